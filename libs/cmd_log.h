@@ -0,0 +1,68 @@
+#ifndef CMD_LOG_H
+#define CMD_LOG_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+/**
+ * Log of every command the server has answered, numbered from 0 in arrival order.
+ *
+ * The newest records live in a fixed ring of record offsets over a fixed byte ring, so appending never
+ * allocates and memory stays the same however long the server runs. When either ring fills up, the oldest
+ * half is written to an append-only data file in one go, next to an index file holding each record's 8 byte
+ * offset in the data file, so any record can be read back with two preads. Records are the same bytes in
+ * memory and on disk: user length (1 byte), command length (2), reason length (1), rejected flag (1), then
+ * user, command and reason.
+ */
+
+// entries and bytes the rings hold, powers of two
+#define CMD_LOG_ENTRIES 4096
+#define CMD_LOG_BYTES (256 * 1024)
+// a longer command is logged cut to this
+#define CMD_LOG_COMMAND_MAX 4096
+
+typedef struct {
+    pthread_mutex_t mutex;
+    // absolute byte offset of each record in memory, by seq % CMD_LOG_ENTRIES
+    uint64_t *starts;
+    char *bytes;
+    // [first, next) are in memory, everything before first is on disk
+    uint64_t first;
+    uint64_t next;
+    uint64_t bytes_end;
+    // spill files, -1 when there are none and spilled records are dropped
+    int data_fd;
+    int index_fd;
+    uint64_t data_len;
+    // [0, disk_end) are in the files, a spilled record past that was lost to a failed write
+    uint64_t disk_end;
+    // index entries for one spill
+    uint64_t *spill_index;
+    char data_path[128];
+    char index_path[136];
+} cmd_log;
+
+typedef struct {
+    const char *user;
+    const char *command;
+    bool rejected;
+    // empty if there is none
+    const char *reason;
+    // the three strings above, NUL terminated
+    char text[256 + CMD_LOG_COMMAND_MAX + 256];
+} cmd_log_record;
+
+// Spill files are path and path.idx, truncated. Returns 0, or -1 if the rings cannot be allocated.
+// Without the files the log keeps only what fits in memory
+int cmd_log_init(cmd_log *log, const char *path);
+// Close, and unlink the spill files if remove is set
+void cmd_log_close(cmd_log *log, bool remove);
+
+void cmd_log_append(cmd_log *log, const char *user, const char *command, int result, const char *reason);
+
+// Records logged so far
+uint64_t cmd_log_count(cmd_log *log);
+// Copy record seq into rec. Returns 0, 1 if there is no such record yet, -1 if it could not be read back
+int cmd_log_get(cmd_log *log, uint64_t seq, cmd_log_record *rec);
+
+#endif // CMD_LOG_H
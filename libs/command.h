@@ -0,0 +1,63 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "markdown.h"
+/**
+ * Parser for the edit commands clients send, one line each.
+ *
+ * The keyword is looked up in a small perfect hash table and its arguments are read according to the shape
+ * its table entry names, so adding a command is one table entry. Parsing works in place on the line and never
+ * allocates: trailing \r\n is cut off and a text argument is left NUL terminated inside the line. Every
+ * rejection is a static string that goes to the client as is. command_apply maps a parsed command onto its
+ * markdown_* call, for live edits and log replay alike. Binary clients send commands already split into
+ * their arguments, command_encode and command_decode are that form.
+ */
+
+typedef enum {
+    CMD_INSERT,
+    CMD_DELETE,
+    CMD_NEWLINE,
+    CMD_HEADING,
+    CMD_BOLD,
+    CMD_ITALIC,
+    CMD_CODE,
+    CMD_BLOCKQUOTE,
+    CMD_ORDERED_LIST,
+    CMD_UNORDERED_LIST,
+    CMD_HORIZONTAL_RULE,
+    CMD_LINK,
+    CMD_COUNT
+} command_op;
+
+typedef struct {
+    command_op op;
+    // in the order they are written: pos, pos len, level pos or start end
+    size_t a;
+    size_t b;
+    // INSERT's text or LINK's url, points into the parsed line
+    const char *text;
+} parsed_command;
+
+// Parse line, which is modified. Returns NULL, or why the command is rejected
+const char *command_parse(char *line, parsed_command *cmd);
+
+// A WIRE_COMMAND frame (see wire.h) for cmd: a, b for the commands that take two numbers, then the text.
+// Returns the frame's size, 0 if it does not fit in size bytes
+size_t command_encode(const parsed_command *cmd, char *buf, size_t size);
+// The body of a WIRE_COMMAND frame into cmd without going through text, and into its text form in line, which
+// cmd->text points into. Returns false if it is not a valid command, line then holds as much of it as makes
+// command_parse reject it for the same reason
+bool command_decode(const char *body, size_t len, char *line, size_t size, parsed_command *cmd);
+
+// Stage the edit on doc against version through its markdown_* call. Returns what that call returned
+int command_apply(document *doc, uint64_t version, const parsed_command *cmd);
+
+// The keyword of op
+const char *command_name(command_op op);
+
+// Reason for a failed markdown_* call, by its return code
+const char *command_result_reason(int result);
+
+#endif // COMMAND_H
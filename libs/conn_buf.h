@@ -0,0 +1,38 @@
+#ifndef CONN_BUF_H
+#define CONN_BUF_H
+#include <stddef.h>
+#include <stdbool.h>
+/**
+ * Growable byte buffer for a client connection, used as its read and write buffer when FIFOs are driven
+ * non-blocking. Bytes live in data[start, start + len), consuming from the front only moves start and the
+ * space is reclaimed by the next append.
+ */
+
+typedef struct {
+    char *data;
+    size_t start;
+    size_t len;
+    size_t cap;
+} conn_buf;
+
+void conn_buf_init(conn_buf *b);
+void conn_buf_free(conn_buf *b);
+
+// Returns 0, or -1 if the buffer could not grow
+int conn_buf_append(conn_buf *b, const void *data, size_t len);
+// Drop the first n buffered bytes
+void conn_buf_consume(conn_buf *b, size_t n);
+
+static inline const char *conn_buf_head(const conn_buf *b) {
+    return b->data + b->start;
+}
+
+// Length of the first line buffered, '\n' included, or 0 while it is incomplete. A line reaching limit bytes
+// is cut there, and at_eof whatever is left counts as the last line
+size_t conn_buf_line(const conn_buf *b, size_t limit, bool at_eof);
+
+// Write as much as a non-blocking fd takes.
+// Returns 0 once the buffer is empty, 1 if the fd would block with bytes left, -1 on a failed write
+int conn_buf_flush_fd(conn_buf *b, int fd);
+
+#endif // CONN_BUF_H
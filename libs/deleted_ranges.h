@@ -0,0 +1,27 @@
+#ifndef DELETED_RANGES_H
+#define DELETED_RANGES_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "document.h"
+/**
+ * Ranges deleted while applying one version's pending edits, used to rebase inserts that were queued into
+ * text that is gone by the time they run. An insert inside a deleted range moves to the start of that range,
+ * and when several queued deletes cover the same position the one queued first wins.
+ *
+ * Internally the ranges are flattened into disjoint spans sorted by line, each remembering where an insert
+ * inside it ends up, so a lookup is a binary search no matter how many deletes a version holds.
+ */
+
+void deleted_ranges_init(deleted_ranges *dr);
+void deleted_ranges_free(deleted_ranges *dr);
+// Forget every range but keep the memory for the next version
+void deleted_ranges_clear(deleted_ranges *dr);
+
+// Record that [pos, pos + len) of ln was deleted. Returns 0, or -1 if the span array could not grow
+int deleted_ranges_add(deleted_ranges *dr, line_node *ln, uint32_t gen, size_t pos, size_t len);
+
+// True if pos of ln lies in a deleted range, *rebased_out gets the position the insert moves to
+bool deleted_ranges_lookup(const deleted_ranges *dr, const line_node *ln, uint32_t gen, size_t pos, size_t *rebased_out);
+
+#endif // DELETED_RANGES_H
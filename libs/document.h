@@ -3,6 +3,9 @@
 #define DOCUMENT_H
 #define _GNU_SOURCE
 #include <pthread.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "pool.h"
 /**
  * This file is the header file for all the document functions. You will be tested on the functions inside markdown.h
  * You are allowed to and encouraged multiple helper functions and data structures, and make your code as modular as possible. 
@@ -20,13 +23,39 @@ typedef enum {
     LINE_HORIZONTAL_RULE,
 } line_type;
 
+// Storage engine for line content, chosen at markdown_init time (see line_store.h)
+typedef enum {
+    STORAGE_LINKED_LIST,
+    STORAGE_PIECE_TABLE,
+} storage_engine;
+
+// A span of the document's append-only add buffer
+typedef struct {
+    size_t start;
+    size_t len;
+} line_piece;
+
 typedef struct line_node {
     char *content;
     size_t length;
+    // piece table engine only, content is NULL then
+    line_piece *pieces;
+    size_t piece_count;
+    size_t piece_cap;
     line_type type;
     int metadata;
+    // bumped every time the node is freed, see edit_op.target_gen
+    uint32_t generation;
+    // equals document.touch_epoch once the line is in the current touched list
+    uint32_t touch_epoch;
     struct line_node *next;
     struct line_node *prev;
+    // order-statistics index over the lines (see line_index.h)
+    struct line_node *idx_left;
+    struct line_node *idx_right;
+    struct line_node *idx_parent;
+    uint32_t idx_prio;
+    size_t idx_weight;
 } line_node;
 
 typedef enum {
@@ -40,6 +69,8 @@ typedef enum {
 typedef struct edit_op {
     edit_type type;
     line_node *target;
+    // target->generation when the op was queued, a mismatch means the line is gone
+    uint32_t target_gen;
     size_t pos;
     char *text;
     size_t len;
@@ -48,6 +79,75 @@ typedef struct edit_op {
     struct edit_op *next;
 } edit_op;
 
+// A line that may have been freed since, valid while ln->generation == gen
+typedef struct {
+    line_node *ln;
+    uint32_t gen;
+} line_handle;
+
+// Flattened copy of the document, patched lazily on the next read after a commit.
+// Bytes [0, keep_prefix) and the last keep_suffix bytes are known to still match the document.
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool valid;
+    bool dirty;
+    size_t keep_prefix;
+    size_t keep_suffix;
+    uint64_t version;
+} flat_cache;
+
+// Part of a range deleted in the current version, inserts that land in [start, end) of ln move to rebase_to
+typedef struct {
+    line_node *ln;
+    uint32_t gen;
+    size_t start;
+    size_t end;
+    size_t rebase_to;
+} deleted_span;
+
+// Disjoint spans sorted by (ln, gen, start), see deleted_ranges.h
+typedef struct {
+    deleted_span *spans;
+    size_t count;
+    size_t cap;
+} deleted_ranges;
+
+// One change a commit made to the flattened text, positions as they were right before it happened
+typedef struct {
+    size_t pos;
+    size_t len;
+    bool insert;
+} flat_edit;
+
+// Everything that turned version `version` into version + 1, in the order it was applied
+typedef struct {
+    uint64_t version;
+    flat_edit *edits;
+    size_t count;
+    size_t cap;
+    bool complete;
+} version_edits;
+
+#define OP_HISTORY_VERSIONS 64
+
+// Ring of the last OP_HISTORY_VERSIONS versions, see op_history.h
+typedef struct {
+    version_edits slots[OP_HISTORY_VERSIONS];
+    uint64_t first_version;
+} op_history;
+
+struct doc_snapshot;
+
+// Latest published snapshot and which bytes of it still match the document (see snapshot.h)
+typedef struct {
+    struct doc_snapshot *latest;
+    bool dirty;
+    size_t keep_prefix;
+    size_t keep_suffix;
+} snapshot_state;
+
 typedef struct {
     // TODO
     line_node *head;
@@ -58,6 +158,25 @@ typedef struct {
     pthread_mutex_t lock;
     edit_op *pending_edits;
     edit_op *pending_edits_tail;
+    line_node *index_root;
+    uint32_t index_seed;
+    storage_engine engine;
+    char *add_buf;
+    size_t add_len;
+    size_t add_cap;
+    obj_pool line_pool;
+    obj_pool op_pool;
+    bump_arena text_arena;
+    // lines whose content changed or that lost a neighbour since the last apply
+    line_handle *touched;
+    size_t touched_count;
+    size_t touched_cap;
+    uint32_t touch_epoch;
+    bool touched_lost;
+    flat_cache flat;
+    snapshot_state snaps;
+    deleted_ranges deleted;
+    op_history history;
 } document;
 
 // Functions from here onwards.
@@ -0,0 +1,42 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+#include <stddef.h>
+#include <sys/types.h>
+#include "snapshot.h"
+/**
+ * Broadcast payload fan-out to FIFO subscribers.
+ *
+ * A payload is a short header followed by the first len bytes of a snapshot. It is copied once into a staging
+ * pipe and tee()d from there into each subscriber's FIFO, so the kernel shares the pipe pages instead of copying
+ * the same bytes out of user space once per client. Anything tee cannot handle (the payload does not fit the
+ * staging pipe, a socket subscriber, a FIFO that filled up half way) goes out with writev instead.
+ */
+
+typedef struct {
+    int rd;
+    int wr;
+    // staged pipe contents are dropped into this
+    int devnull;
+    size_t capacity;
+    // bytes staged, 0 when nothing is
+    size_t len;
+} fanout;
+
+// Returns 0, or -1 with f left unusable (fanout_stage then always fails)
+int fanout_init(fanout *f);
+void fanout_free(fanout *f);
+
+// Put header and snap[0, len) into the staging pipe, growing it if needed.
+// Returns 0, or -1 if the payload does not fit, nothing is staged then
+int fanout_stage(fanout *f, const char *header, size_t header_len, const doc_snapshot *snap, size_t len);
+// Duplicate the staged payload into the pipe fd. Returns how many bytes went in, less than f->len if fd
+// filled up first (fd is then grown for the next payload), or -1 if fd cannot be tee()d into
+ssize_t fanout_tee(fanout *f, int fd);
+// Empty the staging pipe for the next payload
+void fanout_drop(fanout *f);
+
+// The same payload with writev, starting skip bytes into it. Returns how many bytes went out before a
+// non-blocking fd filled up, or -1 on a failed write
+ssize_t fanout_writev(int fd, const char *header, size_t header_len, const doc_snapshot *snap, size_t len, size_t skip);
+
+#endif // FANOUT_H
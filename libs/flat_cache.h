@@ -0,0 +1,25 @@
+#ifndef FLAT_CACHE_H
+#define FLAT_CACHE_H
+#include <stddef.h>
+#include "document.h"
+/**
+ * Cached flattened copy of a document (doc->flat), served by markdown_flatten and markdown_flatten_borrow.
+ *
+ * Every apply of pending edits reports how many leading and trailing bytes of the flattened text it left
+ * alone. Those ranges are folded together until the next read, which then only moves the untouched suffix
+ * and re-renders the bytes in between instead of rebuilding the whole string.
+ */
+
+void flat_cache_init(flat_cache *fc);
+void flat_cache_free(flat_cache *fc);
+
+// An apply kept the first keep_prefix and the last keep_suffix bytes of the flattened document
+void flat_cache_note_change(flat_cache *fc, size_t keep_prefix, size_t keep_suffix);
+
+// Copy the flattened bytes [from, from + len) of doc into out, the range has to lie inside the document
+void flat_cache_copy_range(const document *doc, size_t from, size_t len, char *out);
+
+// Bring doc->flat up to date, caller holds doc->lock. Returns 0, or -1 if the buffer could not grow
+int flat_cache_refresh(document *doc);
+
+#endif // FLAT_CACHE_H
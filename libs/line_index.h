@@ -0,0 +1,32 @@
+#ifndef LINE_INDEX_H
+#define LINE_INDEX_H
+#include <stddef.h>
+#include "document.h"
+/**
+ * Order-statistics index over the line list of a document. It is an implicit treap threaded through the
+ * line_nodes themselves, where every node caches the weight (length + 1 for the separating newline) of its
+ * subtree. This turns cursor to line resolution into an O(log n) descent instead of a walk from doc->head.
+ *
+ * The linked list (head/tail/next/prev) stays the source of truth for ordering, the index has to be told about
+ * every line that is linked, unlinked or changes length.
+ */
+
+void line_index_init(document *doc);
+
+// Link ln into the index right after prev (NULL means at the front)
+void line_index_insert_after(document *doc, line_node *prev, line_node *ln);
+void line_index_remove(document *doc, line_node *ln);
+
+// Call after ln->length changed
+void line_index_update(line_node *ln);
+
+// Return the line holding global_pos and the offset inside it, NULL if global_pos is past the end
+line_node *line_index_find(const document *doc, size_t global_pos, size_t *offset_in_line_out);
+
+// Global position of the first character of ln
+size_t line_index_offset_of(const line_node *ln);
+
+// Length of the flattened document, lines joined by '\n'
+size_t line_index_flat_length(const document *doc);
+
+#endif // LINE_INDEX_H
@@ -0,0 +1,47 @@
+#ifndef LINE_STORE_H
+#define LINE_STORE_H
+#include <stdio.h>
+#include "document.h"
+/**
+ * Content storage for a single line, dispatched on doc->engine.
+ *
+ * STORAGE_LINKED_LIST keeps one malloc'd, NUL terminated buffer per line in ln->content and rebuilds it on
+ * every edit. STORAGE_PIECE_TABLE appends inserted text to the document's append-only add buffer and keeps a
+ * small array of pieces per line, so inserts and deletes only splice piece descriptors.
+ *
+ * Every function keeps ln->length in sync. Linking, total_length and the line index stay with the caller.
+ * Functions returning int give 0 on success and -1 when an allocation failed, leaving the line untouched.
+ */
+
+// One insert of a batch, pos is taken against the line as left by the entries before it
+typedef struct {
+    size_t pos;
+    const char *text;
+    size_t len;
+} line_insert;
+
+#define LINE_INSERT_BATCH_MAX 32
+
+void line_store_free_engine(document *doc);
+
+// Give a fresh (unlinked) line its initial content
+int line_store_init(document *doc, line_node *ln, const char *text, size_t len);
+void line_store_release(document *doc, line_node *ln);
+
+int line_store_insert(document *doc, line_node *ln, size_t pos, const char *text, size_t len);
+// Same result as calling line_store_insert for every entry in order (entries past the end of the line at
+// that point are skipped), but the line is rebuilt once. count is at most LINE_INSERT_BATCH_MAX.
+// *inserted_out gets the number of bytes added
+int line_store_insert_batch(document *doc, line_node *ln, const line_insert *ins, size_t count, size_t *inserted_out);
+int line_store_erase(document *doc, line_node *ln, size_t pos, size_t len);
+
+// Move everything from pos onwards into tail, which must be freshly initialised and empty
+int line_store_split(document *doc, line_node *ln, size_t pos, line_node *tail);
+// Append the content of src to dst, src is left as is
+int line_store_append(document *doc, line_node *dst, const line_node *src);
+
+char line_store_char_at(const document *doc, const line_node *ln, size_t i);
+void line_store_copy(const document *doc, const line_node *ln, size_t from, size_t len, char *out);
+void line_store_write(const document *doc, const line_node *ln, FILE *stream);
+
+#endif // LINE_STORE_H
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include "document.h"  
+#include "snapshot.h"
 /**
  * The given file contains all the functions you will be required to complete. You are free to and encouraged to create
  * more helper functions to help assist you when creating the document. For the automated marking you can expect unit tests
@@ -14,6 +15,8 @@
 
 // Initialize and free a document
 document * markdown_init(void);
+// Same as markdown_init, but with an explicit content storage engine (markdown_init uses STORAGE_LINKED_LIST)
+document * markdown_init_with_engine(storage_engine engine);
 void markdown_free(document *doc);
 
 // === Edit Commands ===
@@ -35,9 +38,46 @@ int markdown_link(document *doc, uint64_t version, size_t start, size_t end, con
 // === Utilities ===
 void markdown_print(const document *doc, FILE *stream);
 char *markdown_flatten(const document *doc);
+// Read-only view of the cached flattened document, NUL terminated. No copy is made, the pointer stays valid
+// until the next markdown_flatten / markdown_flatten_borrow call or markdown_free, so callers racing with
+// other readers have to serialise those calls themselves.
+const char *markdown_flatten_borrow(document *doc, size_t *len_out);
+// Immutable view of the last committed version that can be read without holding any lock.
+// Drop it with snapshot_release, NULL if out of memory
+doc_snapshot *markdown_snapshot(document *doc);
 
 // === Versioning ===
 void markdown_increment_version(document *doc);
 void markdown_commit(document *doc);
 
+// === Persistence ===
+// What the flattened text does not tell about a line: where it ends (it may hold '\n' itself), and its type
+// and metadata
+typedef struct {
+    size_t length;
+    line_type type;
+    int metadata;
+} line_shape;
+
+// Shape of every line of the committed document, in order. Together with the flattened text that is the
+// whole document. Caller frees, NULL if out of memory
+line_shape *markdown_line_shapes(document *doc, size_t *count_out);
+// A document made of the given lines of text, each followed by one separator byte, committed as version.
+// Edits made against older versions cannot be rebased onto it. NULL if out of memory
+document *markdown_load(const char *text, const line_shape *lines, size_t line_count, uint64_t version);
+
+// === Allocation counters ===
+// For each allocator, requests is what the edit path asked for and mallocs what actually reached malloc,
+// the difference is the number of allocations the per-document pools avoided.
+typedef struct {
+    size_t line_requests;
+    size_t line_mallocs;
+    size_t op_requests;
+    size_t op_mallocs;
+    size_t text_requests;
+    size_t text_mallocs;
+} markdown_alloc_stats;
+
+void markdown_get_alloc_stats(const document *doc, markdown_alloc_stats *out);
+
 #endif // MARKDOWN_H
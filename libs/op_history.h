@@ -0,0 +1,35 @@
+#ifndef OP_HISTORY_H
+#define OP_HISTORY_H
+#include <stddef.h>
+#include <stdint.h>
+#include "document.h"
+/**
+ * Bounded history of what each committed version did to the flattened document, used to rebase an edit that
+ * was made against an older version onto the current one instead of rejecting it.
+ *
+ * Every applied change is logged as an insert or delete of a byte range (a line split inserts one '\n', a
+ * merge or a compacted line deletes one). A position from version v is carried through the logs of v, v + 1,
+ * ... up to the current version. Only the last OP_HISTORY_VERSIONS - 1 versions can be rebased from.
+ */
+
+typedef enum {
+    // text inserted exactly at the position ends up before it (insert points, range starts)
+    REBASE_STICK_AFTER,
+    // text inserted exactly at the position ends up after it (range ends)
+    REBASE_STICK_BEFORE
+} rebase_side;
+
+void op_history_init(op_history *h, uint64_t version);
+void op_history_free(op_history *h);
+
+// version just became current, its log starts out empty
+void op_history_begin(op_history *h, uint64_t version);
+// Log a change made while applying edits of version. A failed allocation marks that version as not rebasable
+void op_history_record(op_history *h, uint64_t version, bool insert, size_t pos, size_t len);
+
+// Move *pos from version from onto version to.
+// Returns 0, 1 if the position was inside text deleted since (it then sits where that text was), or -1 if
+// the history needed is gone
+int op_history_rebase(const op_history *h, uint64_t from, uint64_t to, size_t *pos, rebase_side side);
+
+#endif // OP_HISTORY_H
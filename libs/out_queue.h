@@ -0,0 +1,49 @@
+#ifndef OUT_QUEUE_H
+#define OUT_QUEUE_H
+#include <stddef.h>
+#include <stdint.h>
+#include "conn_buf.h"
+/**
+ * Output queue of one client: a conn_buf that also remembers where each queued message ends, so a backlog can
+ * be thrown away without cutting a message in half.
+ *
+ * Offsets are absolute, counted over every byte ever queued. written only moves forward as bytes leave, the
+ * message in front started at head_start and may be partly written.
+ */
+
+typedef struct {
+    conn_buf buf;
+    // ring of message end offsets, oldest first
+    uint64_t *ends;
+    size_t ends_start;
+    size_t ends_len;
+    size_t ends_cap;
+    uint64_t queued;
+    uint64_t written;
+    uint64_t head_start;
+    // open message, its end is recorded by out_queue_end_message
+    uint64_t open_start;
+} out_queue;
+
+void out_queue_init(out_queue *q);
+void out_queue_free(out_queue *q);
+
+static inline size_t out_queue_len(const out_queue *q) {
+    return q->buf.len;
+}
+
+// Returns 0, or -1 if the queue could not grow
+int out_queue_append(out_queue *q, const void *data, size_t len);
+// Everything appended since the last call is one message. Returns 0, or -1 if it could not be recorded
+int out_queue_end_message(out_queue *q);
+// n bytes from the front left
+void out_queue_consume(out_queue *q, size_t n);
+// Write as much as a non-blocking fd takes. Same returns as conn_buf_flush_fd
+int out_queue_flush_fd(out_queue *q, int fd);
+// Drop every complete message nothing of which was written yet, a partly written one stays.
+// Returns how many bytes went
+size_t out_queue_drop_unsent(out_queue *q);
+// Drop everything, the queue is reset
+void out_queue_clear(out_queue *q);
+
+#endif // OUT_QUEUE_H
@@ -0,0 +1,53 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stddef.h>
+/**
+ * Per-document allocators for the edit hot path.
+ *
+ * obj_pool hands out fixed size objects carved from slabs. Freed objects go on a free list and are reused, slabs
+ * are only returned to malloc when the pool is destroyed, so a pointer into a pool stays dereferenceable for the
+ * lifetime of the document even after the object was freed.
+ *
+ * bump_arena hands out variable sized buffers that are all released at once by arena_reset.
+ *
+ * Both count how many objects they handed out and how many of those actually had to go to malloc.
+ */
+
+typedef struct pool_slab {
+    struct pool_slab *next;
+} pool_slab;
+
+typedef struct {
+    size_t obj_size;
+    size_t per_slab;
+    void *free_list;
+    pool_slab *slabs;
+    size_t requests;
+    size_t mallocs;
+} obj_pool;
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+} arena_block;
+
+typedef struct {
+    arena_block *blocks;
+    size_t requests;
+    size_t mallocs;
+} bump_arena;
+
+void obj_pool_init(obj_pool *pool, size_t obj_size, size_t per_slab);
+void *obj_pool_alloc(obj_pool *pool);
+void obj_pool_free(obj_pool *pool, void *obj);
+void obj_pool_destroy(obj_pool *pool);
+
+void arena_init(bump_arena *arena);
+// Copy len bytes into the arena and NUL terminate them
+char *arena_strndup(bump_arena *arena, const char *s, size_t len);
+// Forget every allocation, keeps one block big enough for what was used so far
+void arena_reset(bump_arena *arena);
+void arena_destroy(bump_arena *arena);
+
+#endif // POOL_H
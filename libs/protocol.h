@@ -0,0 +1,18 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+/**
+ * Names the server and its clients agree on, all relative to the server's working directory and formatted
+ * with a pid.
+ *
+ * A client either connects to the server's AF_UNIX stream socket, or asks for a pair of FIFOs with SIGRTMIN
+ * and opens them once the server answers with SIGRTMIN + 1. The same protocol runs over both, text lines
+ * until a client sends BINARY ON and frames after it (see wire.h).
+ */
+
+// listening socket, formatted with the server pid
+#define SERVER_SOCKET_FMT "SOCK_%d"
+// per client FIFOs, formatted with the client pid
+#define CLIENT_FIFO_C2S_FMT "FIFO_C2S_%d"
+#define CLIENT_FIFO_S2C_FMT "FIFO_S2C_%d"
+
+#endif // PROTOCOL_H
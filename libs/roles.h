@@ -0,0 +1,40 @@
+#ifndef ROLES_H
+#define ROLES_H
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+/**
+ * The users of roles.txt and their roles, held in memory.
+ *
+ * The file is parsed once into an open addressing hash table, so a lookup costs the same for ten users or
+ * tens of thousands. A thread watches the file's directory with inotify and, whenever roles.txt is written or
+ * renamed into place, builds a new table and swaps it in with one atomic store. Lookups never wait: a reader
+ * registers itself under the current epoch and reads whichever table it finds, and the reload thread flips
+ * the epoch after the swap and only frees the old table once every reader of the old epoch is done.
+ */
+
+// longest role a lookup hands back, including the NUL
+#define ROLE_MAX 32
+
+typedef struct role_table role_table;
+
+typedef struct {
+    _Atomic(role_table *) current;
+    atomic_uint epoch;
+    // readers inside a lookup, by the parity of the epoch they entered under
+    atomic_uint readers[2];
+    char path[256];
+    int inotify_fd;
+    pthread_t watcher;
+} role_store;
+
+// Load path and start watching it. A missing file is an empty table until it shows up.
+// Returns 0, -1 if it cannot be watched (the table loaded now is kept for good then),
+// or -2 if no table could be allocated at all, rs must not be used then
+int role_store_open(role_store *rs, const char *path);
+
+// Copy the role of user into role, cut to size. False if user has none
+bool role_store_lookup(role_store *rs, const char *user, char *role, size_t size);
+
+#endif // ROLES_H
@@ -0,0 +1,63 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+/**
+ * Shared memory transport for a client on the same host as the server.
+ *
+ * The client maps one memfd holding two single producer / single consumer byte rings, client to server and
+ * server to client, and passes it together with two eventfds to the server over the socket it connected on.
+ * The text protocol then runs over the rings unchanged.
+ *
+ * Copying in and out of a ring is plain memory traffic. A side only goes through its eventfd when it is about
+ * to sleep: it parks first (sets a flag in the ring it waits on), checks the ring once more and then waits for
+ * the eventfd, and whoever moves the ring along next sees the flag and writes that eventfd. Each side owns one
+ * eventfd, which means "input arrived or output space freed up".
+ */
+
+#define SHM_RING_CAPACITY (64 * 1024)
+
+typedef struct {
+    // total bytes ever written, only the producer stores it
+    _Alignas(64) atomic_uint_fast64_t head;
+    // total bytes ever read, only the consumer stores it
+    _Alignas(64) atomic_uint_fast64_t tail;
+    _Alignas(64) atomic_uint consumer_parked;
+    atomic_uint producer_parked;
+    uint32_t capacity;
+    _Alignas(64) char data[SHM_RING_CAPACITY];
+} shm_ring;
+
+typedef struct {
+    shm_ring *rx;
+    shm_ring *tx;
+    // written by the peer to wake this side, and the one this side writes to wake the peer
+    int efd_local;
+    int efd_peer;
+    void *map;
+    size_t map_len;
+} shm_channel;
+
+// Client side: a fresh memfd with both rings and the two eventfds. The server needs *memfd_out, ch->efd_peer
+// and ch->efd_local, the memfd can be closed once sent. Returns 0, or -1 with nothing left open
+int shm_channel_create(shm_channel *ch, int *memfd_out);
+// Server side: map a client's memfd, takes ownership of the eventfds. Returns 0, or -1 if the memfd does not
+// hold a channel (the caller still owns the fds then)
+int shm_channel_attach(shm_channel *ch, int memfd, int efd_server, int efd_client);
+void shm_channel_close(shm_channel *ch);
+
+// Copy up to len bytes in or out, without blocking. Returns how many bytes moved, and wakes the peer if it
+// is parked on what this changed
+size_t shm_channel_write(shm_channel *ch, const void *data, size_t len);
+size_t shm_channel_read(shm_channel *ch, void *buf, size_t len);
+
+// Announce that this side is about to wait for input (or output space). Returns false if there already is
+// some, the caller then must not wait
+bool shm_channel_park_reader(shm_channel *ch);
+bool shm_channel_park_writer(shm_channel *ch);
+// Back from waiting: clear both flags and reset the eventfd
+void shm_channel_unpark(shm_channel *ch);
+
+#endif // SHM_RING_H
@@ -0,0 +1,61 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include "document.h"
+/**
+ * Immutable, reference counted views of a committed document version.
+ *
+ * A snapshot is the flattened document cut into chunks of at most SNAPSHOT_CHUNK_SIZE bytes. Chunks are
+ * reference counted on their own, so the next snapshot reuses every chunk that lies entirely inside the bytes
+ * the commits since then left alone and only renders the chunks around the edits. Once taken, a snapshot can
+ * be read and written out without any lock, while the document keeps changing underneath.
+ */
+
+#define SNAPSHOT_CHUNK_SIZE (16 * 1024)
+
+typedef struct {
+    atomic_size_t refs;
+    size_t len;
+    char data[];
+} snapshot_chunk;
+
+typedef struct doc_snapshot {
+    atomic_size_t refs;
+    uint64_t version;
+    size_t total_length;
+    // length of the flattened text, lines joined by '\n'
+    size_t flat_len;
+    size_t chunk_count;
+    snapshot_chunk **chunks;
+} doc_snapshot;
+
+void snapshot_state_init(snapshot_state *st);
+// Drops the reference the document holds on its latest snapshot, readers keep theirs
+void snapshot_state_free(snapshot_state *st);
+
+// An apply kept the first keep_prefix and the last keep_suffix bytes of the flattened document
+void snapshot_note_change(snapshot_state *st, size_t keep_prefix, size_t keep_suffix);
+
+// Snapshot of the current committed state with one reference for the caller, caller holds doc->lock.
+// NULL if out of memory
+doc_snapshot *snapshot_take(document *doc);
+void snapshot_release(doc_snapshot *snap);
+
+// Write the first len bytes of the flattened text. Returns 0, or -1 on a failed write
+int snapshot_write_fd(const doc_snapshot *snap, int fd, size_t len);
+int snapshot_write_file(const doc_snapshot *snap, FILE *stream, size_t len);
+// Hand len bytes of the flattened text starting at from to fn piece by piece, in order.
+// Returns 0, or the first nonzero value fn returned
+int snapshot_for_each(const doc_snapshot *snap, size_t from, size_t len,
+                      int (*fn)(void *ctx, const char *data, size_t len), void *ctx);
+
+// Compare the first from_len bytes of from with the first to_len bytes of to. *prefix_out and *suffix_out get
+// the length of their common prefix and suffix, which never overlap. Chunks both snapshots share are skipped
+// without looking at them, so the cost is in the bytes that were rendered anew
+void snapshot_diff(const doc_snapshot *from, size_t from_len, const doc_snapshot *to, size_t to_len,
+                   size_t *prefix_out, size_t *suffix_out);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,44 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+/**
+ * Histograms of latencies and sizes, recorded from any thread without a lock.
+ *
+ * Buckets are laid out the way HdrHistogram does it: values below 2^STATS_SUB_BITS get a bucket each, and
+ * every power of two above that is split into 2^STATS_SUB_BITS equal buckets, so a percentile is off by at most
+ * 1/32 of its value whatever its magnitude. Recording is a handful of relaxed atomic adds, and reading takes
+ * the counts as they are at that moment, which can be a few records apart between buckets.
+ */
+
+// bits of a value kept below its highest set bit, and the highest value told apart (larger ones count as it)
+#define STATS_SUB_BITS 5
+#define STATS_MAX_BITS 40
+#define STATS_MAX_VALUE ((UINT64_C(1) << STATS_MAX_BITS) - 1)
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+// zeroed is empty, a static one needs no initialisation
+typedef struct {
+    atomic_uint_fast64_t counts[STATS_BUCKETS];
+    atomic_uint_fast64_t total;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+} stats_hist;
+
+// CLOCK_MONOTONIC in nanoseconds
+uint64_t stats_now(void);
+
+void stats_record(stats_hist *h, uint64_t value);
+// stats_record(h, stats_now() - since), returns the time it took
+uint64_t stats_record_since(stats_hist *h, uint64_t since);
+
+// The smallest value at least q (0 to 1) of the records are at or below, rounded up to its bucket's top.
+// 0 for an empty histogram
+uint64_t stats_percentile(stats_hist *h, double q);
+
+// One line: name, count, mean, p50, p99, p999 and max. Nothing for an empty histogram
+void stats_print(FILE *out, const char *name, stats_hist *h);
+
+#endif // STATS_H
@@ -0,0 +1,90 @@
+#ifndef WAL_H
+#define WAL_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "markdown.h"
+#include "conn_buf.h"
+/**
+ * Write-ahead log and snapshots of the document, so a restart picks up at the last committed version.
+ *
+ * Every command handed to markdown is staged, failed ones too since they may have queued part of their
+ * edit, and each markdown_commit seals what was staged as the record of the version it made: payload length,
+ * CRC32, version, command count and the command lines (host byte order). Records are buffered and a writer
+ * thread appends and fdatasyncs them, so all the commits that arrive during one fsync share the next one.
+ * An edit is answered only after wal_flush has covered its record.
+ *
+ * Every WAL_CHECKPOINT_VERSIONS versions, or once the log holds WAL_CHECKPOINT_BYTES, the log is cut: the
+ * records so far go to <log>.old, the document of the cut is written to the snapshot file (temporary file,
+ * fsync, rename) and <log>.old is removed. Recovery loads the snapshot and replays the records after it from
+ * <log>.old and <log>, stopping at the first torn record, then cuts again so the next start only has to read
+ * the snapshot. Only a torn last record is cut off: if a damaged record has more after it, or a record does
+ * not follow on from the version before it, recovery refuses to write over the files.
+ *
+ * A write or fsync that fails stops the log: the file is cut back to where it ended before that group, so
+ * no torn record is left for recovery to stop at, nothing sealed from then on becomes durable and wal_flush
+ * says so.
+ */
+
+#ifndef WAL_CHECKPOINT_VERSIONS
+#define WAL_CHECKPOINT_VERSIONS 10000
+#endif
+#ifndef WAL_CHECKPOINT_BYTES
+#define WAL_CHECKPOINT_BYTES (16 * 1024 * 1024)
+#endif
+
+typedef struct {
+    pthread_mutex_t mutex;
+    // the writer waits on work, wal_flush on done
+    pthread_cond_t work;
+    pthread_cond_t done;
+    // false without a log file, everything is a no-op then
+    bool enabled;
+    bool stop;
+    // a write failed, durable stays where it was from then on
+    bool failed;
+    // commands staged since the last commit, each a 2 byte length and the line
+    conn_buf staged;
+    uint32_t staged_count;
+    // a command could not be staged, the commit cannot be logged as it was made
+    bool staged_lost;
+    // sealed records the writer has not taken yet
+    conn_buf pending;
+    // records sealed, and written and synced, counted from the start of this run
+    uint64_t sealed;
+    uint64_t durable;
+    // a cut at pending offset cut_at, the snapshot and line shapes are of the last version before it
+    doc_snapshot *cut;
+    line_shape *cut_lines;
+    size_t cut_line_count;
+    size_t cut_at;
+    uint64_t cut_version;
+    uint64_t log_bytes;
+    int fd;
+    pthread_t writer;
+    uint64_t fsyncs;
+    char path[128];
+    char old_path[136];
+    char snap_path[128];
+    char snap_tmp_path[136];
+} wal;
+
+// Recover the document from snap_path and log_path into *doc (an empty one if there is nothing to recover)
+// and start logging. Returns 0, or -1 if the log cannot be written, *doc is still set then, or with *doc NULL if
+// committed versions are missing from the files or memory ran out
+int wal_open(wal *w, const char *log_path, const char *snap_path, document **doc);
+
+// Both with the document's writers locked out: command is about to be handed to markdown, and
+// markdown_commit just made doc's current version
+void wal_stage(wal *w, const char *command);
+void wal_commit(wal *w, document *doc);
+
+// Wait until every record sealed so far is on disk. Returns 0, or -1 if the log failed before they got there
+int wal_flush(wal *w);
+// The log stopped after a failed write, nothing committed from now on will survive a restart
+bool wal_failed(wal *w);
+// Cut at doc's current version, wait for the writer to finish and stop logging
+void wal_close(wal *w, document *doc);
+
+#endif // WAL_H
@@ -0,0 +1,55 @@
+#ifndef WIRE_H
+#define WIRE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+/**
+ * Binary framing a client can switch its connection to by sending BINARY ON after the initial sync. The
+ * answer (SUCCESS) is the last text the server sends, and everything after the BINARY ON line is frames in
+ * both directions. Binary clients always get deltas.
+ *
+ * A frame is its length as a LEB128 varint, then that many bytes: an opcode and its payload. Integers in a
+ * payload are LEB128 varints, and a trailing string or document text is the rest of the frame, so nothing is
+ * escaped or searched for and a frame is taken in one piece once its length is known.
+ *
+ * Client to server:
+ *   WIRE_LINE         a command in text form, answered as if it came as a line
+ *   WIRE_DISCONNECT
+ *   WIRE_COMMAND + op an edit, see command_encode
+ * Server to client:
+ *   WIRE_OK           the answer SUCCESS
+ *   WIRE_REJECT       reason
+ *   WIRE_SYNC         version, then the whole document
+ *   WIRE_DELTA        base version, version, pos, deleted, then the inserted bytes
+ *   WIRE_EDITS        a batch's EDIT lines as in the text protocol
+ */
+
+// longest LEB128 varint of a 64 bit value, and longest frame header
+#define WIRE_VARINT_MAX 10
+#define WIRE_HEADER_MAX (WIRE_VARINT_MAX + 1)
+
+typedef enum {
+    WIRE_LINE = 0x01,
+    WIRE_DISCONNECT = 0x02,
+    // plus command_op, whose order is part of the protocol
+    WIRE_COMMAND = 0x10,
+    WIRE_OK = 0x80,
+    WIRE_REJECT = 0x81,
+    WIRE_SYNC = 0x82,
+    WIRE_DELTA = 0x83,
+    WIRE_EDITS = 0x84
+} wire_op;
+
+// LEB128, also what wal.c writes snapshot line shapes in. Returns the bytes written, at most WIRE_VARINT_MAX
+size_t wire_put_varint(char *buf, uint64_t v);
+// The varint at *p, which is moved past it. False if it runs past end or does not fit 64 bits
+bool wire_get_varint(const char **p, const char *end, uint64_t *out);
+
+// Length and opcode of a frame with payload_len bytes after the opcode. Returns the bytes written, at most
+// WIRE_HEADER_MAX
+size_t wire_frame_header(char *buf, wire_op op, uint64_t payload_len);
+// The first frame in data[0, len): *body gets its opcode and payload, *body_len their length (at least 1).
+// Returns the whole frame's size, 0 while it is incomplete, (size_t)-1 if it is empty or longer than limit
+size_t wire_frame(const char *data, size_t len, size_t limit, const char **body, size_t *body_len);
+
+#endif // WIRE_H
@@ -7,14 +7,82 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include "../libs/protocol.h"
+#include "../libs/shm_ring.h"
+#include "../libs/wire.h"
+#include "../libs/command.h"
+#include "../libs/conn_buf.h"
+
+// longest command line taken from stdin, and how much of it is read at once
+#define COMMAND_INPUT_MAX 1024
+#define STDIN_CHUNK (16 * 1024)
+// how much of the server's frames is read at once
+#define FRAME_CHUNK (64 * 1024)
+
+// how often an empty ring is checked again before sleeping on the eventfd, when there is a second CPU the
+// server could be answering on
+#define SHM_SPIN_ROUNDS 2000
+
+typedef enum {
+    SHM_OFF,
+    // rings sent with the username, the server's first answer tells whether it took them
+    SHM_OFFERED,
+    SHM_ON
+} shm_mode;
+
+static shm_mode shm_state = SHM_OFF;
+static shm_channel shm;
+static int shm_spin_rounds = 0;
+
+// the document as of the last sync or broadcast, deltas are applied to it
+static struct {
+    char *text;
+    size_t len;
+    unsigned long long version;
+} local_doc;
+// the SUCCESS answering DELTA ON is not for the user
+static bool delta_ack_pending = false;
+// the server took BINARY ON, both directions are frames (wire.h) and rx holds what came of them so far
+static bool binary = false;
+static conn_buf rx;
 
 ssize_t read_line(int fd, char *buf, size_t maxlen);
 void print_bytes(int fd, int count);
 void process_line(const char *line);
+int read_exact(int fd, char *buf, size_t len);
+int read_document(int fd, bool framed);
+int read_delta(int fd, const char *header);
+void set_document(char *text, size_t len, unsigned long long version);
+int apply_delta(unsigned long long base, unsigned long long version, size_t pos, size_t deleted, const char *ins, size_t inserted);
+void process_server_line(int fd, const char *line);
+int negotiate_binary(int fd_c2s, int fd_s2c);
+ssize_t read_frames(int fd);
+void process_frame(const char *body, size_t len);
+size_t encode_command(const char *cmd, size_t len, char *out);
+int connect_socket(int server_pid);
+int connect_fifos(int server_pid, int *fd_c2s, int *fd_s2c);
+void close_channel(int fd_c2s, int fd_s2c);
+int offer_shm(int sock, const char *username);
+ssize_t server_read(int fd, void *buf, size_t len);
+ssize_t server_write(int fd, const void *buf, size_t len);
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        printf("Usage: %s <server_pid> <username>\n", argv[0]);
+    bool want_shm = false;
+    bool want_binary = false;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "shm") == 0) {
+            want_shm = true;
+        } else if (strcmp(argv[i], "binary") == 0) {
+            want_binary = true;
+        } else {
+            argc = 0;
+        }
+    }
+    if (argc < 3) {
+        printf("Usage: %s <server_pid> <username> [shm] [binary]\n", argv[0]);
         return 1;
     }
 
@@ -25,49 +93,30 @@ int main(int argc, char *argv[]) {
     }
     char *username = argv[2];
 
-    // block SIGRTMIN + 1
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGRTMIN + 1);
-    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
-        perror("sigprocmask");
-        exit(1);
-    }
-
-    // send sigrtmin to server
-    if (kill(server_pid, SIGRTMIN) < 0) {
-        perror("kill(SIGRTMIN)");
-        exit(1);
-    }
-
-    // wait sigrtmin + 1
-    int sig;
-    if (sigwait(&mask, &sig) != 0) {
-        fprintf(stderr, "sigwait failed\n");
-        return EXIT_FAILURE;
-    }
-
-    // create fifos path
-    char fifo_c2s[256];
-    char fifo_s2c[256];
-    snprintf(fifo_c2s, sizeof(fifo_c2s), "FIFO_C2S_%d", getpid());
-    snprintf(fifo_s2c, sizeof(fifo_s2c), "FIFO_S2C_%d", getpid());
-
-    // open fifos
-    int fd_c2s = open(fifo_c2s, O_WRONLY);
-    int fd_s2c = open(fifo_s2c, O_RDONLY);
-    if (fd_c2s == -1 || fd_s2c == -1) {
-        perror("error open fifos");
-        printf("FIFO_C2S: %s, FIFO_S2C: %s\n", fifo_c2s, fifo_s2c);
+    // the server's socket when it has one, the signal and FIFO handshake otherwise
+    int fd_c2s, fd_s2c;
+    int sock = connect_socket(server_pid);
+    if (sock != -1) {
+        fd_c2s = sock;
+        fd_s2c = sock;
+    } else if (connect_fifos(server_pid, &fd_c2s, &fd_s2c) < 0) {
         return 1;
     }
 
-    // send username to server
-    if (write(fd_c2s, username, strlen(username)) < 0 ||
+    // send username to server, shared memory can only be offered over the socket
+    if (want_shm && sock == -1) {
+        fprintf(stderr, "No server socket, shared memory transport unavailable\n");
+    }
+    if (want_shm && sock != -1) {
+        if (offer_shm(sock, username) < 0) {
+            perror("offer_shm");
+            close_channel(fd_c2s, fd_s2c);
+            return 1;
+        }
+    } else if (write(fd_c2s, username, strlen(username)) < 0 ||
         write(fd_c2s, "\n", 1) < 0) {
         perror("write(username)");
-        close(fd_c2s);
-        close(fd_s2c);
+        close_channel(fd_c2s, fd_s2c);
         return 1;
     }
 
@@ -76,7 +125,7 @@ int main(int argc, char *argv[]) {
     int idx = 0;
     char ch;
 
-    while ((n = read(fd_s2c, &ch, 1)) == 1
+    while ((n = server_read(fd_s2c, &ch, 1)) == 1
        && ch != '\n'
        && idx < (int)sizeof(linebuf) - 1) {
         linebuf[idx++] = ch;
@@ -85,158 +134,234 @@ int main(int argc, char *argv[]) {
     linebuf[idx] = '\0';
     if (idx == 0) {
         perror("failed to read/rejection from server.\n");
-        close(fd_c2s);
-        close(fd_s2c);
+        close_channel(fd_c2s, fd_s2c);
         return 1;
     }
     //check rejection
     if (strncmp(linebuf, "Reject UNAUTHORISED", 19) == 0) {
         printf("Reject UNAUTHORISED\n");
-        close(fd_c2s);
-        close(fd_s2c);
+        close_channel(fd_c2s, fd_s2c);
         return 1;
     }
     printf("Server response: %s\n", linebuf);
 
-    // get version
-    char versionbuf[32];
-    idx = 0;
-    while ((n = read(fd_s2c, &ch, 1)) == 1 && ch != '\n' && idx < (int)sizeof(versionbuf) - 1) {
-        versionbuf[idx++] = ch;
-    }
-    versionbuf[idx] = '\0';
-    if(idx == 0) {
-        perror("failed to read version from server.\n");
-        close(fd_c2s);
-        close(fd_s2c);
+    // VERSION\n<version>\nDOC\n<length>\n<content>\nEND\n
+    char line[512];
+    if (read_line(fd_s2c, line, sizeof(line)) <= 0 || strcmp(line, "VERSION\n") != 0 ||
+        read_document(fd_s2c, true) < 0) {
+        fprintf(stderr, "failed to read document from server.\n");
+        close_channel(fd_c2s, fd_s2c);
         return 1;
     }
+    printf("Document version: %llu\n", local_doc.version);
+    printf("Document length: %zu\n", local_doc.len);
+    printf("Document content:\n%.*s\n", (int)local_doc.len, local_doc.text);
 
-    // get doc length
-    char lengthbuf[32];
-    idx = 0;
-    while ((n = read(fd_s2c, &ch, 1)) == 1 && ch != '\n' && idx < (int)sizeof(lengthbuf) - 1) {
-        lengthbuf[idx++] = ch;
-    }
-    lengthbuf[idx] = '\0';
-    if(idx == 0) {
-        perror("failed to read length from server.\n");
-        close(fd_c2s);
-        close(fd_s2c);
+    // frames from here on if the server knows them, they always carry deltas
+    int framed = want_binary ? negotiate_binary(fd_c2s, fd_s2c) : 0;
+    if (framed < 0) {
+        fprintf(stderr, "server went away while switching to binary frames.\n");
+        close_channel(fd_c2s, fd_s2c);
         return 1;
     }
-    int doc_length = atoi(lengthbuf);
+    binary = framed == 1;
+    conn_buf_init(&rx);
 
-    // read document content
-    char *doc = malloc(doc_length + 1);
-    if(!doc) {
-        perror("malloc");
-        close(fd_c2s);
-        close(fd_s2c);
+    // later broadcasts only carry what changed
+    if (!binary && server_write(fd_c2s, "DELTA ON\n", 9) != 9) {
+        perror("write(DELTA ON)");
+        close_channel(fd_c2s, fd_s2c);
         return 1;
     }
+    // answered before anything sent after it, the server keeps the order
+    delta_ack_pending = !binary;
+
+    // stdin is read in chunks, every whole command in one goes to the server in a single write
+    char input[STDIN_CHUNK];
+    size_t input_len = 0;
+    bool overlong = false;
+    bool disconnect = false;
 
-    ssize_t total_read = 0;
-    while (total_read < doc_length && 
-        (n = read(fd_s2c, doc + total_read, doc_length - total_read)) > 0) {
-        total_read += n;
-    }
-    doc[total_read] = '\0';
-    printf("Document version: %s\n", versionbuf);
-    printf("Document length: %s\n", lengthbuf);
-    printf("Document content:\n%s\n", doc);
-    free(doc);
-    
     fd_set read_fds;
     int maxfd = (fd_s2c > STDIN_FILENO ? fd_s2c : STDIN_FILENO);
-    bool skip_first_broadcast = true;
-    char line[512];
 
     // main loop
+    if (shm_state == SHM_ON && shm.efd_local > maxfd) maxfd = shm.efd_local;
     while (1) {
         FD_ZERO(&read_fds);
         FD_SET(fd_s2c, &read_fds);
         FD_SET(STDIN_FILENO, &read_fds);
 
-        int ready = select(maxfd + 1, &read_fds, NULL, NULL, NULL);
-        if (ready < 0) {
-            perror("select");
-            break;
-        }
-        
-        // broadcast from server
-        if (FD_ISSET(fd_s2c, &read_fds)) {
-            // Process server broadcast
-            if (read_line(fd_s2c, line, sizeof(line)) <= 0) 
-                continue;
-            if (strncmp(line, "VERSION", 7) != 0) 
-                continue;
-
-            // Check first broadcast
-            if (skip_first_broadcast) {
-                skip_first_broadcast = false;
-                
-                // Read peek line
-                if (read_line(fd_s2c, line, sizeof(line)) > 0) {
-                    if (strncmp(line, "DOC", 3) == 0) {
-                        // Skip document broadcast
-                        while (read_line(fd_s2c, line, sizeof(line)) > 0
-                            && strcmp(line, "END\n") != 0) {
-                            ;
-                        }
-                        continue;
-                    } else {
-
-                    }
-                }
+        // the ring can hold more than what was read so far, only sleep when it is empty
+        bool server_ready = false;
+        if (shm_state == SHM_ON) {
+            if (shm_channel_park_reader(&shm)) {
+                FD_SET(shm.efd_local, &read_fds);
+            } else {
+                server_ready = true;
+                FD_ZERO(&read_fds);
             }
+        }
 
-            if (!skip_first_broadcast && strncmp(line, "END\n", 4) != 0) {
-                process_line(line);
+        if (!server_ready) {
+            int ready = select(maxfd + 1, &read_fds, NULL, NULL, NULL);
+            if (ready < 0) {
+                perror("select");
+                break;
             }
-            
-            // Continue reading until END
-            while (read_line(fd_s2c, line, sizeof(line)) > 0) {
-                if (strcmp(line, "END\n") == 0)
+        }
+        if (shm_state == SHM_ON) {
+            shm_channel_unpark(&shm);
+            server_ready = server_ready || FD_ISSET(shm.efd_local, &read_fds);
+        }
+        
+        // broadcast from server
+        if (server_ready || FD_ISSET(fd_s2c, &read_fds)) {
+            if (binary) {
+                if (read_frames(fd_s2c) <= 0) break;
+            } else {
+                if (read_line(fd_s2c, line, sizeof(line)) <= 0) 
                     break;
-                process_line(line);
+                process_server_line(fd_s2c, line);
             }
         }
         if (FD_ISSET(STDIN_FILENO, &read_fds)) {
-            // client give command
-            char cmd[1024];
-            if (!fgets(cmd, sizeof(cmd), stdin)) {
+            // client give commands, as many as arrived
+            ssize_t n = read(STDIN_FILENO, input + input_len, sizeof(input) - input_len);
+            if (n <= 0) {
                 break;
             }
-            size_t len = strlen(cmd);
-            if (len == 0 || cmd[len - 1] != '\n') {
-                int c;
-                while ((c = getchar()) != '\n' && c != EOF) {}
+            input_len += (size_t)n;
+
+            char batch[STDIN_CHUNK];
+            size_t batch_len = 0;
+            size_t start = 0;
+            char *nl;
+            while (!disconnect && (nl = memchr(input + start, '\n', input_len - start))) {
+                const char *cmd = input + start;
+                size_t len = (size_t)(nl - cmd) + 1;
+                start += len;
+                if (overlong) {
+                    // the tail of a command that did not fit
+                    overlong = false;
+                    continue;
+                }
+                // answered from the local copy
+                if (len == 5 && memcmp(cmd, "DOC?\n", 5) == 0) {
+                    printf("Document version: %llu\n%.*s\n", local_doc.version, (int)local_doc.len, local_doc.text);
+                    continue;
+                }
+                // a frame can be a little longer than its line
+                if (batch_len + len + WIRE_HEADER_MAX > sizeof(batch)) {
+                    if (server_write(fd_c2s, batch, batch_len) != (ssize_t)batch_len) {
+                        perror("write command");
+                        disconnect = true;
+                        break;
+                    }
+                    batch_len = 0;
+                }
+                if (binary) {
+                    batch_len += encode_command(cmd, len, batch + batch_len);
+                } else {
+                    memcpy(batch + batch_len, cmd, len);
+                    batch_len += len;
+                }
+                disconnect = strncmp(cmd, "DISCONNECT", 10) == 0;
+            }
+            memmove(input, input + start, input_len - start);
+            input_len -= start;
+            if (input_len >= COMMAND_INPUT_MAX) {
                 printf("command too long or missing newline\n");
-                continue;
+                input_len = 0;
+                overlong = true;
             }
 
-            // send command to server
-            if (write(fd_c2s, cmd, len) != (size_t)len) {
+            // send commands to server
+            if (batch_len > 0 && server_write(fd_c2s, batch, batch_len) != (ssize_t)batch_len) {
                 perror("write command");
                 break;
             }
-            if (strncmp(cmd, "DISCONNECT", 10) == 0) {
+            if (disconnect) {
                 break;
             }
         }
     }
-    close(fd_c2s);
-    close(fd_s2c);
+    close_channel(fd_c2s, fd_s2c);
+    if (shm_state != SHM_OFF) shm_channel_close(&shm);
+    conn_buf_free(&rx);
+    free(local_doc.text);
+    return 0;
+}
+
+// connect to the server's AF_UNIX socket, -1 if it has none or refuses
+int connect_socket(int server_pid) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), SERVER_SOCKET_FMT, server_pid);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// SIGRTMIN to the server, wait for SIGRTMIN + 1 and open the FIFOs it made
+int connect_fifos(int server_pid, int *fd_c2s, int *fd_s2c) {
+    // block SIGRTMIN + 1
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGRTMIN + 1);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        perror("sigprocmask");
+        exit(1);
+    }
+
+    // send sigrtmin to server
+    if (kill(server_pid, SIGRTMIN) < 0) {
+        perror("kill(SIGRTMIN)");
+        exit(1);
+    }
+
+    // wait sigrtmin + 1
+    int sig;
+    if (sigwait(&mask, &sig) != 0) {
+        fprintf(stderr, "sigwait failed\n");
+        return -1;
+    }
+
+    // create fifos path
+    char fifo_c2s[256];
+    char fifo_s2c[256];
+    snprintf(fifo_c2s, sizeof(fifo_c2s), CLIENT_FIFO_C2S_FMT, getpid());
+    snprintf(fifo_s2c, sizeof(fifo_s2c), CLIENT_FIFO_S2C_FMT, getpid());
+
+    // open fifos
+    *fd_c2s = open(fifo_c2s, O_WRONLY);
+    *fd_s2c = open(fifo_s2c, O_RDONLY);
+    if (*fd_c2s == -1 || *fd_s2c == -1) {
+        perror("error open fifos");
+        printf("FIFO_C2S: %s, FIFO_S2C: %s\n", fifo_c2s, fifo_s2c);
+        return -1;
+    }
     return 0;
 }
 
+// a socket is both ends at once
+void close_channel(int fd_c2s, int fd_s2c) {
+    close(fd_c2s);
+    if (fd_s2c != fd_c2s) close(fd_s2c);
+}
+
 // read a line
 ssize_t read_line(int fd, char *buf, size_t maxlen) {
     ssize_t n = 0, rc;
     char c;
     while (n < (ssize_t)maxlen - 1) {
-        rc = read(fd, &c, 1);
+        rc = server_read(fd, &c, 1);
         if (rc == 1) {
             buf[n++] = c;
             if (c == '\n') break;
@@ -250,11 +375,233 @@ ssize_t read_line(int fd, char *buf, size_t maxlen) {
     return n;
 }
 
+// read exactly len bytes, -1 if the server went away first
+int read_exact(int fd, char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = server_read(fd, buf + done, len - done);
+        if (n <= 0) return -1;
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+// <version>\n, then DOC\n<length>\n<content>\nEND\n when framed (initial sync, full resync) or
+// <length>\n<content> for a plain broadcast. Replaces the local copy
+int read_document(int fd, bool framed) {
+    char line[64];
+    if (read_line(fd, line, sizeof(line)) <= 0) return -1;
+    unsigned long long version = strtoull(line, NULL, 10);
+    if (framed && (read_line(fd, line, sizeof(line)) <= 0 || strcmp(line, "DOC\n") != 0)) return -1;
+    if (read_line(fd, line, sizeof(line)) <= 0) return -1;
+    size_t len = strtoull(line, NULL, 10);
+
+    char *text = malloc(len + 1);
+    if (!text || read_exact(fd, text, len) < 0) {
+        free(text);
+        return -1;
+    }
+    text[len] = '\0';
+    if (framed && (read_line(fd, line, sizeof(line)) != 1 || read_line(fd, line, sizeof(line)) <= 0 ||
+                   strcmp(line, "END\n") != 0)) {
+        free(text);
+        return -1;
+    }
+    set_document(text, len, version);
+    return 0;
+}
+
+// text is malloc()ed and NUL terminated, the local copy takes it over
+void set_document(char *text, size_t len, unsigned long long version) {
+    free(local_doc.text);
+    local_doc.text = text;
+    local_doc.len = len;
+    local_doc.version = version;
+}
+
+// DELTA <base> <version> <pos> <deleted> <inserted>\n<inserted bytes>\nEND\n, header already read.
+// Replaces local_doc.text[pos, pos + deleted) with the inserted bytes
+int read_delta(int fd, const char *header) {
+    unsigned long long base, version;
+    size_t pos, deleted, inserted;
+    if (sscanf(header, "DELTA %llu %llu %zu %zu %zu", &base, &version, &pos, &deleted, &inserted) != 5) {
+        return -1;
+    }
+    char *ins = malloc(inserted + 1);
+    char line[16];
+    if (!ins || read_exact(fd, ins, inserted) < 0 || read_line(fd, line, sizeof(line)) != 1 ||
+        read_line(fd, line, sizeof(line)) <= 0 || strcmp(line, "END\n") != 0) {
+        free(ins);
+        return -1;
+    }
+    int ret = apply_delta(base, version, pos, deleted, ins, inserted);
+    free(ins);
+    return ret;
+}
+
+// Replace local_doc.text[pos, pos + deleted) with ins, if the local copy is base. -1 only if out of memory
+int apply_delta(unsigned long long base, unsigned long long version, size_t pos, size_t deleted, const char *ins, size_t inserted) {
+    if (base != local_doc.version || pos > local_doc.len || deleted > local_doc.len - pos) {
+        fprintf(stderr, "delta %llu -> %llu does not apply to version %llu\n", base, version, local_doc.version);
+        return 0;
+    }
+
+    size_t len = local_doc.len - deleted + inserted;
+    char *text = malloc(len + 1);
+    if (!text) return -1;
+    memcpy(text, local_doc.text, pos);
+    memcpy(text + pos, ins, inserted);
+    memcpy(text + pos + inserted, local_doc.text + pos + deleted, local_doc.len - pos - deleted);
+    text[len] = '\0';
+    set_document(text, len, version);
+    return 0;
+}
+
+// one line from the server: a document update or an answer to a command
+void process_server_line(int fd, const char *line) {
+    int ret = 0;
+    if (strcmp(line, "VERSION\n") == 0) {
+        ret = read_document(fd, true);
+    } else if (strncmp(line, "DELTA ", 6) == 0) {
+        ret = read_delta(fd, line);
+    } else if (line[0] >= '0' && line[0] <= '9') {
+        // plain broadcast still in flight when DELTA ON went out: <version>\n<length>\n<content>
+        char length[64];
+        char *text = NULL;
+        size_t len = 0;
+        if (read_line(fd, length, sizeof(length)) <= 0) {
+            ret = -1;
+        } else {
+            len = strtoull(length, NULL, 10);
+            text = malloc(len + 1);
+            ret = text ? read_exact(fd, text, len) : -1;
+        }
+        if (ret == 0) {
+            text[len] = '\0';
+            set_document(text, len, strtoull(line, NULL, 10));
+        } else {
+            free(text);
+        }
+    } else if (delta_ack_pending && strcmp(line, "SUCCESS\n") == 0) {
+        delta_ack_pending = false;
+    } else {
+        process_line(line);
+    }
+    if (ret < 0) fprintf(stderr, "malformed document update from server\n");
+}
+
+// BINARY ON, and whatever text arrives until it is answered. Returns 1 if the server switched to frames,
+// 0 if it does not know them, -1 if it went away
+int negotiate_binary(int fd_c2s, int fd_s2c) {
+    if (server_write(fd_c2s, "BINARY ON\n", 10) != 10) return -1;
+    // nothing else was sent yet, so the first answer is this one
+    char line[512];
+    while (read_line(fd_s2c, line, sizeof(line)) > 0) {
+        if (strcmp(line, "SUCCESS\n") == 0) return 1;
+        if (strncmp(line, "Reject", 6) == 0) return 0;
+        process_server_line(fd_s2c, line);
+    }
+    return -1;
+}
+
+// Whatever the server sent since the last call into rx, then every whole frame in it; a frame split across
+// reads waits there for the rest. Returns 0 once the server went away, -1 on an error
+ssize_t read_frames(int fd) {
+    char chunk[FRAME_CHUNK];
+    ssize_t n = server_read(fd, chunk, sizeof(chunk));
+    if (n <= 0) return n;
+    if (conn_buf_append(&rx, chunk, (size_t)n) < 0) return -1;
+
+    const char *body;
+    size_t body_len;
+    size_t size;
+    while ((size = wire_frame(conn_buf_head(&rx), rx.len, SIZE_MAX, &body, &body_len)) != 0) {
+        if (size == (size_t)-1) {
+            fprintf(stderr, "malformed frame from server\n");
+            return -1;
+        }
+        process_frame(body, body_len);
+        conn_buf_consume(&rx, size);
+    }
+    return n;
+}
+
+// one frame from the server, opcode first
+void process_frame(const char *body, size_t len) {
+    const char *p = body + 1;
+    const char *end = body + len;
+    uint64_t base, version, pos, deleted;
+    int ret = 0;
+    switch ((unsigned char)body[0]) {
+    case WIRE_OK:
+        fputs("SUCCESS\n", stdout);
+        break;
+    case WIRE_REJECT:
+        printf("Reject %.*s\n", (int)(end - p), p);
+        break;
+    case WIRE_SYNC: {
+        char *text = NULL;
+        if (wire_get_varint(&p, end, &version) && (text = malloc((size_t)(end - p) + 1))) {
+            memcpy(text, p, (size_t)(end - p));
+            text[end - p] = '\0';
+            set_document(text, (size_t)(end - p), version);
+        } else {
+            ret = -1;
+        }
+        break;
+    }
+    case WIRE_DELTA:
+        if (wire_get_varint(&p, end, &base) && wire_get_varint(&p, end, &version) && wire_get_varint(&p, end, &pos) &&
+            wire_get_varint(&p, end, &deleted)) {
+            ret = apply_delta(base, version, (size_t)pos, (size_t)deleted, p, (size_t)(end - p));
+        } else {
+            ret = -1;
+        }
+        break;
+    case WIRE_EDITS:
+        // the EDIT lines of the text protocol, each goes through process_line
+        while (p < end) {
+            const char *nl = memchr(p, '\n', (size_t)(end - p));
+            size_t n = nl ? (size_t)(nl - p) + 1 : (size_t)(end - p);
+            char line[2048];
+            size_t keep = n < sizeof(line) ? n : sizeof(line) - 1;
+            memcpy(line, p, keep);
+            line[keep] = '\0';
+            process_line(line);
+            p += n;
+        }
+        break;
+    default:
+        // from a newer server, nothing this client needs
+        break;
+    }
+    if (ret < 0) fprintf(stderr, "malformed document update from server\n");
+}
+
+// The frame for one command line from stdin ('\n' included) into out, which has room for len + WIRE_HEADER_MAX
+// bytes. Edits go split up, anything else as its text for the server to answer. Returns the frame's size
+size_t encode_command(const char *cmd, size_t len, char *out) {
+    char line[COMMAND_INPUT_MAX + 1];
+    size_t n = len - 1 < COMMAND_INPUT_MAX ? len - 1 : COMMAND_INPUT_MAX;
+    memcpy(line, cmd, n);
+    line[n] = '\0';
+    if (strncmp(line, "DISCONNECT", 10) == 0) return wire_frame_header(out, WIRE_DISCONNECT, 0);
+
+    char parsed_line[COMMAND_INPUT_MAX + 1];
+    memcpy(parsed_line, line, n + 1);
+    parsed_command pc;
+    size_t size = command_parse(parsed_line, &pc) == NULL ? command_encode(&pc, out, n + WIRE_HEADER_MAX) : 0;
+    if (size > 0) return size;
+    size = wire_frame_header(out, WIRE_LINE, n);
+    memcpy(out + size, line, n);
+    return size + n;
+}
+
 // print bytes
 void print_bytes(int fd, int count) {
     char c;
     for (int i = 0; i < count; i++) {
-        if (read(fd, &c, 1) != 1) break;
+        if (server_read(fd, &c, 1) != 1) break;
         write(STDOUT_FILENO, &c, 1);
     }
     fputc('\n', stdout);
@@ -278,4 +625,106 @@ void process_line(const char *line) {
             fputs(line, stdout);
         }
     }
-}
\ No newline at end of file
+}
+// username over the socket together with a fresh ring pair: [memfd, server eventfd, client eventfd]
+int offer_shm(int sock, const char *username) {
+    int memfd;
+    if (shm_channel_create(&shm, &memfd) < 0) {
+        return -1;
+    }
+
+    struct iovec iov[2] = {
+        { .iov_base = (void *)username, .iov_len = strlen(username) },
+        { .iov_base = "\n", .iov_len = 1 }
+    };
+    union {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    int fds[3] = { memfd, shm.efd_peer, shm.efd_local };
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    ssize_t sent = sendmsg(sock, &msg, 0);
+    close(memfd);
+    if (sent < 0) {
+        shm_channel_close(&shm);
+        return -1;
+    }
+    shm_state = SHM_OFFERED;
+    shm_spin_rounds = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_ROUNDS : 0;
+    return 0;
+}
+
+// read() from the server, or from the ring once it is in use
+ssize_t server_read(int fd, void *buf, size_t len) {
+    if (shm_state == SHM_OFF) return read(fd, buf, len);
+
+    int spins = 0;
+    while (1) {
+        size_t moved = shm_channel_read(&shm, buf, len);
+        if (moved > 0) {
+            shm_state = SHM_ON;
+            return (ssize_t)moved;
+        }
+        if (spins++ < shm_spin_rounds) continue;
+        if (!shm_channel_park_reader(&shm)) continue;
+
+        struct pollfd pfd[2] = {
+            { .fd = shm.efd_local, .events = POLLIN },
+            { .fd = fd, .events = POLLIN }
+        };
+        int ready = poll(pfd, 2, -1);
+        shm_channel_unpark(&shm);
+        if (ready < 0 && errno != EINTR) return -1;
+
+        moved = shm_channel_read(&shm, buf, len);
+        if (moved > 0) {
+            shm_state = SHM_ON;
+            return (ssize_t)moved;
+        }
+        if (ready > 0 && pfd[1].revents) {
+            if (shm_state == SHM_OFFERED) {
+                // the server answered over the socket, it did not take the rings
+                shm_channel_close(&shm);
+                shm_state = SHM_OFF;
+            }
+            // with the rings in use that is the server hanging up
+            return read(fd, buf, len);
+        }
+    }
+}
+
+// write() to the server, or into the ring once it is in use. Blocks until all of buf is out
+ssize_t server_write(int fd, const void *buf, size_t len) {
+    if (shm_state == SHM_OFF) return write(fd, buf, len);
+
+    size_t done = 0;
+    while (done < len) {
+        size_t moved = shm_channel_write(&shm, (const char *)buf + done, len - done);
+        done += moved;
+        if (moved > 0 || !shm_channel_park_writer(&shm)) continue;
+
+        struct pollfd pfd[2] = {
+            { .fd = shm.efd_local, .events = POLLIN },
+            { .fd = fd, .events = POLLIN }
+        };
+        int ready = poll(pfd, 2, -1);
+        shm_channel_unpark(&shm);
+        if (ready < 0 && errno != EINTR) return -1;
+        // the server only ever talks over the ring, anything on the socket means it hung up
+        if (ready > 0 && pfd[1].revents) return -1;
+    }
+    return (ssize_t)len;
+}
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include "../libs/cmd_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define ENTRY_MASK (CMD_LOG_ENTRIES - 1)
+#define BYTE_MASK (CMD_LOG_BYTES - 1)
+#define RECORD_HEADER 5
+#define RECORD_MAX (RECORD_HEADER + 255 + (CMD_LOG_COMMAND_MAX - 1) + 255)
+
+static void ring_put(cmd_log *log, uint64_t at, const void *src, size_t len) {
+    // src may be NULL then
+    if (len == 0) return;
+    size_t pos = at & BYTE_MASK;
+    size_t first = len < CMD_LOG_BYTES - pos ? len : CMD_LOG_BYTES - pos;
+    memcpy(log->bytes + pos, src, first);
+    memcpy(log->bytes, (const char *)src + first, len - first);
+}
+
+static void ring_get(const cmd_log *log, uint64_t at, void *dst, size_t len) {
+    size_t pos = at & BYTE_MASK;
+    size_t first = len < CMD_LOG_BYTES - pos ? len : CMD_LOG_BYTES - pos;
+    memcpy(dst, log->bytes + pos, first);
+    memcpy((char *)dst + first, log->bytes, len - first);
+}
+
+static uint64_t record_end(const cmd_log *log, uint64_t seq) {
+    return seq + 1 < log->next ? log->starts[(seq + 1) & ENTRY_MASK] : log->bytes_end;
+}
+
+static int pwrite_full(int fd, const char *data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int pread_full(int fd, char *data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, data, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+static void close_spill_files(cmd_log *log) {
+    if (log->data_fd != -1) close(log->data_fd);
+    if (log->index_fd != -1) close(log->index_fd);
+    log->data_fd = -1;
+    log->index_fd = -1;
+}
+
+// Move the oldest records out until both rings are at most half full
+static void cmd_log_spill(cmd_log *log) {
+    uint64_t start = log->starts[log->first & ENTRY_MASK];
+    uint64_t end = start;
+    uint64_t n = 0;
+    while (log->first + n < log->next &&
+           (log->next - log->first - n > CMD_LOG_ENTRIES / 2 || log->bytes_end - end > CMD_LOG_BYTES / 2)) {
+        log->spill_index[n] = log->data_len + (end - start);
+        n++;
+        end = record_end(log, log->first + n - 1);
+    }
+
+    // the files only ever hold the records from 0 on without a gap
+    if (log->data_fd != -1 && log->disk_end == log->first) {
+        size_t pos = start & BYTE_MASK;
+        size_t len = (size_t)(end - start);
+        size_t head = len < CMD_LOG_BYTES - pos ? len : CMD_LOG_BYTES - pos;
+        if (pwrite_full(log->data_fd, log->bytes + pos, head, log->data_len) < 0 ||
+            pwrite_full(log->data_fd, log->bytes, len - head, log->data_len + head) < 0 ||
+            pwrite_full(log->index_fd, (const char *)log->spill_index, n * sizeof(uint64_t),
+                        log->first * sizeof(uint64_t)) < 0) {
+            perror("cmd_log_spill: older commands are dropped from now on");
+            close_spill_files(log);
+        } else {
+            log->data_len += len;
+            log->disk_end += n;
+        }
+    }
+    log->first += n;
+}
+
+int cmd_log_init(cmd_log *log, const char *path) {
+    memset(log, 0, sizeof(*log));
+    log->data_fd = -1;
+    log->index_fd = -1;
+    log->starts = malloc(CMD_LOG_ENTRIES * sizeof(*log->starts));
+    log->spill_index = malloc(CMD_LOG_ENTRIES * sizeof(*log->spill_index));
+    log->bytes = malloc(CMD_LOG_BYTES);
+    if (!log->starts || !log->spill_index || !log->bytes) {
+        free(log->starts);
+        free(log->spill_index);
+        free(log->bytes);
+        return -1;
+    }
+    pthread_mutex_init(&log->mutex, NULL);
+
+    snprintf(log->data_path, sizeof(log->data_path), "%s", path);
+    snprintf(log->index_path, sizeof(log->index_path), "%s.idx", path);
+    log->data_fd = open(log->data_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    log->index_fd = open(log->index_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (log->data_fd == -1 || log->index_fd == -1) {
+        perror("cmd_log_init: only the newest commands will be kept");
+        close_spill_files(log);
+    }
+    return 0;
+}
+
+void cmd_log_close(cmd_log *log, bool remove) {
+    pthread_mutex_lock(&log->mutex);
+    close_spill_files(log);
+    if (remove) {
+        unlink(log->data_path);
+        unlink(log->index_path);
+    }
+    pthread_mutex_unlock(&log->mutex);
+}
+
+void cmd_log_append(cmd_log *log, const char *user, const char *command, int result, const char *reason) {
+    size_t user_len = strnlen(user, 255);
+    size_t command_len = strcspn(command, "\r\n");
+    if (command_len > CMD_LOG_COMMAND_MAX - 1) command_len = CMD_LOG_COMMAND_MAX - 1;
+    size_t reason_len = reason ? strnlen(reason, 255) : 0;
+    unsigned char header[RECORD_HEADER] = {
+        (unsigned char)user_len,
+        (unsigned char)(command_len & 0xff),
+        (unsigned char)(command_len >> 8),
+        (unsigned char)reason_len,
+        result != 0
+    };
+    uint64_t size = RECORD_HEADER + user_len + command_len + reason_len;
+
+    pthread_mutex_lock(&log->mutex);
+    uint64_t used = log->next > log->first ? log->bytes_end - log->starts[log->first & ENTRY_MASK] : 0;
+    if (log->next - log->first == CMD_LOG_ENTRIES || used + size > CMD_LOG_BYTES) cmd_log_spill(log);
+
+    uint64_t at = log->bytes_end;
+    log->starts[log->next & ENTRY_MASK] = at;
+    ring_put(log, at, header, RECORD_HEADER);
+    at += RECORD_HEADER;
+    ring_put(log, at, user, user_len);
+    at += user_len;
+    ring_put(log, at, command, command_len);
+    at += command_len;
+    ring_put(log, at, reason, reason_len);
+    log->bytes_end = at + reason_len;
+    log->next++;
+    pthread_mutex_unlock(&log->mutex);
+}
+
+uint64_t cmd_log_count(cmd_log *log) {
+    pthread_mutex_lock(&log->mutex);
+    uint64_t count = log->next;
+    pthread_mutex_unlock(&log->mutex);
+    return count;
+}
+
+// Record seq, which was spilled, from the files into raw. Caller holds log->mutex
+static int read_spilled(const cmd_log *log, uint64_t seq, unsigned char *raw) {
+    uint64_t offset;
+    if (pread_full(log->index_fd, (char *)&offset, sizeof(offset), seq * sizeof(offset)) < 0 ||
+        pread_full(log->data_fd, (char *)raw, RECORD_HEADER, offset) < 0) {
+        return -1;
+    }
+    size_t body = (size_t)raw[0] + (raw[1] | (size_t)raw[2] << 8) + raw[3];
+    return pread_full(log->data_fd, (char *)raw + RECORD_HEADER, body, offset + RECORD_HEADER);
+}
+
+int cmd_log_get(cmd_log *log, uint64_t seq, cmd_log_record *rec) {
+    unsigned char raw[RECORD_MAX];
+
+    pthread_mutex_lock(&log->mutex);
+    if (seq >= log->next) {
+        pthread_mutex_unlock(&log->mutex);
+        return 1;
+    }
+    if (seq >= log->first) {
+        uint64_t start = log->starts[seq & ENTRY_MASK];
+        ring_get(log, start, raw, (size_t)(record_end(log, seq) - start));
+        pthread_mutex_unlock(&log->mutex);
+    } else {
+        // a failed spill or cmd_log_close may close the files, and their fd numbers be reused, as soon as the
+        // lock is let go. The preads mostly hit the page cache, so appends wait little for them
+        int rc = seq < log->disk_end ? read_spilled(log, seq, raw) : -1;
+        pthread_mutex_unlock(&log->mutex);
+        if (rc != 0) return -1;
+    }
+
+    size_t user_len = raw[0];
+    size_t command_len = raw[1] | (size_t)raw[2] << 8;
+    size_t reason_len = raw[3];
+    const unsigned char *p = raw + RECORD_HEADER;
+    char *t = rec->text;
+    rec->user = t;
+    memcpy(t, p, user_len);
+    t[user_len] = '\0';
+    t += user_len + 1;
+    p += user_len;
+    rec->command = t;
+    memcpy(t, p, command_len);
+    t[command_len] = '\0';
+    t += command_len + 1;
+    p += command_len;
+    rec->reason = t;
+    memcpy(t, p, reason_len);
+    t[reason_len] = '\0';
+    rec->rejected = raw[4] != 0;
+    return 0;
+}
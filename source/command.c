@@ -0,0 +1,248 @@
+#include "../libs/command.h"
+#include "../libs/wire.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// what follows the keyword, each argument after at least one blank
+typedef enum {
+    ARGS_POS,
+    ARGS_RANGE,
+    ARGS_POS_TEXT,
+    ARGS_RANGE_TEXT
+} command_args;
+
+typedef struct {
+    const char *name;
+    size_t len;
+    command_args args;
+    // the reason a malformed command is rejected with
+    const char *usage;
+} command_spec;
+
+#define SPEC(keyword, args, expected) \
+    { keyword, sizeof(keyword) - 1, args, "Invalid " keyword " format. Expected: " keyword " " expected }
+
+// indexed by command_op
+static const command_spec command_specs[CMD_COUNT] = {
+    [CMD_INSERT]          = SPEC("INSERT", ARGS_POS_TEXT, "pos text"),
+    [CMD_DELETE]          = SPEC("DELETE", ARGS_RANGE, "pos len"),
+    [CMD_NEWLINE]         = SPEC("NEWLINE", ARGS_POS, "pos"),
+    [CMD_HEADING]         = SPEC("HEADING", ARGS_RANGE, "level pos"),
+    [CMD_BOLD]            = SPEC("BOLD", ARGS_RANGE, "start end"),
+    [CMD_ITALIC]          = SPEC("ITALIC", ARGS_RANGE, "start end"),
+    [CMD_CODE]            = SPEC("CODE", ARGS_RANGE, "start end"),
+    [CMD_BLOCKQUOTE]      = SPEC("BLOCKQUOTE", ARGS_POS, "pos"),
+    [CMD_ORDERED_LIST]    = SPEC("ORDERED_LIST", ARGS_POS, "pos"),
+    [CMD_UNORDERED_LIST]  = SPEC("UNORDERED_LIST", ARGS_POS, "pos"),
+    [CMD_HORIZONTAL_RULE] = SPEC("HORIZONTAL_RULE", ARGS_POS, "pos"),
+    [CMD_LINK]            = SPEC("LINK", ARGS_RANGE_TEXT, "start end url"),
+};
+
+// length plus the first two characters is collision free for the keywords above
+#define COMMAND_HASH(word, len) (((len) + (unsigned char)(word)[0] + (unsigned char)(word)[1]) & 31)
+
+// command_op + 1 by COMMAND_HASH of its keyword, 0 for none. A new keyword needs a slot of its own
+static const unsigned char command_slots[32] = {
+    [29] = CMD_INSERT + 1,
+    [15] = CMD_DELETE + 1,
+    [26] = CMD_NEWLINE + 1,
+    [20] = CMD_HEADING + 1,
+    [21] = CMD_BOLD + 1,
+    [3]  = CMD_ITALIC + 1,
+    [22] = CMD_CODE + 1,
+    [24] = CMD_BLOCKQUOTE + 1,
+    [13] = CMD_ORDERED_LIST + 1,
+    [17] = CMD_UNORDERED_LIST + 1,
+    [6]  = CMD_HORIZONTAL_RULE + 1,
+    [25] = CMD_LINK + 1,
+};
+
+static const command_spec *command_lookup(const char *word, size_t len) {
+    if (len < 2) return NULL;
+    unsigned slot = command_slots[COMMAND_HASH(word, len)];
+    if (slot == 0) return NULL;
+    const command_spec *spec = &command_specs[slot - 1];
+    if (spec->len != len || memcmp(spec->name, word, len) != 0) return NULL;
+    return spec;
+}
+
+static bool takes_range(const command_spec *spec) {
+    return spec->args == ARGS_RANGE || spec->args == ARGS_RANGE_TEXT;
+}
+
+static bool takes_text(const command_spec *spec) {
+    return spec->args == ARGS_POS_TEXT || spec->args == ARGS_RANGE_TEXT;
+}
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// past the blanks at *p, false if there are none
+static bool skip_blanks(const char **p) {
+    const char *s = *p;
+    while (is_blank(*s)) s++;
+    if (s == *p) return false;
+    *p = s;
+    return true;
+}
+
+// the decimal number at *p, false if there is none or it does not fit
+static bool parse_size(const char **p, size_t *out) {
+    const char *s = *p;
+    if (*s < '0' || *s > '9') return false;
+    size_t value = 0;
+    while (*s >= '0' && *s <= '9') {
+        size_t digit = (size_t)(*s - '0');
+        if (value > (SIZE_MAX - digit) / 10) return false;
+        value = value * 10 + digit;
+        s++;
+    }
+    *p = s;
+    *out = value;
+    return true;
+}
+
+const char *command_parse(char *line, parsed_command *cmd) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+
+    size_t word = 0;
+    while (word < len && !is_blank(line[word])) word++;
+    const command_spec *spec = command_lookup(line, word);
+    if (!spec) return "Unknown command";
+
+    cmd->op = (command_op)(spec - command_specs);
+    cmd->a = 0;
+    cmd->b = 0;
+    cmd->text = NULL;
+    const char *p = line + word;
+    if (!skip_blanks(&p) || !parse_size(&p, &cmd->a)) return spec->usage;
+    if (takes_range(spec)) {
+        if (!skip_blanks(&p) || !parse_size(&p, &cmd->b)) return spec->usage;
+    }
+    if (takes_text(spec)) {
+        // the text is the rest of the line, and may be empty
+        if (!skip_blanks(&p)) return spec->usage;
+        cmd->text = p;
+    } else {
+        while (is_blank(*p)) p++;
+        if (*p != '\0') return spec->usage;
+    }
+
+    if (cmd->op == CMD_HEADING && (cmd->a < 1 || cmd->a > 6)) return spec->usage;
+    return NULL;
+}
+
+size_t command_encode(const parsed_command *cmd, char *buf, size_t size) {
+    if (cmd->op >= CMD_COUNT) return 0;
+    const command_spec *spec = &command_specs[cmd->op];
+    char args[2 * WIRE_VARINT_MAX];
+    size_t n = wire_put_varint(args, cmd->a);
+    if (takes_range(spec)) n += wire_put_varint(args + n, cmd->b);
+    size_t text_len = takes_text(spec) && cmd->text ? strlen(cmd->text) : 0;
+
+    char header[WIRE_HEADER_MAX];
+    size_t h = wire_frame_header(header, (wire_op)(WIRE_COMMAND + cmd->op), n + text_len);
+    if (h + n + text_len > size) return 0;
+    memcpy(buf, header, h);
+    memcpy(buf + h, args, n);
+    memcpy(buf + h + n, cmd->text, text_len);
+    return h + n + text_len;
+}
+
+bool command_decode(const char *body, size_t len, char *line, size_t size, parsed_command *cmd) {
+    // an unknown opcode is as unknown as an empty line
+    line[0] = '\0';
+    unsigned op = len > 0 ? (unsigned)(unsigned char)body[0] - WIRE_COMMAND : CMD_COUNT;
+    if (op >= CMD_COUNT) return false;
+    const command_spec *spec = &command_specs[op];
+
+    const char *p = body + 1;
+    const char *end = body + len;
+    uint64_t a = 0;
+    uint64_t b = 0;
+    bool valid = wire_get_varint(&p, end, &a) && (!takes_range(spec) || wire_get_varint(&p, end, &b)) &&
+                 a <= SIZE_MAX && b <= SIZE_MAX;
+    // the text parser skips the blanks in front of the text, and a line cannot hold the rest
+    if (valid && takes_text(spec)) {
+        while (p < end && is_blank(*p)) p++;
+        valid = memchr(p, '\0', (size_t)(end - p)) == NULL && memchr(p, '\n', (size_t)(end - p)) == NULL &&
+                memchr(p, '\r', (size_t)(end - p)) == NULL;
+    } else if (valid) {
+        valid = p == end;
+    }
+    if (valid && op == CMD_HEADING && (a < 1 || a > 6)) valid = false;
+
+    int text_len = (int)(end - p);
+    int written = -1;
+    if (valid && !takes_text(spec)) {
+        written = takes_range(spec) ? snprintf(line, size, "%s %llu %llu", spec->name, (unsigned long long)a, (unsigned long long)b)
+                                    : snprintf(line, size, "%s %llu", spec->name, (unsigned long long)a);
+    } else if (valid) {
+        written = takes_range(spec) ? snprintf(line, size, "%s %llu %llu %.*s", spec->name, (unsigned long long)a,
+                                               (unsigned long long)b, text_len, p)
+                                    : snprintf(line, size, "%s %llu %.*s", spec->name, (unsigned long long)a, text_len, p);
+    }
+    if (written < 0 || (size_t)written >= size) {
+        // the keyword alone gets the usage
+        snprintf(line, size, "%s", spec->name);
+        return false;
+    }
+
+    cmd->op = (command_op)op;
+    cmd->a = (size_t)a;
+    cmd->b = (size_t)b;
+    cmd->text = takes_text(spec) ? line + written - text_len : NULL;
+    return true;
+}
+
+const char *command_name(command_op op) {
+    return op < CMD_COUNT ? command_specs[op].name : "?";
+}
+
+const char *command_result_reason(int result) {
+    // markdown.c's DELETE_POSITION and OUTDATED_VERSION, anything else is a bad cursor position
+    switch (result) {
+    case -2:
+        return "DELETED_POSITION";
+    case -3:
+        return "OUTDATED_VERSION";
+    default:
+        return "INVALID_POSITION";
+    }
+}
+
+int command_apply(document *doc, uint64_t version, const parsed_command *cmd) {
+    switch (cmd->op) {
+    case CMD_INSERT:
+        return markdown_insert(doc, version, cmd->a, cmd->text);
+    case CMD_DELETE:
+        return markdown_delete(doc, version, cmd->a, cmd->b);
+    case CMD_NEWLINE:
+        return markdown_newline(doc, version, cmd->a);
+    case CMD_HEADING:
+        return markdown_heading(doc, version, cmd->a, cmd->b);
+    case CMD_BOLD:
+        return markdown_bold(doc, version, cmd->a, cmd->b);
+    case CMD_ITALIC:
+        return markdown_italic(doc, version, cmd->a, cmd->b);
+    case CMD_CODE:
+        return markdown_code(doc, version, cmd->a, cmd->b);
+    case CMD_BLOCKQUOTE:
+        return markdown_blockquote(doc, version, cmd->a);
+    case CMD_ORDERED_LIST:
+        return markdown_ordered_list(doc, version, cmd->a);
+    case CMD_UNORDERED_LIST:
+        return markdown_unordered_list(doc, version, cmd->a);
+    case CMD_HORIZONTAL_RULE:
+        return markdown_horizontal_rule(doc, version, cmd->a);
+    case CMD_LINK:
+        return markdown_link(doc, version, cmd->a, cmd->b, cmd->text);
+    case CMD_COUNT:
+        break;
+    }
+    return -1;
+}
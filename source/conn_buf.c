@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+#include "../libs/conn_buf.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define CONN_BUF_MIN_CAP 1024
+
+void conn_buf_init(conn_buf *b) {
+    b->data = NULL;
+    b->start = 0;
+    b->len = 0;
+    b->cap = 0;
+}
+
+void conn_buf_free(conn_buf *b) {
+    free(b->data);
+    conn_buf_init(b);
+}
+
+int conn_buf_append(conn_buf *b, const void *data, size_t len) {
+    if (len == 0) return 0;
+    if (b->start + b->len + len > b->cap) {
+        if (b->len + len <= b->cap) {
+            // enough room once the consumed front is reclaimed
+            memmove(b->data, b->data + b->start, b->len);
+        } else {
+            size_t cap = b->cap ? b->cap : CONN_BUF_MIN_CAP;
+            while (cap < b->len + len) cap *= 2;
+            char *grown = malloc(cap);
+            if (!grown) return -1;
+            if (b->len) memcpy(grown, b->data + b->start, b->len);
+            free(b->data);
+            b->data = grown;
+            b->cap = cap;
+        }
+        b->start = 0;
+    }
+    memcpy(b->data + b->start + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+void conn_buf_consume(conn_buf *b, size_t n) {
+    if (n >= b->len) {
+        b->start = 0;
+        b->len = 0;
+        return;
+    }
+    b->start += n;
+    b->len -= n;
+}
+
+size_t conn_buf_line(const conn_buf *b, size_t limit, bool at_eof) {
+    size_t avail = b->len < limit ? b->len : limit;
+    const char *nl = memchr(conn_buf_head(b), '\n', avail);
+    if (nl) return (size_t)(nl - conn_buf_head(b)) + 1;
+    if (b->len >= limit || at_eof) return avail;
+    return 0;
+}
+
+int conn_buf_flush_fd(conn_buf *b, int fd) {
+    while (b->len > 0) {
+        ssize_t ret = write(fd, b->data + b->start, b->len);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+        if (ret <= 0) return -1;
+        conn_buf_consume(b, (size_t)ret);
+    }
+    return 0;
+}
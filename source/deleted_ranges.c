@@ -0,0 +1,89 @@
+#define _GNU_SOURCE
+#include "../libs/deleted_ranges.h"
+#include <stdlib.h>
+#include <string.h>
+
+void deleted_ranges_init(deleted_ranges *dr) {
+    dr->spans = NULL;
+    dr->count = 0;
+    dr->cap = 0;
+}
+
+void deleted_ranges_free(deleted_ranges *dr) {
+    free(dr->spans);
+    deleted_ranges_init(dr);
+}
+
+void deleted_ranges_clear(deleted_ranges *dr) {
+    dr->count = 0;
+}
+
+// order by line identity first, then by position inside the line
+static int key_cmp(const line_node *a_ln, uint32_t a_gen, size_t a_pos, const deleted_span *b) {
+    if ((uintptr_t)a_ln != (uintptr_t)b->ln) return (uintptr_t)a_ln < (uintptr_t)b->ln ? -1 : 1;
+    if (a_gen != b->gen) return a_gen < b->gen ? -1 : 1;
+    if (a_pos != b->start) return a_pos < b->start ? -1 : 1;
+    return 0;
+}
+
+static bool same_line(const deleted_span *s, const line_node *ln, uint32_t gen) {
+    return s->ln == ln && s->gen == gen;
+}
+
+// first span whose key is greater than (ln, gen, pos)
+static size_t upper_bound(const deleted_ranges *dr, const line_node *ln, uint32_t gen, size_t pos) {
+    size_t lo = 0, hi = dr->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (key_cmp(ln, gen, pos, &dr->spans[mid]) < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+static int insert_span(deleted_ranges *dr, size_t at, deleted_span span) {
+    if (dr->count == dr->cap) {
+        size_t cap = dr->cap ? dr->cap * 2 : 16;
+        deleted_span *grown = realloc(dr->spans, cap * sizeof(deleted_span));
+        if (!grown) return -1;
+        dr->spans = grown;
+        dr->cap = cap;
+    }
+    memmove(&dr->spans[at + 1], &dr->spans[at], (dr->count - at) * sizeof(deleted_span));
+    dr->spans[at] = span;
+    dr->count++;
+    return 0;
+}
+
+int deleted_ranges_add(deleted_ranges *dr, line_node *ln, uint32_t gen, size_t pos, size_t len) {
+    size_t end = pos + len;
+    size_t cursor = pos;
+    size_t i = upper_bound(dr, ln, gen, pos);
+
+    // earlier deletes keep the parts they already cover, only the gaps between them belong to this one
+    if (i > 0 && same_line(&dr->spans[i - 1], ln, gen) && dr->spans[i - 1].end > cursor) {
+        cursor = dr->spans[i - 1].end;
+    }
+    while (cursor < end) {
+        if (i < dr->count && same_line(&dr->spans[i], ln, gen) && dr->spans[i].start < end) {
+            if (dr->spans[i].start > cursor) {
+                if (insert_span(dr, i, (deleted_span){ ln, gen, cursor, dr->spans[i].start, pos }) != 0) return -1;
+                i++;
+            }
+            if (dr->spans[i].end > cursor) cursor = dr->spans[i].end;
+            i++;
+            continue;
+        }
+        return insert_span(dr, i, (deleted_span){ ln, gen, cursor, end, pos });
+    }
+    return 0;
+}
+
+bool deleted_ranges_lookup(const deleted_ranges *dr, const line_node *ln, uint32_t gen, size_t pos, size_t *rebased_out) {
+    size_t i = upper_bound(dr, ln, gen, pos);
+    if (i == 0) return false;
+    const deleted_span *s = &dr->spans[i - 1];
+    if (!same_line(s, ln, gen) || pos >= s->end) return false;
+    *rebased_out = s->rebase_to;
+    return true;
+}
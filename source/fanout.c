@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include "../libs/fanout.h"
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+// iovecs handed to one writev
+#define FANOUT_IOV_BATCH 64
+
+int fanout_init(fanout *f) {
+    int fds[2];
+    f->rd = f->wr = f->devnull = -1;
+    f->capacity = 0;
+    f->len = 0;
+    if (pipe2(fds, O_CLOEXEC) < 0) return -1;
+    f->devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int capacity = fcntl(fds[1], F_GETPIPE_SZ);
+    // a full staging pipe has to fail the write, not wait for a reader that never comes
+    if (f->devnull == -1 || capacity < 0 || fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        if (f->devnull != -1) close(f->devnull);
+        f->devnull = -1;
+        return -1;
+    }
+    f->rd = fds[0];
+    f->wr = fds[1];
+    f->capacity = (size_t)capacity;
+    return 0;
+}
+
+void fanout_free(fanout *f) {
+    if (f->rd != -1) close(f->rd);
+    if (f->wr != -1) close(f->wr);
+    if (f->devnull != -1) close(f->devnull);
+    f->rd = f->wr = f->devnull = -1;
+}
+
+// Fill iov with the payload from offset skip on, at most max entries. Returns how many were used
+static int payload_iov(struct iovec *iov, int max, const char *header, size_t header_len,
+                       const doc_snapshot *snap, size_t len, size_t skip) {
+    int n = 0;
+    if (skip < header_len) {
+        iov[n].iov_base = (void *)(header + skip);
+        iov[n].iov_len = header_len - skip;
+        n++;
+        skip = 0;
+    } else {
+        skip -= header_len;
+    }
+    for (size_t i = 0; i < snap->chunk_count && len > 0 && n < max; i++) {
+        const snapshot_chunk *c = snap->chunks[i];
+        size_t todo = c->len < len ? c->len : len;
+        len -= todo;
+        if (skip >= todo) {
+            skip -= todo;
+            continue;
+        }
+        iov[n].iov_base = (void *)(c->data + skip);
+        iov[n].iov_len = todo - skip;
+        n++;
+        skip = 0;
+    }
+    return n;
+}
+
+int fanout_stage(fanout *f, const char *header, size_t header_len, const doc_snapshot *snap, size_t len) {
+    if (f->wr == -1) return -1;
+    size_t total = header_len + len;
+    if (total > f->capacity) {
+        // bounded by /proc/sys/fs/pipe-max-size, bigger documents take the writev path
+        if (total > INT_MAX) return -1;
+        int capacity = fcntl(f->wr, F_SETPIPE_SZ, (int)total);
+        if (capacity < 0 || (size_t)capacity < total) return -1;
+        f->capacity = (size_t)capacity;
+    }
+
+    struct iovec iov[FANOUT_IOV_BATCH];
+    size_t staged = 0;
+    while (staged < total) {
+        int n = payload_iov(iov, FANOUT_IOV_BATCH, header, header_len, snap, len, staged);
+        ssize_t ret = writev(f->wr, iov, n);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) {
+            f->len = staged;
+            fanout_drop(f);
+            return -1;
+        }
+        staged += (size_t)ret;
+    }
+    f->len = total;
+    return 0;
+}
+
+ssize_t fanout_tee(fanout *f, int fd) {
+    while (1) {
+        // tee always starts at the front of the staging pipe, the caller finishes a short one itself
+        ssize_t ret = tee(f->rd, fd, f->len, 0);
+        if (ret < 0 && errno == EINTR) continue;
+        // a FIFO smaller than the payload, so the next one fits (best effort, the pipe-max-size limit applies)
+        if (ret >= 0 && (size_t)ret < f->len && f->len <= INT_MAX) {
+            fcntl(fd, F_SETPIPE_SZ, (int)f->len);
+        }
+        return ret;
+    }
+}
+
+void fanout_drop(fanout *f) {
+    while (f->len > 0) {
+        ssize_t ret = splice(f->rd, NULL, f->devnull, NULL, f->len, 0);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) {
+            // fresh pipe rather than one with a stale payload at the front
+            fanout_free(f);
+            fanout_init(f);
+            return;
+        }
+        f->len -= (size_t)ret;
+    }
+}
+
+ssize_t fanout_writev(int fd, const char *header, size_t header_len, const doc_snapshot *snap, size_t len, size_t skip) {
+    struct iovec iov[FANOUT_IOV_BATCH];
+    size_t total = header_len + len;
+    size_t done = 0;
+    while (skip + done < total) {
+        int n = payload_iov(iov, FANOUT_IOV_BATCH, header, header_len, snap, len, skip + done);
+        ssize_t ret = writev(fd, iov, n);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (ret <= 0) return done > 0 ? (ssize_t)done : -1;
+        done += (size_t)ret;
+    }
+    return (ssize_t)done;
+}
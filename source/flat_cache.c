@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+#include "../libs/flat_cache.h"
+#include "../libs/line_index.h"
+#include "../libs/line_store.h"
+#include <stdlib.h>
+#include <string.h>
+
+void flat_cache_init(flat_cache *fc) {
+    fc->buf = NULL;
+    fc->len = 0;
+    fc->cap = 0;
+    fc->valid = false;
+    fc->dirty = false;
+    fc->keep_prefix = 0;
+    fc->keep_suffix = 0;
+    fc->version = 0;
+}
+
+void flat_cache_free(flat_cache *fc) {
+    free(fc->buf);
+    flat_cache_init(fc);
+}
+
+void flat_cache_note_change(flat_cache *fc, size_t keep_prefix, size_t keep_suffix) {
+    if (!fc->valid) return;
+    // what survived every apply since the last refresh still matches the cache
+    if (!fc->dirty) {
+        fc->keep_prefix = keep_prefix;
+        fc->keep_suffix = keep_suffix;
+        fc->dirty = true;
+        return;
+    }
+    if (keep_prefix < fc->keep_prefix) fc->keep_prefix = keep_prefix;
+    if (keep_suffix < fc->keep_suffix) fc->keep_suffix = keep_suffix;
+}
+
+static int reserve(flat_cache *fc, size_t len) {
+    if (len + 1 <= fc->cap) return 0;
+    size_t cap = fc->cap ? fc->cap : 256;
+    while (cap < len + 1) cap *= 2;
+    char *grown = realloc(fc->buf, cap);
+    if (!grown) return -1;
+    fc->buf = grown;
+    fc->cap = cap;
+    return 0;
+}
+
+void flat_cache_copy_range(const document *doc, size_t from, size_t len, char *out) {
+    size_t offset = 0;
+    line_node *ln = len ? line_index_find(doc, from, &offset) : NULL;
+    while (ln && len > 0) {
+        size_t chunk = ln->length - offset;
+        if (chunk > len) chunk = len;
+        line_store_copy(doc, ln, offset, chunk, out);
+        out += chunk;
+        len -= chunk;
+        if (len == 0) break;
+        *out++ = '\n';
+        len--;
+        ln = ln->next;
+        offset = 0;
+    }
+}
+
+int flat_cache_refresh(document *doc) {
+    flat_cache *fc = &doc->flat;
+    if (fc->valid && !fc->dirty) {
+        fc->version = doc->version;
+        return 0;
+    }
+
+    size_t old_len = fc->len;
+    size_t new_len = line_index_flat_length(doc);
+    if (reserve(fc, new_len) != 0) return -1;
+
+    size_t keep = fc->keep_prefix + fc->keep_suffix;
+    if (fc->valid && keep <= old_len && keep <= new_len) {
+        memmove(fc->buf + new_len - fc->keep_suffix, fc->buf + old_len - fc->keep_suffix, fc->keep_suffix);
+        flat_cache_copy_range(doc, fc->keep_prefix, new_len - keep, fc->buf + fc->keep_prefix);
+    } else {
+        flat_cache_copy_range(doc, 0, new_len, fc->buf);
+    }
+
+    fc->buf[new_len] = '\0';
+    fc->len = new_len;
+    fc->valid = true;
+    fc->dirty = false;
+    fc->version = doc->version;
+    return 0;
+}
@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include "../libs/line_index.h"
+#include <stdlib.h>
+#include <stdbool.h>
+
+static size_t weight_of(const line_node *n) {
+    return n ? n->idx_weight : 0;
+}
+
+// recompute subtree weight from the children
+static void pull(line_node *n) {
+    n->idx_weight = weight_of(n->idx_left) + weight_of(n->idx_right) + n->length + 1;
+}
+
+static void pull_to_root(line_node *n) {
+    while (n) {
+        pull(n);
+        n = n->idx_parent;
+    }
+}
+
+// xorshift32, priorities only need to be well spread
+static uint32_t next_prio(document *doc) {
+    uint32_t x = doc->index_seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    doc->index_seed = x;
+    return x;
+}
+
+static void replace_child(document *doc, line_node *parent, line_node *old_child, line_node *new_child) {
+    if (new_child) new_child->idx_parent = parent;
+    if (!parent) {
+        doc->index_root = new_child;
+    } else if (parent->idx_left == old_child) {
+        parent->idx_left = new_child;
+    } else {
+        parent->idx_right = new_child;
+    }
+}
+
+// rotate x above its parent, keeps in-order sequence
+static void rotate_up(document *doc, line_node *x) {
+    line_node *p = x->idx_parent;
+    line_node *g = p->idx_parent;
+
+    if (p->idx_left == x) {
+        p->idx_left = x->idx_right;
+        if (x->idx_right) x->idx_right->idx_parent = p;
+        x->idx_right = p;
+    } else {
+        p->idx_right = x->idx_left;
+        if (x->idx_left) x->idx_left->idx_parent = p;
+        x->idx_left = p;
+    }
+    p->idx_parent = x;
+    replace_child(doc, g, p, x);
+    pull(p);
+    pull(x);
+}
+
+// merge two treaps, every node of a comes before every node of b
+static line_node *merge(line_node *a, line_node *b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->idx_prio > b->idx_prio) {
+        a->idx_right = merge(a->idx_right, b);
+        a->idx_right->idx_parent = a;
+        pull(a);
+        return a;
+    }
+    b->idx_left = merge(a, b->idx_left);
+    b->idx_left->idx_parent = b;
+    pull(b);
+    return b;
+}
+
+void line_index_init(document *doc) {
+    doc->index_root = NULL;
+    doc->index_seed = 0x9e3779b9u;
+}
+
+void line_index_insert_after(document *doc, line_node *prev, line_node *ln) {
+    ln->idx_left = NULL;
+    ln->idx_right = NULL;
+    ln->idx_prio = next_prio(doc);
+    ln->idx_weight = ln->length + 1;
+
+    // attach as in-order successor of prev (or as the very first node)
+    line_node *parent = NULL;
+    bool as_left = true;
+    if (prev) {
+        if (!prev->idx_right) {
+            parent = prev;
+            as_left = false;
+        } else {
+            parent = prev->idx_right;
+            while (parent->idx_left) parent = parent->idx_left;
+        }
+    } else {
+        parent = doc->index_root;
+        while (parent && parent->idx_left) parent = parent->idx_left;
+    }
+
+    ln->idx_parent = parent;
+    if (!parent) {
+        doc->index_root = ln;
+        return;
+    }
+    if (as_left) {
+        parent->idx_left = ln;
+    } else {
+        parent->idx_right = ln;
+    }
+    pull_to_root(parent);
+
+    while (ln->idx_parent && ln->idx_parent->idx_prio < ln->idx_prio) {
+        rotate_up(doc, ln);
+    }
+}
+
+void line_index_remove(document *doc, line_node *ln) {
+    line_node *parent = ln->idx_parent;
+    line_node *joined = merge(ln->idx_left, ln->idx_right);
+    replace_child(doc, parent, ln, joined);
+    pull_to_root(parent);
+
+    ln->idx_left = NULL;
+    ln->idx_right = NULL;
+    ln->idx_parent = NULL;
+}
+
+void line_index_update(line_node *ln) {
+    pull_to_root(ln);
+}
+
+line_node *line_index_find(const document *doc, size_t global_pos, size_t *offset_in_line_out) {
+    line_node *node = doc->index_root;
+    while (node) {
+        size_t left_weight = weight_of(node->idx_left);
+        if (global_pos < left_weight) {
+            node = node->idx_left;
+            continue;
+        }
+        global_pos -= left_weight;
+        if (global_pos <= node->length) {
+            *offset_in_line_out = global_pos;
+            return node;
+        }
+        global_pos -= node->length + 1;
+        node = node->idx_right;
+    }
+    return NULL;
+}
+
+size_t line_index_offset_of(const line_node *ln) {
+    size_t offset = weight_of(ln->idx_left);
+    for (const line_node *n = ln; n->idx_parent; n = n->idx_parent) {
+        const line_node *p = n->idx_parent;
+        if (p->idx_right == n) {
+            offset += weight_of(p->idx_left) + p->length + 1;
+        }
+    }
+    return offset;
+}
+
+size_t line_index_flat_length(const document *doc) {
+    // the last line has no separator after it
+    return doc->index_root ? doc->index_root->idx_weight - 1 : 0;
+}
@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+#include "../libs/line_store.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// === Linked list engine: one buffer per line ===
+
+static int ll_init(line_node *ln, const char *text, size_t len) {
+    char *content = malloc(len + 1);
+    if (!content) return -1;
+    if (len > 0) memcpy(content, text, len);
+    content[len] = '\0';
+    ln->content = content;
+    ln->length = len;
+    return 0;
+}
+
+static int ll_insert(line_node *ln, size_t pos, const char *text, size_t len) {
+    char *old_content = ln->content;
+    size_t old_len = ln->length;
+    size_t new_len = old_len + len;
+    char *new_content = malloc(new_len + 1);
+    if (!new_content) return -1;
+
+    memcpy(new_content, old_content, pos);
+    memcpy(new_content + pos, text, len);
+    memcpy(new_content + pos + len, old_content + pos, old_len - pos);
+    new_content[new_len] = '\0';
+
+    free(old_content);
+    ln->content = new_content;
+    ln->length = new_len;
+    return 0;
+}
+
+static int ll_erase(line_node *ln, size_t pos, size_t len) {
+    if (pos == 0 && len == ln->length) {
+        char *empty = malloc(1);
+        if (!empty) return -1;
+        empty[0] = '\0';
+        free(ln->content);
+        ln->content = empty;
+        ln->length = 0;
+        return 0;
+    }
+
+    size_t new_len = ln->length - len;
+    memmove(ln->content + pos, ln->content + pos + len, ln->length - (pos + len));
+    ln->content[new_len] = '\0';
+    ln->length = new_len;
+
+    // shrinking is best effort, the old buffer is still valid on failure
+    char *shrunk = realloc(ln->content, new_len + 1);
+    if (shrunk) ln->content = shrunk;
+    return 0;
+}
+
+static int ll_split(line_node *ln, size_t pos, line_node *tail) {
+    size_t tail_len = ln->length - pos;
+    char *tail_content = malloc(tail_len + 1);
+    if (!tail_content) return -1;
+    memcpy(tail_content, ln->content + pos, tail_len);
+    tail_content[tail_len] = '\0';
+
+    free(tail->content);
+    tail->content = tail_content;
+    tail->length = tail_len;
+
+    ln->content[pos] = '\0';
+    ln->length = pos;
+    char *shrunk = realloc(ln->content, pos + 1);
+    if (shrunk) ln->content = shrunk;
+    return 0;
+}
+
+static int ll_append(line_node *dst, const line_node *src) {
+    size_t new_len = dst->length + src->length;
+    char *new_content = realloc(dst->content, new_len + 1);
+    if (!new_content) return -1;
+    memcpy(new_content + dst->length, src->content, src->length);
+    new_content[new_len] = '\0';
+    dst->content = new_content;
+    dst->length = new_len;
+    return 0;
+}
+
+// === Piece table engine: spans of the append-only add buffer ===
+
+static int add_buf_append(document *doc, const char *text, size_t len, size_t *start_out) {
+    if (doc->add_len + len > doc->add_cap) {
+        size_t cap = doc->add_cap ? doc->add_cap : 256;
+        while (cap < doc->add_len + len) cap *= 2;
+        char *grown = realloc(doc->add_buf, cap);
+        if (!grown) return -1;
+        doc->add_buf = grown;
+        doc->add_cap = cap;
+    }
+    memcpy(doc->add_buf + doc->add_len, text, len);
+    *start_out = doc->add_len;
+    doc->add_len += len;
+    return 0;
+}
+
+static int pieces_reserve(line_node *ln, size_t need) {
+    if (need <= ln->piece_cap) return 0;
+    size_t cap = ln->piece_cap ? ln->piece_cap : 4;
+    while (cap < need) cap *= 2;
+    line_piece *grown = realloc(ln->pieces, cap * sizeof(line_piece));
+    if (!grown) return -1;
+    ln->pieces = grown;
+    ln->piece_cap = cap;
+    return 0;
+}
+
+// index of the piece holding pos and the offset inside it, pos == length gives (piece_count, 0)
+static size_t piece_at(const line_node *ln, size_t pos, size_t *offset_out) {
+    size_t i = 0;
+    while (i < ln->piece_count && pos >= ln->pieces[i].len) {
+        pos -= ln->pieces[i].len;
+        i++;
+    }
+    *offset_out = pos;
+    return i;
+}
+
+// make a piece start exactly at pos, needs one spare slot, returns that piece's index
+static size_t pieces_cut(line_node *ln, size_t pos) {
+    size_t offset;
+    size_t i = piece_at(ln, pos, &offset);
+    if (offset == 0) return i;
+
+    memmove(&ln->pieces[i + 2], &ln->pieces[i + 1], (ln->piece_count - i - 1) * sizeof(line_piece));
+    ln->pieces[i + 1].start = ln->pieces[i].start + offset;
+    ln->pieces[i + 1].len = ln->pieces[i].len - offset;
+    ln->pieces[i].len = offset;
+    ln->piece_count++;
+    return i + 1;
+}
+
+static int pt_insert(document *doc, line_node *ln, size_t pos, const char *text, size_t len) {
+    if (len == 0) return 0;
+
+    // typing at the end of the last thing typed just grows that piece
+    size_t offset;
+    size_t i = piece_at(ln, pos, &offset);
+    if (offset == 0 && i > 0 && ln->pieces[i - 1].start + ln->pieces[i - 1].len == doc->add_len) {
+        size_t start;
+        if (add_buf_append(doc, text, len, &start) != 0) return -1;
+        ln->pieces[i - 1].len += len;
+        ln->length += len;
+        return 0;
+    }
+
+    size_t start;
+    if (pieces_reserve(ln, ln->piece_count + 2) != 0) return -1;
+    if (add_buf_append(doc, text, len, &start) != 0) return -1;
+
+    i = pieces_cut(ln, pos);
+    memmove(&ln->pieces[i + 1], &ln->pieces[i], (ln->piece_count - i) * sizeof(line_piece));
+    ln->pieces[i].start = start;
+    ln->pieces[i].len = len;
+    ln->piece_count++;
+    ln->length += len;
+    return 0;
+}
+
+static int pt_erase(line_node *ln, size_t pos, size_t len) {
+    if (pieces_reserve(ln, ln->piece_count + 2) != 0) return -1;
+    size_t first = pieces_cut(ln, pos);
+    size_t last = pieces_cut(ln, pos + len);
+    memmove(&ln->pieces[first], &ln->pieces[last], (ln->piece_count - last) * sizeof(line_piece));
+    ln->piece_count -= last - first;
+    ln->length -= len;
+    return 0;
+}
+
+static int pt_split(line_node *ln, size_t pos, line_node *tail) {
+    if (pieces_reserve(ln, ln->piece_count + 1) != 0) return -1;
+    size_t i = pieces_cut(ln, pos);
+    size_t moved = ln->piece_count - i;
+    if (pieces_reserve(tail, moved) != 0) return -1;
+
+    memcpy(tail->pieces, &ln->pieces[i], moved * sizeof(line_piece));
+    tail->piece_count = moved;
+    tail->length = ln->length - pos;
+    ln->piece_count = i;
+    ln->length = pos;
+    return 0;
+}
+
+static int pt_append(line_node *dst, const line_node *src) {
+    if (pieces_reserve(dst, dst->piece_count + src->piece_count) != 0) return -1;
+
+    size_t skip = 0;
+    if (dst->piece_count > 0 && src->piece_count > 0) {
+        line_piece *last = &dst->pieces[dst->piece_count - 1];
+        if (last->start + last->len == src->pieces[0].start) {
+            last->len += src->pieces[0].len;
+            skip = 1;
+        }
+    }
+    memcpy(&dst->pieces[dst->piece_count], &src->pieces[skip], (src->piece_count - skip) * sizeof(line_piece));
+    dst->piece_count += src->piece_count - skip;
+    dst->length += src->length;
+    return 0;
+}
+
+// === Batched inserts ===
+
+// a run of the rebuilt line, either inserted text or bytes [from, from + len) of the old line
+typedef struct {
+    const char *text;
+    size_t from;
+    size_t len;
+} batch_seg;
+
+// lay the inserts out over the old line without moving any bytes yet, returns the segment count
+static size_t batch_layout(const line_node *ln, const line_insert *ins, size_t count, batch_seg *segs, size_t *inserted_out) {
+    size_t nseg = 0;
+    size_t cur_len = ln->length;
+    if (cur_len > 0) segs[nseg++] = (batch_seg){ NULL, 0, cur_len };
+
+    for (size_t k = 0; k < count; k++) {
+        size_t pos = ins[k].pos;
+        if (pos > cur_len || ins[k].len == 0) continue;
+
+        size_t i = 0, acc = 0;
+        while (i < nseg && acc + segs[i].len <= pos) acc += segs[i++].len;
+        if (i < nseg && pos > acc) {
+            // split segment i at pos
+            memmove(&segs[i + 1], &segs[i], (nseg - i) * sizeof(batch_seg));
+            segs[i].len = pos - acc;
+            segs[i + 1].from += pos - acc;
+            segs[i + 1].len -= pos - acc;
+            nseg++;
+            i++;
+        }
+        memmove(&segs[i + 1], &segs[i], (nseg - i) * sizeof(batch_seg));
+        segs[i] = (batch_seg){ ins[k].text, 0, ins[k].len };
+        nseg++;
+        cur_len += ins[k].len;
+    }
+
+    *inserted_out = cur_len - ln->length;
+    return nseg;
+}
+
+static int ll_insert_batch(line_node *ln, const batch_seg *segs, size_t nseg, size_t new_len) {
+    char *new_content = malloc(new_len + 1);
+    if (!new_content) return -1;
+
+    char *out = new_content;
+    for (size_t i = 0; i < nseg; i++) {
+        memcpy(out, segs[i].text ? segs[i].text + segs[i].from : ln->content + segs[i].from, segs[i].len);
+        out += segs[i].len;
+    }
+    new_content[new_len] = '\0';
+
+    free(ln->content);
+    ln->content = new_content;
+    ln->length = new_len;
+    return 0;
+}
+
+static int pt_insert_batch(document *doc, line_node *ln, const batch_seg *segs, size_t nseg, size_t new_len) {
+    // every old piece can be cut in two by an insert, every insert adds at most one piece
+    size_t cap = ln->piece_count + nseg;
+    line_piece *pieces = malloc(cap * sizeof(line_piece));
+    if (!pieces) return -1;
+
+    size_t n = 0;
+    for (size_t s = 0; s < nseg; s++) {
+        if (segs[s].text) {
+            size_t start;
+            if (add_buf_append(doc, segs[s].text + segs[s].from, segs[s].len, &start) != 0) {
+                free(pieces);
+                return -1;
+            }
+            // inserts next to each other end up next to each other in the add buffer too
+            if (n > 0 && pieces[n - 1].start + pieces[n - 1].len == start) {
+                pieces[n - 1].len += segs[s].len;
+            } else {
+                pieces[n++] = (line_piece){ start, segs[s].len };
+            }
+            continue;
+        }
+        size_t offset;
+        size_t i = piece_at(ln, segs[s].from, &offset);
+        size_t left = segs[s].len;
+        while (left > 0) {
+            size_t len = ln->pieces[i].len - offset;
+            if (len > left) len = left;
+            pieces[n++] = (line_piece){ ln->pieces[i].start + offset, len };
+            left -= len;
+            offset = 0;
+            i++;
+        }
+    }
+
+    free(ln->pieces);
+    ln->pieces = pieces;
+    ln->piece_count = n;
+    ln->piece_cap = cap;
+    ln->length = new_len;
+    return 0;
+}
+
+// === Dispatch ===
+
+void line_store_free_engine(document *doc) {
+    free(doc->add_buf);
+    doc->add_buf = NULL;
+    doc->add_len = 0;
+    doc->add_cap = 0;
+}
+
+int line_store_init(document *doc, line_node *ln, const char *text, size_t len) {
+    ln->content = NULL;
+    ln->length = 0;
+    ln->pieces = NULL;
+    ln->piece_count = 0;
+    ln->piece_cap = 0;
+    if (doc->engine == STORAGE_PIECE_TABLE) {
+        return pt_insert(doc, ln, 0, text, len);
+    }
+    return ll_init(ln, text, len);
+}
+
+void line_store_release(document *doc, line_node *ln) {
+    (void)doc;
+    free(ln->content);
+    free(ln->pieces);
+    ln->content = NULL;
+    ln->pieces = NULL;
+    ln->piece_count = 0;
+    ln->piece_cap = 0;
+}
+
+int line_store_insert(document *doc, line_node *ln, size_t pos, const char *text, size_t len) {
+    if (pos > ln->length) return -1;
+    if (doc->engine == STORAGE_PIECE_TABLE) {
+        return pt_insert(doc, ln, pos, text, len);
+    }
+    return ll_insert(ln, pos, text, len);
+}
+
+int line_store_insert_batch(document *doc, line_node *ln, const line_insert *ins, size_t count, size_t *inserted_out) {
+    batch_seg segs[2 * LINE_INSERT_BATCH_MAX + 1];
+    if (count > LINE_INSERT_BATCH_MAX) return -1;
+
+    size_t inserted;
+    size_t nseg = batch_layout(ln, ins, count, segs, &inserted);
+    *inserted_out = 0;
+    if (inserted == 0) return 0;
+
+    int rc = doc->engine == STORAGE_PIECE_TABLE
+        ? pt_insert_batch(doc, ln, segs, nseg, ln->length + inserted)
+        : ll_insert_batch(ln, segs, nseg, ln->length + inserted);
+    if (rc == 0) *inserted_out = inserted;
+    return rc;
+}
+
+int line_store_erase(document *doc, line_node *ln, size_t pos, size_t len) {
+    if (pos > ln->length || len > ln->length - pos) return -1;
+    if (len == 0) return 0;
+    if (doc->engine == STORAGE_PIECE_TABLE) {
+        return pt_erase(ln, pos, len);
+    }
+    return ll_erase(ln, pos, len);
+}
+
+int line_store_split(document *doc, line_node *ln, size_t pos, line_node *tail) {
+    if (pos > ln->length) return -1;
+    if (doc->engine == STORAGE_PIECE_TABLE) {
+        return pt_split(ln, pos, tail);
+    }
+    return ll_split(ln, pos, tail);
+}
+
+int line_store_append(document *doc, line_node *dst, const line_node *src) {
+    if (doc->engine == STORAGE_PIECE_TABLE) {
+        return pt_append(dst, src);
+    }
+    return ll_append(dst, src);
+}
+
+char line_store_char_at(const document *doc, const line_node *ln, size_t i) {
+    if (doc->engine == STORAGE_PIECE_TABLE) {
+        size_t offset;
+        size_t p = piece_at(ln, i, &offset);
+        return doc->add_buf[ln->pieces[p].start + offset];
+    }
+    return ln->content[i];
+}
+
+void line_store_copy(const document *doc, const line_node *ln, size_t from, size_t len, char *out) {
+    if (doc->engine != STORAGE_PIECE_TABLE) {
+        memcpy(out, ln->content + from, len);
+        return;
+    }
+    size_t offset;
+    size_t i = piece_at(ln, from, &offset);
+    while (len > 0 && i < ln->piece_count) {
+        size_t chunk = ln->pieces[i].len - offset;
+        if (chunk > len) chunk = len;
+        memcpy(out, doc->add_buf + ln->pieces[i].start + offset, chunk);
+        out += chunk;
+        len -= chunk;
+        offset = 0;
+        i++;
+    }
+}
+
+void line_store_write(const document *doc, const line_node *ln, FILE *stream) {
+    if (doc->engine != STORAGE_PIECE_TABLE) {
+        if (ln->content) fwrite(ln->content, 1, ln->length, stream);
+        return;
+    }
+    for (size_t i = 0; i < ln->piece_count; i++) {
+        fwrite(doc->add_buf + ln->pieces[i].start, 1, ln->pieces[i].len, stream);
+    }
+}
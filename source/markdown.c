@@ -1,5 +1,11 @@
 #define _GNU_SOURCE
 #include "../libs/markdown.h"
+#include "../libs/line_index.h"
+#include "../libs/line_store.h"
+#include "../libs/flat_cache.h"
+#include "../libs/snapshot.h"
+#include "../libs/deleted_ranges.h"
+#include "../libs/op_history.h"
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
@@ -13,7 +19,10 @@
 #define OUTDATED_VERSION -3
 #define SUCCESS 0
 
-static bool line_is_ordered_list(const line_node *ln);
+#define LINE_POOL_SLAB 256
+#define OP_POOL_SLAB 64
+
+static bool line_is_ordered_list(const document *doc, const line_node *ln);
 static int find_line_and_offset(document *doc, size_t global_pos, line_node **target_line_out, size_t *offset_in_line_out);
 static void apply_insert_op(document *doc, edit_op *op);
 static void apply_delete_op(document *doc, edit_op *op);
@@ -23,45 +32,134 @@ static void apply_all_pending_edits(document *doc);
 static int check_if_start_of_line(document *doc, size_t pos, bool *is_start_of_line);
 
 // helper functions
-static bool line_is_ordered_list(const line_node *ln) {
-    if (!ln || !ln->content || ln->length < 3) return false;
-    if (!isdigit((unsigned char)ln->content[0])) return false;
-    if (ln->content[1] != '.' || ln->content[2] != ' ') return false;
+static bool line_is_ordered_list(const document *doc, const line_node *ln) {
+    if (!ln || ln->length < 3) return false;
+    if (!isdigit((unsigned char)line_store_char_at(doc, ln, 0))) return false;
+    if (line_store_char_at(doc, ln, 1) != '.' || line_store_char_at(doc, ln, 2) != ' ') return false;
     return true;
 }
 
+// A line handle is a pointer plus the generation it was taken at. Line slots come from doc->line_pool and are
+// never handed back to malloc while the document lives, so a stale handle can always be checked safely.
+static bool line_handle_valid(const line_node *ln, uint32_t generation) {
+    return ln && ln->generation == generation;
+}
+
+// unlinked line back to the pool, outstanding handles to it go stale
+static void free_line(document *doc, line_node *ln) {
+    line_store_release(doc, ln);
+    ln->generation++;
+    ln->touch_epoch = 0;
+    obj_pool_free(&doc->line_pool, ln);
+}
+
+// log a change of the flattened text so edits made against this version can be rebased later
+static void record_flat_edit(document *doc, bool insert, size_t pos, size_t len) {
+    op_history_record(&doc->history, doc->version, insert, pos, len);
+}
+
+// remember that the bytes of ln changed during this apply
+static void touch_line(document *doc, line_node *ln) {
+    if (!ln || ln->touch_epoch == doc->touch_epoch) return;
+    if (doc->touched_count == doc->touched_cap) {
+        size_t cap = doc->touched_cap ? doc->touched_cap * 2 : 16;
+        line_handle *grown = realloc(doc->touched, cap * sizeof(line_handle));
+        if (!grown) {
+            doc->touched_lost = true;
+            return;
+        }
+        doc->touched = grown;
+        doc->touched_cap = cap;
+    }
+    ln->touch_epoch = doc->touch_epoch;
+    doc->touched[doc->touched_count++] = (line_handle){ ln, ln->generation };
+}
+
+// ln is about to be unlinked, the lines around it end up next to different bytes
+static void touch_neighbours(document *doc, line_node *ln) {
+    touch_line(doc, ln->prev);
+    touch_line(doc, ln->next);
+}
+
+// turn the touched lines of this apply into the byte range the flat cache has to redo
+static void finish_touched_lines(document *doc) {
+    if (doc->touched_lost) {
+        doc->flat.valid = false;
+        snapshot_note_change(&doc->snaps, 0, 0);
+    } else if (doc->touched_count > 0) {
+        size_t flat_len = line_index_flat_length(doc);
+        size_t lo = flat_len;
+        size_t hi = 0;
+        for (size_t i = 0; i < doc->touched_count; i++) {
+            line_handle h = doc->touched[i];
+            if (!line_handle_valid(h.ln, h.gen)) continue;
+            size_t start = line_index_offset_of(h.ln);
+            if (start < lo) lo = start;
+            if (start + h.ln->length > hi) hi = start + h.ln->length;
+        }
+        if (lo > hi) {
+            lo = 0;
+            hi = flat_len;
+        }
+        flat_cache_note_change(&doc->flat, lo, flat_len - hi);
+        snapshot_note_change(&doc->snaps, lo, flat_len - hi);
+    }
+
+    doc->touched_count = 0;
+    doc->touched_lost = false;
+    if (++doc->touch_epoch == 0) doc->touch_epoch = 1;
+}
+
 // free line_nodes
-static void free_line_nodes(line_node *head) {
+static void free_line_nodes(document *doc, line_node *head) {
     line_node *current = head;
     while (current) {
         line_node *next = current->next;
-        free(current->content);
-        free(current);
+        free_line(doc, current);
         current = next;
     }
 }
 
-// free edit_ops
-static void free_edit_ops(edit_op *head) {
+// free edit_ops, their text lives in doc->text_arena
+static void free_edit_ops(document *doc, edit_op *head) {
     edit_op *current = head;
     while (current) {
         edit_op *next = current->next;
-        if (current->text) {
-            free(current->text);
-        }
-        free(current);
+        obj_pool_free(&doc->op_pool, current);
         current = next;
     }
 }
 
+static edit_op *new_edit_op(document *doc, edit_type type, line_node *target, size_t pos, size_t len) {
+    edit_op *op = obj_pool_alloc(&doc->op_pool);
+    if (!op) return NULL;
+    op->type = type;
+    op->target = target;
+    op->target_gen = target ? target->generation : 0;
+    op->pos = pos;
+    op->text = NULL;
+    op->len = len;
+    op->new_type = LINE_NORMAL;
+    op->new_metadata = 0;
+    op->next = NULL;
+    return op;
+}
+
+// append to pending_edits queue using tail pointer
+static void queue_edit_op(document *doc, edit_op *op) {
+    if (!doc->pending_edits) {
+        doc->pending_edits = op;
+    } else {
+        doc->pending_edits_tail->next = op;
+    }
+    doc->pending_edits_tail = op;
+}
+
 static int find_line_and_offset(document *doc, size_t global_pos, line_node **target_line_out, size_t *offset_in_line_out) {
     if (!doc || !target_line_out || !offset_in_line_out) {
         return INVALID_CURSOR_POS;
     }
 
-    line_node *current_ln = doc->head;
-    size_t chars_before_current_line = 0;
-
     if (doc->head == NULL) { 
         if (global_pos == 0) {
             *target_line_out = NULL;
@@ -71,30 +169,14 @@ static int find_line_and_offset(document *doc, size_t global_pos, line_node **ta
         return INVALID_CURSOR_POS;
     }
 
-    while (current_ln) {
-        size_t is_last = (current_ln->next == NULL);
-        
-        if (global_pos <= chars_before_current_line + current_ln->length) {
-            *target_line_out = current_ln;
-            *offset_in_line_out = global_pos - chars_before_current_line;
-            return SUCCESS;
-        }
-        
-        if (!is_last) {
-            chars_before_current_line += current_ln->length + 1;
-        } else {
-            chars_before_current_line += current_ln->length;
-        }
-        
-        current_ln = (struct line_node *)current_ln->next;
-    }
-    
-    if (global_pos == chars_before_current_line) {
-        *target_line_out = NULL;
-        *offset_in_line_out = 0;
-        return SUCCESS;
+    // every line weighs length + 1 in the index, so the position right after the
+    // last character of the last line still resolves to that line
+    line_node *found = line_index_find(doc, global_pos, offset_in_line_out);
+    if (!found) {
+        return INVALID_CURSOR_POS;
     }
-    return INVALID_CURSOR_POS;
+    *target_line_out = found;
+    return SUCCESS;
 }
 
 // apply insert
@@ -104,43 +186,23 @@ static void apply_insert_op(document *doc, edit_op *op) {
     char *text_to_insert = op->text;
     size_t text_len = op->len;
 
-    bool need_retarget = false;
-    if (!doc->head) {
-        need_retarget = true;
-    } else {
-        line_node *current = doc->head;
-        bool found = false;
-        while(current){
-            if(current == target_line){
-                found = true;
-                break;
-            }
-            current = (line_node*)current->next;
-        }
-        if(!found) need_retarget = true;
-    }
-    if (need_retarget) {
+    // the target may have been merged away or compacted since the op was queued
+    if (!doc->head || !line_handle_valid(target_line, op->target_gen)) {
         target_line = doc->head;
         ins_pos_in_line  = 0;
         op->target = doc->head;
+        op->target_gen = doc->head ? doc->head->generation : 0;
         op->pos = 0;
     }
 
     if (target_line == NULL) { 
         if (doc->head == NULL && ins_pos_in_line == 0) {
-            char *new_content = malloc(text_len + 1);
-            if (!new_content) return;
-            memcpy(new_content, text_to_insert, text_len);
-            new_content[text_len] = '\0';
-
-            line_node *new_ln = malloc(sizeof(line_node));
-            if (!new_ln) {
-                free(new_content);
+            line_node *new_ln = obj_pool_alloc(&doc->line_pool);
+            if (!new_ln) return;
+            if (line_store_init(doc, new_ln, text_to_insert, text_len) != 0) {
+                free_line(doc, new_ln);
                 return;
             }
-            
-            new_ln->content = new_content;
-            new_ln->length = text_len;
             new_ln->type = LINE_NORMAL;
             new_ln->metadata = 0;
             new_ln->prev = NULL;
@@ -150,6 +212,9 @@ static void apply_insert_op(document *doc, edit_op *op) {
             doc->tail = new_ln;
             doc->line_count = 1;
             doc->total_length = text_len;
+            line_index_insert_after(doc, NULL, new_ln);
+            touch_line(doc, new_ln);
+            record_flat_edit(doc, true, 0, text_len);
         } else {
             target_line = doc->head;
             ins_pos_in_line = 0;
@@ -157,24 +222,11 @@ static void apply_insert_op(document *doc, edit_op *op) {
     }
     if (target_line != NULL) {
         if (ins_pos_in_line > target_line->length) return;
-        
-        char *old_content = target_line->content;
-        size_t old_len = target_line->length;
-        size_t new_total_len = old_len + text_len;
-        char *new_content_buf = malloc(new_total_len + 1);
-        if (!new_content_buf) return;
-
-        memcpy(new_content_buf, old_content, ins_pos_in_line);
-        memcpy(new_content_buf + ins_pos_in_line, text_to_insert, text_len);
-        memcpy(new_content_buf + ins_pos_in_line + text_len,
-            old_content + ins_pos_in_line,
-            old_len - ins_pos_in_line);
-        new_content_buf[new_total_len] = '\0';
-        
-        free(old_content);
-        target_line->content = new_content_buf;
-        target_line->length = new_total_len;
+        if (line_store_insert(doc, target_line, ins_pos_in_line, text_to_insert, text_len) != 0) return;
         doc->total_length += text_len;
+        line_index_update(target_line);
+        touch_line(doc, target_line);
+        record_flat_edit(doc, true, line_index_offset_of(target_line) + ins_pos_in_line, text_len);
     }
 }
 
@@ -192,31 +244,22 @@ static void apply_delete_op(document *doc, edit_op *op) {
     }
     if (actual_del_len == 0) return;
 
-    doc->total_length -= actual_del_len;
-
-    if (actual_del_len == target_line->length && del_pos_in_line == 0) {
-        free(target_line->content);
-        target_line->content = malloc(1);
-        if (!target_line->content) {
-            target_line->length = 0;
-        } else {
-            target_line->content[0] = '\0';
-            target_line->length = 0;
-        }
-        return;
-    } else if (del_pos_in_line + actual_del_len == target_line->length && target_line->next) {
+    if (del_pos_in_line + actual_del_len == target_line->length && del_pos_in_line > 0 && target_line->next) {
+        // deleting up to the end of the line pulls the next line up
         line_node *nxt = (line_node*)target_line->next;
-        
-        size_t new_len = del_pos_in_line + nxt->length;
-        char *new_content = realloc(target_line->content, new_len + 1);
-        
-        if (!new_content) return;
-
-        memcpy(new_content + del_pos_in_line, nxt->content, nxt->length);
-        new_content[new_len] = '\0';
-        
-        target_line->content = new_content;
-        target_line->length = new_len;
+        size_t flat_pos = line_index_offset_of(target_line) + del_pos_in_line;
+        if (line_store_erase(doc, target_line, del_pos_in_line, actual_del_len) != 0) return;
+        doc->total_length -= actual_del_len;
+        touch_line(doc, target_line);
+        if (line_store_append(doc, target_line, nxt) != 0) {
+            line_index_update(target_line);
+            record_flat_edit(doc, false, flat_pos, actual_del_len);
+            return;
+        }
+        line_index_update(target_line);
+        touch_neighbours(doc, nxt);
+        // the separator before nxt goes too
+        record_flat_edit(doc, false, flat_pos, actual_del_len + 1);
         
         target_line->next = nxt->next;
         if (nxt->next) {
@@ -224,32 +267,33 @@ static void apply_delete_op(document *doc, edit_op *op) {
         } else {
             doc->tail = target_line;
         }
+        line_index_remove(doc, nxt);
         
-        free(nxt->content);
-        free(nxt);
+        free_line(doc, nxt);
         
         doc->line_count--;
-    } else {
-        char *content = target_line->content;
-        size_t old_len = target_line->length;
-        memmove(content + del_pos_in_line, 
-                content + del_pos_in_line + actual_del_len,
-                old_len - (del_pos_in_line + actual_del_len));
-        
-        size_t new_len = old_len - actual_del_len;
-        char *shrunk_content = realloc(content, new_len + 1);
-        if (!shrunk_content && new_len > 0) {
-            return;
-        }
-        if (!shrunk_content && new_len == 0) {
-            free(content); 
-            shrunk_content = malloc(1); 
-            if(shrunk_content) shrunk_content[0] = '\0'; else return;
-        }
-        target_line->content = shrunk_content;
-        target_line->length = new_len;
-        target_line->content[new_len] = '\0';
+        return;
+    }
+
+    if (line_store_erase(doc, target_line, del_pos_in_line, actual_del_len) != 0) return;
+    doc->total_length -= actual_del_len;
+    line_index_update(target_line);
+    touch_line(doc, target_line);
+    record_flat_edit(doc, false, line_index_offset_of(target_line) + del_pos_in_line, actual_del_len);
+}
+
+static line_node *new_empty_line(document *doc, line_type type, int metadata) {
+    line_node *ln = obj_pool_alloc(&doc->line_pool);
+    if (!ln) return NULL;
+    if (line_store_init(doc, ln, "", 0) != 0) {
+        free_line(doc, ln);
+        return NULL;
     }
+    ln->type = type;
+    ln->metadata = metadata;
+    ln->prev = NULL;
+    ln->next = NULL;
+    return ln;
 }
 
 // split line
@@ -259,88 +303,35 @@ static void apply_split_line_op(document *doc, edit_op *op) {
 
     if (line_to_split == NULL) {
         if (doc->head == NULL && split_pos_in_line == 0) {
-            line_node *first_new = malloc(sizeof(line_node));
+            line_node *first_new = new_empty_line(doc, LINE_NORMAL, 0);
             if (!first_new) return;
-            first_new->content = malloc(1);
-            if(first_new->content) first_new->content[0] = '\0';
-            else {
-                free(first_new);
-                return;
-            }
-            first_new->length = 0; 
-            first_new->type = LINE_NORMAL;
-            first_new->metadata = 0;
-            first_new->prev = NULL;
-
-            line_node *second_new = malloc(sizeof(line_node));
+            line_node *second_new = new_empty_line(doc, op->new_type, op->new_metadata);
             if (!second_new) {
-                free(first_new->content);
-                free(first_new);
+                free_line(doc, first_new);
                 return;
             }
-            second_new->content = malloc(1);
-            if(second_new->content) second_new->content[0] = '\0';
-            else {
-                free(second_new);
-                free(first_new->content);
-                free(first_new);
-                
-            }
-            second_new->length = 0;
-            second_new->type = op->new_type;
-            second_new->metadata = op->new_metadata;
             second_new->prev = (struct line_node*)first_new; 
-            second_new->next = NULL;
-
             first_new->next = (struct line_node*)second_new;
             doc->head = first_new;
             doc->tail = second_new;
             doc->line_count = 2;
-        } else {
-            return;
+            line_index_insert_after(doc, NULL, first_new);
+            line_index_insert_after(doc, first_new, second_new);
+            touch_line(doc, first_new);
+            touch_line(doc, second_new);
+            record_flat_edit(doc, true, 0, 1);
         }
         return;
     }
 
     if (split_pos_in_line > line_to_split->length) return;
 
-    size_t second_part_len = line_to_split->length - split_pos_in_line;
-    char *second_part_str = malloc(second_part_len + 1);
-    if (!second_part_str) return;
-    memcpy(second_part_str, line_to_split->content + split_pos_in_line, second_part_len);
-    second_part_str[second_part_len] = '\0';
-
-    line_node *new_line_after_split = malloc(sizeof(line_node));
-    if (!new_line_after_split) {
-        free(second_part_str);
+    line_node *new_line_after_split = new_empty_line(doc, op->new_type, op->new_metadata);
+    if (!new_line_after_split) return;
+    if (line_store_split(doc, line_to_split, split_pos_in_line, new_line_after_split) != 0) {
+        free_line(doc, new_line_after_split);
         return;
     }
-    new_line_after_split->content = second_part_str;
-    new_line_after_split->length = second_part_len;
-    new_line_after_split->type = op->new_type;
-    new_line_after_split->metadata = op->new_metadata;
-
-    // Truncate original line
-    size_t first_part_new_len = split_pos_in_line;
-    char *temp_first_content = realloc(line_to_split->content, first_part_new_len + 1);
-    if (!temp_first_content && first_part_new_len > 0) { 
-        // Preserve old buffer on failure
-        free(new_line_after_split->content);
-        free(new_line_after_split);
-        return; 
-    }
-    if (!temp_first_content && first_part_new_len == 0) {
-        free(line_to_split->content);
-        temp_first_content = malloc(1);
-        if(temp_first_content) temp_first_content[0] = '\0'; else {
-            free(new_line_after_split->content);
-            free(new_line_after_split);
-            return;
-        }
-    }
-    line_to_split->content = temp_first_content;
-    line_to_split->length = first_part_new_len;
-    line_to_split->content[first_part_new_len] = '\0';
     
     // Link new_line_after_split
     new_line_after_split->next = line_to_split->next;
@@ -352,6 +343,11 @@ static void apply_split_line_op(document *doc, edit_op *op) {
     }
     line_to_split->next = (struct line_node*)new_line_after_split;
     doc->line_count++;
+    line_index_update(line_to_split);
+    line_index_insert_after(doc, line_to_split, new_line_after_split);
+    touch_line(doc, line_to_split);
+    touch_line(doc, new_line_after_split);
+    record_flat_edit(doc, true, line_index_offset_of(line_to_split) + split_pos_in_line, 1);
 }
 
 // merge line
@@ -363,20 +359,13 @@ static void apply_merge_line_op(document *doc, edit_op *op) {
     }
     
     line_node *next_line = (line_node*)target_line->next;
-    
-    // Calculate new length
-    size_t new_len = target_line->length + next_line->length;
-    
-    char *new_content = realloc(target_line->content, new_len + 1);
-    if (!new_content) {
+    size_t separator_pos = line_index_offset_of(target_line) + target_line->length;
+    if (line_store_append(doc, target_line, next_line) != 0) {
         return;
     }
-    
-    memcpy(new_content + target_line->length, next_line->content, next_line->length);
-    new_content[new_len] = '\0';
-    
-    target_line->content = new_content;
-    target_line->length = new_len;
+    record_flat_edit(doc, false, separator_pos, 1);
+    touch_line(doc, target_line);
+    touch_neighbours(doc, next_line);
     
     // Fix links
     target_line->next = next_line->next;
@@ -385,38 +374,123 @@ static void apply_merge_line_op(document *doc, edit_op *op) {
     } else {
         doc->tail = target_line;
     }
+    line_index_remove(doc, next_line);
+    line_index_update(target_line);
 
-    free(next_line->content);
-    free(next_line);
+    free_line(doc, next_line);
 
     doc->line_count--;
 }
 
+// unlink ln if it ended up empty with no metadata to keep it around
+static void compact_line(document *doc, line_node *ln) {
+    if (ln->length != 0 || ln->metadata != 0) return;
+
+    // an empty line is nothing but one separator in the flattened text
+    if (ln->next) record_flat_edit(doc, false, line_index_offset_of(ln), 1);
+    else if (ln->prev) record_flat_edit(doc, false, line_index_offset_of(ln) - 1, 1);
+    touch_neighbours(doc, ln);
+    if (ln->prev) ((line_node*)ln->prev)->next = ln->next;
+    else doc->head = (line_node*)ln->next;
+    if (ln->next) ((line_node*)ln->next)->prev = ln->prev;
+    else doc->tail = (line_node*)ln->prev;
+    line_index_remove(doc, ln);
+    free_line(doc, ln);
+    doc->line_count--;
+}
+
+// every line that can have become empty during this apply is in the touched list,
+// the rest were already compacted by an earlier apply
+static void compact_touched_lines(document *doc) {
+    if (doc->touched_lost) {
+        line_node *ln = doc->head;
+        while (ln) {
+            line_node *next = (line_node*)ln->next;
+            compact_line(doc, ln);
+            ln = next;
+        }
+        return;
+    }
+    // compact_line touches neighbours, so the list can grow (and move) while we walk it
+    for (size_t i = 0; i < doc->touched_count; i++) {
+        line_handle h = doc->touched[i];
+        if (line_handle_valid(h.ln, h.gen)) compact_line(doc, h.ln);
+    }
+}
+
+// an insert queued inside a range deleted earlier in this version lands where that range started
+static void rebase_insert(const document *doc, edit_op *op) {
+    size_t rebased;
+    if (deleted_ranges_lookup(&doc->deleted, op->target, op->target_gen, op->pos, &rebased)) {
+        op->pos = rebased;
+    }
+}
+
+// consecutive inserts into one live line, rebuilt once instead of once per op.
+// Returns the first op after the run, the ops of the run are freed
+static edit_op *apply_insert_run(document *doc, edit_op *first) {
+    line_node *ln = first->target;
+    line_insert batch[LINE_INSERT_BATCH_MAX];
+    size_t n = 0;
+
+    edit_op *end = first;
+    while (end && n < LINE_INSERT_BATCH_MAX && end->type == EDIT_INSERT
+           && end->target == ln && end->target_gen == first->target_gen) {
+        rebase_insert(doc, end);
+        batch[n++] = (line_insert){ end->pos, end->text, end->len };
+        end = end->next;
+    }
+
+    size_t inserted = 0;
+    if (n == 1 || line_store_insert_batch(doc, ln, batch, n, &inserted) != 0) {
+        // single op, or no memory for the rebuild: one op at a time
+        for (edit_op *op = first; op != end; op = op->next) apply_insert_op(doc, op);
+    } else if (inserted > 0) {
+        doc->total_length += inserted;
+        line_index_update(ln);
+        touch_line(doc, ln);
+
+        size_t line_pos = line_index_offset_of(ln);
+        size_t cur_len = ln->length - inserted;
+        for (size_t i = 0; i < n; i++) {
+            if (batch[i].pos > cur_len) continue;
+            record_flat_edit(doc, true, line_pos + batch[i].pos, batch[i].len);
+            cur_len += batch[i].len;
+        }
+    }
+
+    while (first != end) {
+        edit_op *next = first->next;
+        obj_pool_free(&doc->op_pool, first);
+        first = next;
+    }
+    return end;
+}
+
 // edit pending edit
 static void apply_all_pending_edits(document *doc) {
-    typedef struct { line_node *ln; size_t pos, len; } del_region;
-    del_region dels[16];
-    size_t nd = 0;
-
     edit_op *cur = doc->pending_edits;
     while (cur) {
         edit_op *next = cur->next;
 
+        // inserts retarget themselves, anything else aimed at a line that is gone is dropped
+        if (cur->type != EDIT_INSERT && cur->target && !line_handle_valid(cur->target, cur->target_gen)) {
+            obj_pool_free(&doc->op_pool, cur);
+            cur = next;
+            continue;
+        }
+
         if (cur->type == EDIT_DELETE) {
-            if (nd < 16)
-                dels[nd++] = (del_region){ cur->target, cur->pos, cur->len };
+            // out of memory only costs the rebasing of inserts into this range
+            deleted_ranges_add(&doc->deleted, cur->target, cur->target_gen, cur->pos, cur->len);
             apply_delete_op(doc, cur);
         }
+        else if (cur->type == EDIT_INSERT && doc->head && line_handle_valid(cur->target, cur->target_gen)) {
+            cur = apply_insert_run(doc, cur);
+            continue;
+        }
         else if (cur->type == EDIT_INSERT) {
-            for (size_t i = 0; i < nd; i++) {
-                if (cur->target == dels[i].ln
-                    && cur->pos  >= dels[i].pos
-                    && cur->pos  <  dels[i].pos + dels[i].len)
-                {
-                    cur->pos = dels[i].pos;
-                    break;
-                }
-            }
+            rebase_insert(doc, cur);
             apply_insert_op(doc, cur);
         }
         else {           
@@ -426,37 +500,65 @@ static void apply_all_pending_edits(document *doc) {
               case EDIT_CHANGE_TYPE:
                 cur->target->type     = cur->new_type;
                 cur->target->metadata = cur->new_metadata;
+                touch_line(doc, cur->target);
                 break;
               default: break;
             }
         }
 
-        if (cur->text) free(cur->text);
-        free(cur);
+        obj_pool_free(&doc->op_pool, cur);
         cur = next;
     }
 
-    line_node *ln = doc->head;
-    while (ln) {
-        line_node *next = (line_node*)ln->next;
-        if (ln->length == 0 && ln->content && ln->content[0] == '\0' && ln->metadata == 0) {
-            if (ln->prev) ((line_node*)ln->prev)->next = ln->next;
-            else doc->head = (line_node*)ln->next;
-            if (ln->next) ((line_node*)ln->next)->prev = ln->prev;
-            else doc->tail = (line_node*)ln->prev;
-            free(ln->content);
-            free(ln);
-            doc->line_count--;
-        }
-        ln = next;
-    }
+    compact_touched_lines(doc);
 
     doc->pending_edits = NULL;
     doc->pending_edits_tail = NULL;
+    deleted_ranges_clear(&doc->deleted);
+    // nothing references op text anymore
+    arena_reset(&doc->text_arena);
+    finish_touched_lines(doc);
+}
+
+// Carry start (and end, if given) of an edit made against an older version onto doc->version, caller holds
+// doc->lock. A position that fell inside text deleted since is a conflict, unless clamp is set (a delete just
+// shrinks to what is left)
+static int rebase_locked(document *doc, uint64_t version, size_t *start, size_t *end, bool clamp) {
+    if (version == doc->version) return SUCCESS;
+
+    int start_hit = op_history_rebase(&doc->history, version, doc->version, start, REBASE_STICK_AFTER);
+    if (start_hit < 0) return OUTDATED_VERSION;
+    int end_hit = 0;
+    if (end) {
+        end_hit = op_history_rebase(&doc->history, version, doc->version, end, REBASE_STICK_BEFORE);
+        if (end_hit < 0) return OUTDATED_VERSION;
+        // an empty range with text inserted right at it
+        if (*end < *start) *end = *start;
+    }
+    if ((start_hit || end_hit) && !clamp) return DELETE_POSITION;
+    return SUCCESS;
+}
+
+// rebase_locked for entry points that do not hold the lock, *version becomes the version the positions refer to
+static int rebase_edit(document *doc, uint64_t *version, size_t *start, size_t *end, bool clamp) {
+    pthread_mutex_lock(&doc->lock);
+    // a version from the future is left to the inner calls to reject, in their usual order of checks
+    if (*version >= doc->version) {
+        pthread_mutex_unlock(&doc->lock);
+        return SUCCESS;
+    }
+    int rc = rebase_locked(doc, *version, start, end, clamp);
+    if (rc == SUCCESS) *version = doc->version;
+    pthread_mutex_unlock(&doc->lock);
+    return rc;
 }
 
 // === Init and Free ===
 document *markdown_init(void) {
+    return markdown_init_with_engine(STORAGE_LINKED_LIST);
+}
+
+document *markdown_init_with_engine(storage_engine engine) {
     document *doc = malloc(sizeof(document));
     if (!doc) {
         return NULL;
@@ -469,6 +571,23 @@ document *markdown_init(void) {
     pthread_mutex_init(&doc->lock, NULL);
     doc->pending_edits = NULL;
     doc->pending_edits_tail = NULL;
+    line_index_init(doc);
+    doc->engine = engine;
+    doc->add_buf = NULL;
+    doc->add_len = 0;
+    doc->add_cap = 0;
+    obj_pool_init(&doc->line_pool, sizeof(line_node), LINE_POOL_SLAB);
+    obj_pool_init(&doc->op_pool, sizeof(edit_op), OP_POOL_SLAB);
+    arena_init(&doc->text_arena);
+    doc->touched = NULL;
+    doc->touched_count = 0;
+    doc->touched_cap = 0;
+    doc->touch_epoch = 1;
+    doc->touched_lost = false;
+    flat_cache_init(&doc->flat);
+    snapshot_state_init(&doc->snaps);
+    deleted_ranges_init(&doc->deleted);
+    op_history_init(&doc->history, doc->version);
     
     return doc;
 }
@@ -479,11 +598,20 @@ void markdown_free(document *doc) {
         return;
     }
     pthread_mutex_destroy(&doc->lock);
-    free_line_nodes(doc->head);
+    free_line_nodes(doc, doc->head);
     doc->head = NULL;
     doc->tail = NULL; 
-    free_edit_ops(doc->pending_edits);
+    free_edit_ops(doc, doc->pending_edits);
     doc->pending_edits = NULL;
+    line_store_free_engine(doc);
+    obj_pool_destroy(&doc->line_pool);
+    obj_pool_destroy(&doc->op_pool);
+    arena_destroy(&doc->text_arena);
+    free(doc->touched);
+    flat_cache_free(&doc->flat);
+    snapshot_state_free(&doc->snaps);
+    deleted_ranges_free(&doc->deleted);
+    op_history_free(&doc->history);
     free(doc);
 }
 
@@ -500,9 +628,10 @@ int markdown_insert(document *doc, uint64_t version, size_t pos, const char *con
 
     pthread_mutex_lock(&doc->lock);
 
-    if (version != doc->version) {
+    int rebased = rebase_locked(doc, version, &pos, NULL, false);
+    if (rebased != SUCCESS) {
         pthread_mutex_unlock(&doc->lock);
-        return OUTDATED_VERSION;
+        return rebased;
     }
 
     line_node *target_node = NULL;
@@ -514,32 +643,19 @@ int markdown_insert(document *doc, uint64_t version, size_t pos, const char *con
         return INVALID_CURSOR_POS;
     }
 
-    edit_op *new_op = malloc(sizeof(edit_op));
+    size_t content_len = strlen(content);
+    edit_op *new_op = new_edit_op(doc, EDIT_INSERT, target_node, offset_in_node, content_len);
     if (!new_op) {
         pthread_mutex_unlock(&doc->lock);
         return INVALID_CURSOR_POS;
     }
-
-    new_op->type = EDIT_INSERT;
-    new_op->target = target_node;
-    new_op->pos = offset_in_node;
-    new_op->text = strdup(content);
+    new_op->text = arena_strndup(&doc->text_arena, content, content_len);
     if (!new_op->text) {
-        free(new_op);
+        obj_pool_free(&doc->op_pool, new_op);
         pthread_mutex_unlock(&doc->lock);
         return INVALID_CURSOR_POS;
     }
-    new_op->len = strlen(content);
-    new_op->new_type = LINE_NORMAL;
-    new_op->new_metadata = 0;
-    new_op->next = NULL;
-
-    if (!doc->pending_edits) {
-        doc->pending_edits = new_op;
-    } else {
-        doc->pending_edits_tail->next = new_op;
-    }
-    doc->pending_edits_tail = new_op;
+    queue_edit_op(doc, new_op);
     
     pthread_mutex_unlock(&doc->lock);
     return SUCCESS;
@@ -556,10 +672,19 @@ int markdown_delete(document *doc, uint64_t version, size_t pos, size_t len) {
 
     pthread_mutex_lock(&doc->lock);
 
-    if (version != doc->version) {
+    size_t end = pos + len;
+    int rebased = rebase_locked(doc, version, &pos, &end, true);
+    if (rebased != SUCCESS) {
         pthread_mutex_unlock(&doc->lock);
-        return OUTDATED_VERSION;
+        return rebased;
+    }
+    // already gone by now, nothing left to do
+    if (end == pos) {
+        pthread_mutex_unlock(&doc->lock);
+        return SUCCESS;
     }
+    len = end - pos;
+    version = doc->version;
 
     line_node *current_line_node;
     size_t offset_in_first_node;
@@ -581,22 +706,10 @@ int markdown_delete(document *doc, uint64_t version, size_t pos, size_t len) {
         size_t chars_to_delete = len - 1;
 
         if (chars_to_delete > 0) {
-            edit_op *del_op = malloc(sizeof(edit_op));
+            edit_op *del_op = new_edit_op(doc, EDIT_DELETE, next_line, 0,
+                                          chars_to_delete > next_line->length ? next_line->length : chars_to_delete);
             if (!del_op) { pthread_mutex_unlock(&doc->lock); return INVALID_CURSOR_POS; }
-            del_op->type = EDIT_DELETE;
-            del_op->target = next_line;
-            del_op->pos = 0;
-            del_op->len = chars_to_delete > next_line->length ? next_line->length : chars_to_delete;
-            del_op->text = NULL;
-            del_op->new_type = LINE_NORMAL;
-            del_op->new_metadata = 0;
-            del_op->next = NULL;
-
-            if (!doc->pending_edits)
-                doc->pending_edits = del_op;
-            else
-                doc->pending_edits_tail->next = del_op;
-            doc->pending_edits_tail = del_op;
+            queue_edit_op(doc, del_op);
 
             if (chars_to_delete > next_line->length) {
                 pthread_mutex_unlock(&doc->lock);
@@ -605,22 +718,9 @@ int markdown_delete(document *doc, uint64_t version, size_t pos, size_t len) {
             }
         }
 
-        edit_op *merge_op = malloc(sizeof(edit_op));
+        edit_op *merge_op = new_edit_op(doc, EDIT_MERGE_LINE, current_line_node, 0, 0);
         if (!merge_op) { pthread_mutex_unlock(&doc->lock); return INVALID_CURSOR_POS; }
-        merge_op->type = EDIT_MERGE_LINE;
-        merge_op->target = current_line_node;
-        merge_op->pos = 0;
-        merge_op->len = 0;
-        merge_op->text = NULL;
-        merge_op->new_type = LINE_NORMAL;
-        merge_op->new_metadata = 0;
-        merge_op->next = NULL;
-
-        if (!doc->pending_edits)
-            doc->pending_edits = merge_op;
-        else
-            doc->pending_edits_tail->next = merge_op;
-        doc->pending_edits_tail = merge_op;
+        queue_edit_op(doc, merge_op);
 
         pthread_mutex_unlock(&doc->lock);
         return SUCCESS;
@@ -635,52 +735,23 @@ int markdown_delete(document *doc, uint64_t version, size_t pos, size_t len) {
                                                 remaining_len_to_delete : chars_available_in_node_from_offset;
 
         if (chars_to_delete_this_iteration > 0) {
-            edit_op *op = malloc(sizeof(edit_op));
+            edit_op *op = new_edit_op(doc, EDIT_DELETE, current_line_node, current_offset_in_node,
+                                      chars_to_delete_this_iteration);
             if (!op) {
                 pthread_mutex_unlock(&doc->lock);
                 return INVALID_CURSOR_POS; 
             }
-            op->type = EDIT_DELETE;
-            op->target = current_line_node;
-            op->pos = current_offset_in_node; 
-            op->len = chars_to_delete_this_iteration;
-            op->text = NULL; 
-            op->new_type = LINE_NORMAL; 
-            op->new_metadata = 0; 
-            op->next = NULL;
-
-            // Append to pending_edits queue using tail pointer
-            if (!doc->pending_edits) {
-                doc->pending_edits = op;
-            } else {
-                doc->pending_edits_tail->next = op;
-            }
-            doc->pending_edits_tail = op;
+            queue_edit_op(doc, op);
             
             if (current_offset_in_node + chars_to_delete_this_iteration == current_line_node->length && 
                 current_line_node->next && remaining_len_to_delete > chars_to_delete_this_iteration) {
                 // Add a merge operation
-                edit_op *merge_op = malloc(sizeof(edit_op));
+                edit_op *merge_op = new_edit_op(doc, EDIT_MERGE_LINE, current_line_node, 0, 0);
                 if (!merge_op) {
                     pthread_mutex_unlock(&doc->lock);
                     return INVALID_CURSOR_POS;
                 }
-                merge_op->type = EDIT_MERGE_LINE;
-                merge_op->target = current_line_node;
-                merge_op->pos = 0;
-                merge_op->len = 0;
-                merge_op->text = NULL;
-                merge_op->new_type = LINE_NORMAL;
-                merge_op->new_metadata = 0;
-                merge_op->next = NULL;
-                
-                // Append to pending_edits using tail pointer
-                if (!doc->pending_edits) {
-                    doc->pending_edits = merge_op;
-                } else {
-                    doc->pending_edits_tail->next = merge_op;
-                }
-                doc->pending_edits_tail = merge_op;
+                queue_edit_op(doc, merge_op);
                 remaining_len_to_delete -= 1;
             }
         }
@@ -706,9 +777,10 @@ int markdown_newline(document *doc, uint64_t version, size_t pos) {
 
     pthread_mutex_lock(&doc->lock);
 
-    if (version != doc->version) {
+    int rebased = rebase_locked(doc, version, &pos, NULL, false);
+    if (rebased != SUCCESS) {
         pthread_mutex_unlock(&doc->lock);
-        return OUTDATED_VERSION;
+        return rebased;
     }
 
     line_node *target_node = NULL;
@@ -722,27 +794,13 @@ int markdown_newline(document *doc, uint64_t version, size_t pos) {
         return INVALID_CURSOR_POS; 
     }
     
-    edit_op *new_op = malloc(sizeof(edit_op));
+    edit_op *new_op = new_edit_op(doc, EDIT_SPLIT_LINE, target_node, offset_in_node, 0);
     if (!new_op) {
         pthread_mutex_unlock(&doc->lock);
         return INVALID_CURSOR_POS; 
     }
-
-    new_op->type = EDIT_SPLIT_LINE;
-    new_op->target = target_node; 
-    new_op->pos = offset_in_node;
-    new_op->text = NULL;
-    new_op->len = 0;
-    new_op->new_type = LINE_NORMAL;
     new_op->new_metadata = 1;
-    new_op->next = NULL;
-
-    if (!doc->pending_edits) {
-        doc->pending_edits = new_op;
-    } else {
-        doc->pending_edits_tail->next = new_op;
-    }
-    doc->pending_edits_tail = new_op;
+    queue_edit_op(doc, new_op);
 
     pthread_mutex_unlock(&doc->lock);
     return SUCCESS;
@@ -770,9 +828,8 @@ static int check_if_start_of_line(document *doc, size_t pos, bool *is_start_of_l
         return SUCCESS;
     }
 
-    if (prev_char_line->content &&
-        offset_in_prev_char_line < prev_char_line->length) {
-        if (prev_char_line->content[offset_in_prev_char_line] == '\n') {
+    if (offset_in_prev_char_line < prev_char_line->length) {
+        if (line_store_char_at(doc, prev_char_line, offset_in_prev_char_line) == '\n') {
             *is_start_of_line = true;
         } else {
             *is_start_of_line = false;
@@ -789,6 +846,8 @@ int markdown_heading(document *doc, uint64_t version, size_t level, size_t pos)
     if (!doc || level == 0 || level > 6) {
         return INVALID_CURSOR_POS;
     }
+    int rebased = rebase_edit(doc, &version, &pos, NULL, false);
+    if (rebased != SUCCESS) return rebased;
 
     line_node *target_node_check = NULL;
     size_t offset_in_node_check = 0;
@@ -827,6 +886,8 @@ int markdown_bold(document *doc, uint64_t version, size_t start, size_t end) {
     if (!doc || start > end) {
         return INVALID_CURSOR_POS;
     }
+    int rebased = rebase_edit(doc, &version, &start, &end, false);
+    if (rebased != SUCCESS) return rebased;
 
     int result = markdown_insert(doc, version, end, "**");
     if (result != SUCCESS) {
@@ -841,6 +902,9 @@ int markdown_italic(document *doc, uint64_t version, size_t start, size_t end) {
     if (!doc || start > end) {
         return INVALID_CURSOR_POS;
     }
+    int rebased = rebase_edit(doc, &version, &start, &end, false);
+    if (rebased != SUCCESS) return rebased;
+
     int result = markdown_insert(doc, version, end, "*");
     if (result != SUCCESS) {
         return result;
@@ -852,6 +916,8 @@ int markdown_italic(document *doc, uint64_t version, size_t start, size_t end) {
 // insert quote
 int markdown_blockquote(document *doc, uint64_t version, size_t pos) {
     if (!doc) return INVALID_CURSOR_POS;
+    int rebased = rebase_edit(doc, &version, &pos, NULL, false);
+    if (rebased != SUCCESS) return rebased;
 
     pthread_mutex_lock(&doc->lock);
     apply_all_pending_edits(doc);
@@ -886,10 +952,12 @@ int markdown_blockquote(document *doc, uint64_t version, size_t pos) {
 int markdown_unordered_list(document *doc, uint64_t version, size_t pos) {
     if (!doc) return INVALID_CURSOR_POS;
     pthread_mutex_lock(&doc->lock);
-    if (version != doc->version) {
+    int rebased = rebase_locked(doc, version, &pos, NULL, false);
+    if (rebased != SUCCESS) {
         pthread_mutex_unlock(&doc->lock);
-        return OUTDATED_VERSION;
+        return rebased;
     }
+    version = doc->version;
     line_node *ln = NULL;
     size_t offset = 0;
     if (find_line_and_offset(doc, pos, &ln, &offset) != SUCCESS) {
@@ -910,10 +978,12 @@ int markdown_unordered_list(document *doc, uint64_t version, size_t pos) {
 int markdown_ordered_list(document *doc, uint64_t version, size_t pos) {
     if (!doc) return INVALID_CURSOR_POS;
     pthread_mutex_lock(&doc->lock);
-    if (version != doc->version) {
+    int rebased = rebase_locked(doc, version, &pos, NULL, false);
+    if (rebased != SUCCESS) {
         pthread_mutex_unlock(&doc->lock);
-        return OUTDATED_VERSION;
+        return rebased;
     }
+    version = doc->version;
     apply_all_pending_edits(doc);
     line_node *ln = NULL;
     size_t offset = 0;
@@ -923,7 +993,7 @@ int markdown_ordered_list(document *doc, uint64_t version, size_t pos) {
     }
     int number = 1;
     line_node *prev_ln = ln->prev ? (line_node*)ln->prev : NULL;
-    while (prev_ln && line_is_ordered_list(prev_ln)) {
+    while (prev_ln && line_is_ordered_list(doc, prev_ln)) {
         number++;
         prev_ln = (line_node*)prev_ln->prev;
     }
@@ -948,6 +1018,8 @@ int markdown_code(document *doc, uint64_t version, size_t start, size_t end) {
     if (!doc || start > end) {
         return INVALID_CURSOR_POS;
     }
+    int rebased = rebase_edit(doc, &version, &start, &end, false);
+    if (rebased != SUCCESS) return rebased;
     int result = markdown_insert(doc, version, end, "`");
     if (result != SUCCESS) return result;
     return markdown_insert(doc, version, start, "`");
@@ -959,7 +1031,8 @@ int markdown_horizontal_rule(document *doc, uint64_t version, size_t pos) {
     apply_all_pending_edits(doc);
     pthread_mutex_unlock(&doc->lock);
 
-    int r;
+    int r = rebase_edit(doc, &version, &pos, NULL, false);
+    if (r != SUCCESS) return r;
     r = markdown_insert(doc, version, pos, "\n");
     if (r != SUCCESS) return r;
     r = markdown_insert(doc, version, pos, "---");
@@ -973,6 +1046,8 @@ int markdown_link(document *doc, uint64_t version, size_t start, size_t end, con
     if (!doc || !url || start >= end) {
         return INVALID_CURSOR_POS;
     }
+    int rebased = rebase_edit(doc, &version, &start, &end, false);
+    if (rebased != SUCCESS) return rebased;
 
     // "](" + url + ")"
     size_t url_len = strlen(url);
@@ -999,9 +1074,7 @@ void markdown_print(const document *doc, FILE *stream) {
 
     line_node *current_ln = doc->head;
     while (current_ln != NULL) {
-        if (current_ln->content) {
-            fwrite(current_ln->content, 1, current_ln->length, stream);
-        }
+        line_store_write(doc, current_ln, stream);
         fputc('\n', stream);
         current_ln = (line_node*)current_ln->next;
     }
@@ -1012,46 +1085,46 @@ void markdown_print(const document *doc, FILE *stream) {
 char *markdown_flatten(const document *doc) {
     if (!doc) return NULL;
 
-    pthread_mutex_lock((pthread_mutex_t*)&doc->lock);
+    // the cache is logically part of the document's value, refreshing it does not change the document
+    document *mutable_doc = (document*)doc;
+    pthread_mutex_lock(&mutable_doc->lock);
 
-    if (doc->head == NULL) {
-        pthread_mutex_unlock((pthread_mutex_t*)&doc->lock);
-        char *empty_str = malloc(1);
-        if (empty_str) empty_str[0] = '\0';
-        return empty_str;
+    if (flat_cache_refresh(mutable_doc) != 0) {
+        pthread_mutex_unlock(&mutable_doc->lock);
+        return NULL;
     }
 
-    size_t buffer_size = doc->total_length;
-    if (doc->line_count > 0) {
-        buffer_size += (doc->line_count - 1); 
+    size_t len = mutable_doc->flat.len;
+    char *result_buf = malloc(len + 1);
+    if (result_buf) {
+        memcpy(result_buf, mutable_doc->flat.buf, len + 1);
     }
-    buffer_size += 1; 
 
-    char *result_buf = malloc(buffer_size);
-    if (!result_buf) {
-        pthread_mutex_unlock((pthread_mutex_t*)&doc->lock);
-        return NULL; 
-    }
+    pthread_mutex_unlock(&mutable_doc->lock);
+    return result_buf;
+}
 
-    char *current_pos_in_buf = result_buf;
-    line_node *current_ln = doc->head;
-    bool first_line = true;
+const char *markdown_flatten_borrow(document *doc, size_t *len_out) {
+    if (!doc) return NULL;
 
-    while (current_ln != NULL) {
-        if (!first_line) {
-            *current_pos_in_buf++ = '\n';
-        }
-        if (current_ln->content && current_ln->length > 0) {
-             memcpy(current_pos_in_buf, current_ln->content, current_ln->length);
-             current_pos_in_buf += current_ln->length;
-        }
-        first_line = false;
-        current_ln = (line_node*)current_ln->next;
+    pthread_mutex_lock(&doc->lock);
+    if (flat_cache_refresh(doc) != 0) {
+        pthread_mutex_unlock(&doc->lock);
+        return NULL;
     }
-    *current_pos_in_buf = '\0';
+    const char *buf = doc->flat.buf;
+    if (len_out) *len_out = doc->flat.len;
+    pthread_mutex_unlock(&doc->lock);
+    return buf;
+}
 
-    pthread_mutex_unlock((pthread_mutex_t*)&doc->lock);
-    return result_buf;
+doc_snapshot *markdown_snapshot(document *doc) {
+    if (!doc) return NULL;
+
+    pthread_mutex_lock(&doc->lock);
+    doc_snapshot *snap = snapshot_take(doc);
+    pthread_mutex_unlock(&doc->lock);
+    return snap;
 }
 
 // version++
@@ -1060,6 +1133,7 @@ void markdown_increment_version(document *doc) {
     pthread_mutex_lock(&doc->lock);
     apply_all_pending_edits(doc);
     doc->version++;
+    op_history_begin(&doc->history, doc->version);
     pthread_mutex_unlock(&doc->lock);
 }
 
@@ -1068,5 +1142,75 @@ void markdown_commit(document *doc) {
     pthread_mutex_lock(&doc->lock);
     apply_all_pending_edits(doc); 
     doc->version++;
+    op_history_begin(&doc->history, doc->version);
+    pthread_mutex_unlock(&doc->lock);
+}
+
+// === Persistence ===
+line_shape *markdown_line_shapes(document *doc, size_t *count_out) {
+    if (!doc) return NULL;
+    pthread_mutex_lock(&doc->lock);
+    line_shape *shapes = malloc((doc->line_count ? doc->line_count : 1) * sizeof(line_shape));
+    size_t count = 0;
+    if (shapes) {
+        for (line_node *ln = doc->head; ln; ln = ln->next) {
+            shapes[count].length = ln->length;
+            shapes[count].type = ln->type;
+            shapes[count].metadata = ln->metadata;
+            count++;
+        }
+    }
     pthread_mutex_unlock(&doc->lock);
-}
\ No newline at end of file
+    *count_out = count;
+    return shapes;
+}
+
+document *markdown_load(const char *text, const line_shape *lines, size_t line_count, uint64_t version) {
+    document *doc = markdown_init();
+    if (!doc) return NULL;
+
+    line_node *prev = NULL;
+    const char *p = text;
+    for (size_t i = 0; i < line_count; i++) {
+        line_node *ln = obj_pool_alloc(&doc->line_pool);
+        if (!ln) {
+            markdown_free(doc);
+            return NULL;
+        }
+        if (line_store_init(doc, ln, p, lines[i].length) != 0) {
+            free_line(doc, ln);
+            markdown_free(doc);
+            return NULL;
+        }
+        ln->type = lines[i].type;
+        ln->metadata = lines[i].metadata;
+        ln->prev = (struct line_node*)prev;
+        ln->next = NULL;
+        if (prev) prev->next = (struct line_node*)ln;
+        else doc->head = ln;
+        doc->tail = ln;
+        doc->line_count++;
+        doc->total_length += lines[i].length;
+        line_index_insert_after(doc, prev, ln);
+        prev = ln;
+        // past the separator
+        p += lines[i].length + 1;
+    }
+
+    doc->version = version;
+    op_history_free(&doc->history);
+    op_history_init(&doc->history, version);
+    return doc;
+}
+
+void markdown_get_alloc_stats(const document *doc, markdown_alloc_stats *out) {
+    if (!doc || !out) return;
+    pthread_mutex_lock((pthread_mutex_t*)&doc->lock);
+    out->line_requests = doc->line_pool.requests;
+    out->line_mallocs = doc->line_pool.mallocs;
+    out->op_requests = doc->op_pool.requests;
+    out->op_mallocs = doc->op_pool.mallocs;
+    out->text_requests = doc->text_arena.requests;
+    out->text_mallocs = doc->text_arena.mallocs;
+    pthread_mutex_unlock((pthread_mutex_t*)&doc->lock);
+}
@@ -0,0 +1,75 @@
+#define _GNU_SOURCE
+#include "../libs/op_history.h"
+#include <stdlib.h>
+
+void op_history_init(op_history *h, uint64_t version) {
+    for (size_t i = 0; i < OP_HISTORY_VERSIONS; i++) {
+        h->slots[i].version = UINT64_MAX;
+        h->slots[i].edits = NULL;
+        h->slots[i].count = 0;
+        h->slots[i].cap = 0;
+        h->slots[i].complete = false;
+    }
+    h->first_version = version;
+    op_history_begin(h, version);
+}
+
+void op_history_free(op_history *h) {
+    for (size_t i = 0; i < OP_HISTORY_VERSIONS; i++) {
+        free(h->slots[i].edits);
+        h->slots[i].edits = NULL;
+        h->slots[i].count = 0;
+        h->slots[i].cap = 0;
+    }
+}
+
+void op_history_begin(op_history *h, uint64_t version) {
+    // reuses the slot of the oldest version, keeping its buffer
+    version_edits *slot = &h->slots[version % OP_HISTORY_VERSIONS];
+    slot->version = version;
+    slot->count = 0;
+    slot->complete = true;
+}
+
+void op_history_record(op_history *h, uint64_t version, bool insert, size_t pos, size_t len) {
+    version_edits *slot = &h->slots[version % OP_HISTORY_VERSIONS];
+    if (len == 0 || slot->version != version || !slot->complete) return;
+
+    if (slot->count == slot->cap) {
+        size_t cap = slot->cap ? slot->cap * 2 : 16;
+        flat_edit *grown = realloc(slot->edits, cap * sizeof(flat_edit));
+        if (!grown) {
+            slot->complete = false;
+            return;
+        }
+        slot->edits = grown;
+        slot->cap = cap;
+    }
+    slot->edits[slot->count++] = (flat_edit){ pos, len, insert };
+}
+
+int op_history_rebase(const op_history *h, uint64_t from, uint64_t to, size_t *pos, rebase_side side) {
+    if (from > to || from < h->first_version || to - from >= OP_HISTORY_VERSIONS) return -1;
+
+    size_t p = *pos;
+    int hit_deleted = 0;
+    for (uint64_t v = from; v < to; v++) {
+        const version_edits *slot = &h->slots[v % OP_HISTORY_VERSIONS];
+        if (slot->version != v || !slot->complete) return -1;
+
+        for (size_t i = 0; i < slot->count; i++) {
+            const flat_edit *e = &slot->edits[i];
+            if (e->insert) {
+                if (e->pos < p || (e->pos == p && side == REBASE_STICK_AFTER)) p += e->len;
+            } else if (p >= e->pos + e->len) {
+                p -= e->len;
+            } else if (p > e->pos) {
+                p = e->pos;
+                hit_deleted = 1;
+            }
+        }
+    }
+
+    *pos = p;
+    return hit_deleted;
+}
@@ -0,0 +1,101 @@
+#include "../libs/out_queue.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define OUT_QUEUE_MIN_ENDS 16
+
+void out_queue_init(out_queue *q) {
+    conn_buf_init(&q->buf);
+    q->ends = NULL;
+    q->ends_start = 0;
+    q->ends_len = 0;
+    q->ends_cap = 0;
+    q->queued = 0;
+    q->written = 0;
+    q->head_start = 0;
+    q->open_start = 0;
+}
+
+void out_queue_free(out_queue *q) {
+    conn_buf_free(&q->buf);
+    free(q->ends);
+    out_queue_init(q);
+}
+
+int out_queue_append(out_queue *q, const void *data, size_t len) {
+    if (conn_buf_append(&q->buf, data, len) < 0) return -1;
+    q->queued += len;
+    return 0;
+}
+
+int out_queue_end_message(out_queue *q) {
+    if (q->queued == q->open_start) return 0;
+    if (q->ends_len == q->ends_cap) {
+        size_t cap = q->ends_cap ? q->ends_cap * 2 : OUT_QUEUE_MIN_ENDS;
+        uint64_t *grown = malloc(cap * sizeof(*grown));
+        if (!grown) return -1;
+        for (size_t i = 0; i < q->ends_len; i++) {
+            grown[i] = q->ends[(q->ends_start + i) % q->ends_cap];
+        }
+        free(q->ends);
+        q->ends = grown;
+        q->ends_start = 0;
+        q->ends_cap = cap;
+    }
+    q->ends[(q->ends_start + q->ends_len) % q->ends_cap] = q->queued;
+    q->ends_len++;
+    q->open_start = q->queued;
+    return 0;
+}
+
+void out_queue_consume(out_queue *q, size_t n) {
+    if (n > q->buf.len) n = q->buf.len;
+    conn_buf_consume(&q->buf, n);
+    q->written += n;
+    while (q->ends_len > 0 && q->ends[q->ends_start] <= q->written) {
+        q->head_start = q->ends[q->ends_start];
+        q->ends_start = (q->ends_start + 1) % q->ends_cap;
+        q->ends_len--;
+    }
+}
+
+int out_queue_flush_fd(out_queue *q, int fd) {
+    while (q->buf.len > 0) {
+        ssize_t ret = write(fd, conn_buf_head(&q->buf), q->buf.len);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+        if (ret <= 0) return -1;
+        out_queue_consume(q, (size_t)ret);
+    }
+    return 0;
+}
+
+size_t out_queue_drop_unsent(out_queue *q) {
+    // a message is only ever dropped whole, and never the open one
+    uint64_t keep = q->written;
+    if (q->written > q->head_start && q->ends_len > 0) keep = q->ends[q->ends_start];
+    if (keep >= q->open_start) return 0;
+
+    size_t dropped = (size_t)(q->open_start - keep);
+    size_t kept = (size_t)(keep - q->written);
+    size_t open = (size_t)(q->queued - q->open_start);
+    char *base = q->buf.data + q->buf.start;
+    memmove(base + kept, base + kept + dropped, open);
+    q->buf.len -= dropped;
+    q->queued -= dropped;
+    q->open_start -= dropped;
+
+    // whatever is left ends at keep, if anything
+    q->ends_len = keep > q->written ? 1 : 0;
+    if (q->written == keep) q->head_start = keep;
+    return dropped;
+}
+
+void out_queue_clear(out_queue *q) {
+    out_queue_consume(q, q->buf.len);
+    q->ends_len = 0;
+    q->head_start = q->written;
+    q->open_start = q->queued;
+}
@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+#include "../libs/pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_MAX_RETAINED (1024 * 1024)
+
+static size_t round_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+// === obj_pool ===
+
+void obj_pool_init(obj_pool *pool, size_t obj_size, size_t per_slab) {
+    size_t align = _Alignof(max_align_t);
+    if (obj_size < sizeof(void *)) obj_size = sizeof(void *);
+    pool->obj_size = round_up(obj_size, align);
+    pool->per_slab = per_slab ? per_slab : 1;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->requests = 0;
+    pool->mallocs = 0;
+}
+
+void *obj_pool_alloc(obj_pool *pool) {
+    if (!pool->free_list) {
+        size_t header = round_up(sizeof(pool_slab), _Alignof(max_align_t));
+        // zeroed so that fields which outlive a free (like a generation counter) start out defined
+        pool_slab *slab = calloc(1, header + pool->obj_size * pool->per_slab);
+        if (!slab) return NULL;
+        pool->mallocs++;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+
+        // thread the new objects onto the free list, first object ends up on top
+        char *objects = (char *)slab + header;
+        for (size_t i = pool->per_slab; i-- > 0;) {
+            void *obj = objects + i * pool->obj_size;
+            *(void **)obj = pool->free_list;
+            pool->free_list = obj;
+        }
+    }
+
+    void *obj = pool->free_list;
+    pool->free_list = *(void **)obj;
+    pool->requests++;
+    return obj;
+}
+
+void obj_pool_free(obj_pool *pool, void *obj) {
+    if (!obj) return;
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+}
+
+void obj_pool_destroy(obj_pool *pool) {
+    pool_slab *slab = pool->slabs;
+    while (slab) {
+        pool_slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+}
+
+// === bump_arena ===
+
+void arena_init(bump_arena *arena) {
+    arena->blocks = NULL;
+    arena->requests = 0;
+    arena->mallocs = 0;
+}
+
+char *arena_strndup(bump_arena *arena, const char *s, size_t len) {
+    arena_block *block = arena->blocks;
+    if (!block || block->size - block->used < len + 1) {
+        size_t size = ARENA_BLOCK_SIZE;
+        while (size < len + 1) size *= 2;
+        block = malloc(sizeof(arena_block) + size);
+        if (!block) return NULL;
+        arena->mallocs++;
+        block->size = size;
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    char *out = (char *)(block + 1) + block->used;
+    memcpy(out, s, len);
+    out[len] = '\0';
+    block->used += len + 1;
+    arena->requests++;
+    return out;
+}
+
+void arena_reset(bump_arena *arena) {
+    // keep the largest block unless it grew silly, the rest goes back to malloc
+    arena_block *keep = NULL;
+    for (arena_block *b = arena->blocks; b; b = b->next) {
+        if (b->size <= ARENA_MAX_RETAINED && (!keep || b->size > keep->size)) keep = b;
+    }
+
+    arena_block *block = arena->blocks;
+    while (block) {
+        arena_block *next = block->next;
+        if (block != keep) free(block);
+        block = next;
+    }
+
+    arena->blocks = keep;
+    if (keep) {
+        keep->next = NULL;
+        keep->used = 0;
+    }
+}
+
+void arena_destroy(bump_arena *arena) {
+    arena_block *block = arena->blocks;
+    while (block) {
+        arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include "../libs/roles.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/inotify.h>
+
+#define ROLE_TABLE_MIN_SLOTS 16
+
+// offsets into role_table.strings, role == 0 marks a free slot (strings starts with a user)
+typedef struct {
+    uint64_t hash;
+    size_t user;
+    size_t role;
+} role_slot;
+
+struct role_table {
+    // every user and role, NUL terminated, in file order
+    char *strings;
+    size_t strings_len;
+    size_t strings_cap;
+    role_slot *slots;
+    size_t mask;
+    size_t count;
+};
+
+// FNV-1a
+static uint64_t role_hash(const char *s) {
+    uint64_t h = 14695981039346656037ULL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void role_table_free(role_table *t) {
+    if (!t) return;
+    free(t->strings);
+    free(t->slots);
+    free(t);
+}
+
+static const role_slot *role_table_find(const role_table *t, const char *user, uint64_t hash) {
+    for (size_t i = hash & t->mask;; i = (i + 1) & t->mask) {
+        const role_slot *s = &t->slots[i];
+        if (s->role == 0) return s;
+        if (s->hash == hash && strcmp(t->strings + s->user, user) == 0) return s;
+    }
+}
+
+// returns the offset the string was stored at, or (size_t)-1 if out of memory
+static size_t role_table_add_string(role_table *t, const char *s) {
+    size_t len = strlen(s) + 1;
+    if (t->strings_len + len > t->strings_cap) {
+        size_t cap = t->strings_cap ? t->strings_cap : 4096;
+        while (cap < t->strings_len + len) cap *= 2;
+        char *grown = realloc(t->strings, cap);
+        if (!grown) return (size_t)-1;
+        t->strings = grown;
+        t->strings_cap = cap;
+    }
+    size_t at = t->strings_len;
+    memcpy(t->strings + at, s, len);
+    t->strings_len += len;
+    return at;
+}
+
+static int role_table_grow(role_table *t) {
+    size_t slots = (t->mask + 1) * 2;
+    role_slot *grown = calloc(slots, sizeof(*grown));
+    if (!grown) return -1;
+    role_slot *old = t->slots;
+    size_t old_slots = t->mask + 1;
+    t->slots = grown;
+    t->mask = slots - 1;
+    for (size_t i = 0; i < old_slots; i++) {
+        if (old[i].role == 0) continue;
+        role_slot *s = (role_slot *)role_table_find(t, t->strings + old[i].user, old[i].hash);
+        *s = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+// the first line naming a user wins
+static int role_table_insert(role_table *t, const char *user, const char *role) {
+    // at most half full
+    if ((t->count + 1) * 2 > t->mask + 1 && role_table_grow(t) < 0) return -1;
+    uint64_t hash = role_hash(user);
+    role_slot *s = (role_slot *)role_table_find(t, user, hash);
+    if (s->role != 0) return 0;
+    size_t user_at = role_table_add_string(t, user);
+    size_t role_at = user_at == (size_t)-1 ? user_at : role_table_add_string(t, role);
+    if (role_at == (size_t)-1) return -1;
+    s->hash = hash;
+    s->user = user_at;
+    s->role = role_at;
+    t->count++;
+    return 0;
+}
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    return s;
+}
+
+// "<user> <role>" per line, anything else is skipped. NULL only if out of memory, a missing file is empty
+static role_table *role_table_load(const char *path) {
+    role_table *t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    t->slots = calloc(ROLE_TABLE_MIN_SLOTS, sizeof(*t->slots));
+    if (!t->slots) {
+        free(t);
+        return NULL;
+    }
+    t->mask = ROLE_TABLE_MIN_SLOTS - 1;
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("error open roles.txt");
+        return t;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    int failed = 0;
+    while (!failed && getline(&line, &cap, file) != -1) {
+        size_t split = strcspn(line, " \t\n");
+        if (line[split] == '\0') continue;
+        line[split] = '\0';
+        char *user = trim(line);
+        char *role = trim(line + split + 1);
+        if (*user == '\0' || *role == '\0') continue;
+        failed = role_table_insert(t, user, role);
+    }
+    free(line);
+    fclose(file);
+    if (failed) {
+        role_table_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+// Swap next in and free the table it replaces once no lookup can be reading it. Reload thread only
+static void role_store_swap(role_store *rs, role_table *next) {
+    role_table *old = atomic_exchange(&rs->current, next);
+    unsigned parity = atomic_fetch_add(&rs->epoch, 1) & 1;
+    // whoever entered before the flip may still hold old, lookups from now on count under the other parity
+    while (atomic_load(&rs->readers[parity]) != 0) sched_yield();
+    role_table_free(old);
+}
+
+static void role_store_reload(role_store *rs) {
+    role_table *t = role_table_load(rs->path);
+    if (!t) {
+        perror("role_store_reload: keeping the previous roles");
+        return;
+    }
+    printf("[SERVER] Loaded %zu users from %s\n", t->count, rs->path);
+    role_store_swap(rs, t);
+}
+
+static void *role_store_watch(void *arg) {
+    role_store *rs = arg;
+    const char *slash = strrchr(rs->path, '/');
+    const char *name = slash ? slash + 1 : rs->path;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t n = read(rs->inotify_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("role_store_watch: inotify read");
+            break;
+        }
+        bool changed = false;
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len > 0 && strcmp(ev->name, name) == 0) changed = true;
+            p += sizeof(*ev) + ev->len;
+        }
+        if (changed) role_store_reload(rs);
+    }
+    return NULL;
+}
+
+int role_store_open(role_store *rs, const char *path) {
+    atomic_init(&rs->epoch, 0);
+    atomic_init(&rs->readers[0], 0);
+    atomic_init(&rs->readers[1], 0);
+    snprintf(rs->path, sizeof(rs->path), "%s", path);
+    role_table *t = role_table_load(rs->path);
+    // not even an empty table, so there is nothing lookups could read
+    if (!t) return -2;
+    printf("[SERVER] Loaded %zu users from %s\n", t->count, rs->path);
+    atomic_init(&rs->current, t);
+
+    // the directory, editors tend to write a new file and rename it over the old one
+    char dir[sizeof(rs->path)];
+    snprintf(dir, sizeof(dir), "%s", rs->path);
+    char *slash = strrchr(dir, '/');
+    if (slash) {
+        slash[slash == dir ? 1 : 0] = '\0';
+    } else {
+        strcpy(dir, ".");
+    }
+    rs->inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (rs->inotify_fd == -1) return -1;
+    if (inotify_add_watch(rs->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1 ||
+        pthread_create(&rs->watcher, NULL, role_store_watch, rs) != 0) {
+        close(rs->inotify_fd);
+        rs->inotify_fd = -1;
+        return -1;
+    }
+    pthread_detach(rs->watcher);
+    return 0;
+}
+
+bool role_store_lookup(role_store *rs, const char *user, char *role, size_t size) {
+    // register under the current epoch, again if it moved on before the registration counted
+    unsigned epoch;
+    while (1) {
+        epoch = atomic_load(&rs->epoch);
+        atomic_fetch_add(&rs->readers[epoch & 1], 1);
+        if (atomic_load(&rs->epoch) == epoch) break;
+        atomic_fetch_sub(&rs->readers[epoch & 1], 1);
+    }
+
+    const role_table *t = atomic_load(&rs->current);
+    const role_slot *s = role_table_find(t, user, role_hash(user));
+    bool found = s->role != 0;
+    if (found && size > 0) snprintf(role, size, "%s", t->strings + s->role);
+
+    atomic_fetch_sub(&rs->readers[epoch & 1], 1);
+    return found;
+}
@@ -11,76 +11,400 @@
 #include <stdint.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "../libs/conn_buf.h"
+#include "../libs/protocol.h"
+#include "../libs/shm_ring.h"
+#include "../libs/fanout.h"
+#include "../libs/out_queue.h"
+#include "../libs/command.h"
+#include "../libs/roles.h"
+#include "../libs/cmd_log.h"
+#include "../libs/wal.h"
+#include "../libs/wire.h"
+#include "../libs/stats.h"
+
+// most event loop threads the server will run, and the epoll events each one takes per wait
+#define EVENT_LOOP_MAX 16
+#define EVENT_LOOP_BATCH 64
+// longest command line, a longer one is cut into pieces of this size
+#define COMMAND_MAX 1024
+// most a client's input is read by in one go, whatever commands that holds
+#define READ_CHUNK 4096
+#define USERNAME_MAX 256
+// a delta client more versions behind than this gets the whole document again
+#define DELTA_MAX_VERSIONS 64
+// distinct base versions one broadcast remembers the diff for
+#define DELTA_PLAN_CACHE 8
+// default bytes a client may have waiting before its broadcasts fall under the lag policy
+#define OUT_QUEUE_LIMIT (1024 * 1024)
+// spill file of the command log, in the working directory next to the socket
+#define COMMAND_LOG_FMT "CMDLOG_%d"
+// write-ahead log and snapshot of the document, in the working directory next to doc.md
+#define WAL_PATH "doc.wal"
+#define SNAPSHOT_PATH "doc.snap"
+// answer to an edit the write-ahead log could not make durable
+#define NOT_DURABLE "NOT_DURABLE"
+// -s writes the STATS? report here, formatted with the server pid
+#define STATS_DUMP_FMT "STATS_%d"
+
+// what happens to a broadcast for a client whose output queue is over the limit
+typedef enum {
+    // the backlog nobody started writing is dropped, the current document is queued in its place
+    LAG_RESYNC,
+    // nothing is queued, once the backlog drained the client catches up in one go
+    LAG_SKIP,
+    // the client is dropped
+    LAG_DISCONNECT
+} lag_policy;
+
+// what an edit spends its time on in process_command, timed separately
+typedef enum {
+    PHASE_PARSE,
+    PHASE_LOCK_WAIT,
+    PHASE_APPLY,
+    PHASE_COMMIT,
+    PHASE_COUNT
+} edit_phase;
 
 typedef struct {
     pid_t client_pid;
+    // accepted socket, or -1 to open the FIFOs below
+    int sock;
     char fifo_c2s[64];
     char fifo_s2c[64];
 } thread_data;
 
+typedef struct loop_conn loop_conn;
+
+// an edit's answer, held until its commit is on disk
+typedef struct {
+    int rc;
+    const char *reason;
+} held_answer;
+
+// Output side of a client. Replies and broadcasts are queued under mutex and written without blocking, so a
+// client that stops reading only ever holds up itself. Whatever fd does not take waits until it is writable:
+// an event loop watches it for EPOLLOUT (or ring space), a thread-per-client client's own thread is woken
+// through wake_efd and polls it.
+typedef struct {
+    pthread_mutex_t mutex;
+    out_queue queue;
+    int fd;
+    // owning event loop client, NULL for a thread-per-client client
+    loop_conn *conn;
+    int wake_efd;
+    // EPOLLOUT is watched, or the client thread was told to poll for it
+    bool armed;
+    // a write failed or the client lagged too far, whatever is queued from then on is dropped
+    bool broken;
+    // broadcasts were skipped, one more follows once the queue drained
+    bool lagging;
+    // switched to binary frames (wire.h) with BINARY ON, everything queued from then on is frames
+    bool binary;
+    size_t peak;
+    uint64_t skipped;
+    uint64_t resyncs;
+    // everything ever queued for the client, and how much of that reached its fd or ring
+    uint64_t bytes_queued;
+    uint64_t bytes_sent;
+    // answers to edits whose commits the WAL has not synced yet, in command order. Only the thread serving the
+    // client's commands touches them, so they are not under mutex
+    held_answer *held;
+    size_t held_count;
+    size_t held_cap;
+} client_output;
+
+// a socket client has fd_c2s == fd_s2c and empty FIFO names
 typedef struct client_node {
     pid_t pid;
     int fd_c2s;
     int fd_s2c;
     char fifo_c2s[64];
     char fifo_s2c[64];
+    client_output *out;
+    // asked for DELTA broadcasts, which are relative to sent
+    bool delta;
+    // last document state this client was sent, whole or as a delta
+    doc_snapshot *sent;
     struct client_node *next;
 } client_node_t;
 
-typedef struct pending_command {
-    char *user;
-    char *command;
-    int result;
-    char *reason;
-    struct pending_command *next;
-} pending_command_t;
+typedef struct event_loop event_loop;
+
+typedef enum {
+    WATCH_WAKE,
+    WATCH_LISTEN,
+    WATCH_INPUT,
+    WATCH_OUTPUT,
+    // eventfd of a shared memory channel, input arrived or output space freed up
+    WATCH_SHM
+} watch_kind;
+
+// what an epoll registration stands for, conn is NULL for the wake pipe and the listening socket
+typedef struct {
+    watch_kind kind;
+    loop_conn *conn;
+} loop_watch;
+
+typedef enum {
+    CONN_AWAIT_USERNAME,
+    CONN_ACTIVE,
+    CONN_CLOSED
+} conn_state;
+
+// One client multiplexed by an event loop. Everything but the output queue is only touched by the loop thread.
+struct loop_conn {
+    pid_t pid;
+    int fd_c2s;
+    int fd_s2c;
+    char fifo_c2s[64];
+    char fifo_s2c[64];
+    char username[USERNAME_MAX];
+    conn_state state;
+    // on the client list, remove_client then owns the FIFOs
+    bool listed;
+    event_loop *loop;
+    // a socket shares one registration for both directions, rd_watch then also gets EPOLLOUT
+    loop_watch rd_watch;
+    loop_watch wr_watch;
+    conn_buf in;
+
+    // a socket client that handed over shared memory rings with its username talks through them from then on,
+    // the socket is only watched for hangup
+    bool has_shm;
+    shm_channel shm;
+    loop_watch shm_watch;
+
+    client_output out;
+
+    loop_conn *next_dead;
+    // on its loop's held list, answers wait for the end of the batch of events
+    bool held_listed;
+    loop_conn *next_held;
+};
+
+struct event_loop {
+    int epfd;
+    // sig_handler posts the pids of connecting clients here
+    int wake_rd;
+    int wake_wr;
+    loop_watch wake_watch;
+    loop_watch listen_watch;
+    // closed during the current batch of events, freed once the batch is done
+    loop_conn *dead;
+    // holding answers from the current batch of events, which share one wait for the disk
+    loop_conn *held;
+};
+
+// An edit staged in batch mode, answered and logged with the broadcast of the commit it went into
+typedef struct {
+    pid_t pid;
+    // arrival order, kept among the commands of one client when the batch is sorted by pid
+    size_t seq;
+    // EDIT <user> <command> SUCCESS|Reject <reason>\n, the answer to the client starts at reply
+    char *edit;
+    size_t edit_len;
+    size_t reply;
+    // the same answer for a binary client, reason is static
+    bool rejected;
+    const char *reason;
+} batched_command;
+
+typedef struct {
+    batched_command *items;
+    size_t count;
+    size_t cap;
+    // at least one edit was staged, the batch needs a commit
+    bool staged;
+    // the edits that succeeded and the bytes of their lines, what the commit will hold
+    size_t edits;
+    size_t edit_bytes;
+} command_batch;
 
 document *global_doc;
 
 static client_node_t *client_head = NULL;
 static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pending_command_t *cmd_queue_head = NULL;
-static pthread_mutex_t cmd_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+// every command answered, LOG? pages through it
+static cmd_log command_log;
+// every edit handed to global_doc, under doc_mutex
+static wal doc_wal;
 static pthread_mutex_t doc_mutex = PTHREAD_MUTEX_INITIALIZER;  // New global document mutex
 
+// zero means thread per client
+static int event_loop_count = 0;
+static event_loop event_loops[EVENT_LOOP_MAX];
+static atomic_uint next_event_loop = 0;
+
+// set by the first commit after a broadcast, dirty_efd then wakes the broadcast thread
+static atomic_bool doc_dirty = false;
+static int dirty_efd = -1;
+// version the last broadcast carried, guarded by client_mutex
+static uint64_t last_broadcast_version = 0;
+// staging pipe plain broadcasts are tee()d from, guarded by client_mutex
+static fanout broadcast_fanout;
+// a lagging client drained, the next broadcast goes out even without a new version
+static atomic_bool broadcast_catchup = false;
+
+static size_t out_queue_limit = OUT_QUEUE_LIMIT;
+static lag_policy lag_mode = LAG_RESYNC;
+static atomic_ulong lag_disconnects = 0;
+// -b: edits are staged as they arrive and committed together once per broadcast interval
+static bool batch_mode = false;
+static pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static command_batch open_batch;
+// roles.txt, reloaded whenever it changes
+static role_store roles;
+
+// STATS?, times in ns: each edit phase by command_op, with a CMD_COUNT row for lines that did not parse
+static const char *phase_names[PHASE_COUNT] = { "parse", "lock wait", "apply", "commit" };
+static stats_hist edit_latency[CMD_COUNT + 1][PHASE_COUNT];
+// a batch's commit in -b mode, and the edits and bytes of command lines every commit holds
+static stats_hist batch_commit_latency;
+static stats_hist commit_edits;
+static stats_hist commit_bytes;
+// a whole broadcast, and the bytes it queued for each client it sent something
+static stats_hist broadcast_latency;
+static stats_hist broadcast_bytes;
+// -s: seconds between rewrites of STATS_<pid>, 0 for none
+static int stats_interval = 0;
+// -w: milliseconds from the first commit after a broadcast to the next broadcast, 0 for the time interval
+static int window_ms = 0;
+
+// AF_UNIX listening socket, -1 if only the FIFO handshake is available
+static int listen_fd = -1;
+static char socket_path[108];
+
 void install_signal_handler(void);
 void server_loop(void);
 void *handle_client(void *arg);
 void sig_handler(int sig, siginfo_t *info, void *context);
-char *check_user_role(const char *username);
-char *trim_whitespace(char *);
-void add_client(pid_t pid, int fd_c2s, int fd_s2c, const char* fifo_c2s_name, const char* fifo_s2c_name);
+void add_client(pid_t pid, int fd_c2s, int fd_s2c, const char* fifo_c2s_name, const char* fifo_s2c_name, client_output *out);
 void remove_client(pid_t pid);
-void broadcast_document(void);
+void broadcast_document(command_batch *batch);
+void mark_document_dirty(void);
 void *broadcast_thread(void *arg);
 void enqueue_command(const char *user, const char *command, int result, const char *reason);
 void *server_stdin_thread(void *arg);
-int process_command(const char *user, const char *command, char **reason);
-
-static size_t find_substring_in_doc(const document *doc, const char *substr) {
-    char *flat = markdown_flatten(doc);
+void *stats_dump_thread(void *arg);
+int process_command(const char *user, char *command, const parsed_command *parsed, bool commit, const char **reason);
+int start_event_loops(int count);
+void *event_loop_thread(void *arg);
+int start_socket_listener(void);
+void *socket_accept_thread(void *arg);
+
+// caller holds doc_mutex
+static size_t find_substring_in_doc(document *doc, const char *substr) {
+    const char *flat = markdown_flatten_borrow(doc, NULL);
     if (!flat) return (size_t)-1;
-    char *p = strstr(flat, substr);
-    size_t pos = (p ? (size_t)(p - flat) : (size_t)-1);
-    free(flat);
-    return pos;
+    const char *p = strstr(flat, substr);
+    return (p ? (size_t)(p - flat) : (size_t)-1);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-b] [-q queue KB] [-l resync|skip|disconnect] [-s stats seconds] [-w window ms] "
+           "<time interval> [epoll [event loop threads]]\n", prog);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <time interval>\n", argv[0]);
+    const char *prog = argv[0];
+    int opt;
+    while ((opt = getopt(argc, argv, "bq:l:s:w:")) != -1) {
+        if (opt == 'b') {
+            batch_mode = true;
+        } else if (opt == 'q' && atol(optarg) > 0) {
+            out_queue_limit = (size_t)atol(optarg) * 1024;
+        } else if (opt == 'l' && strcmp(optarg, "resync") == 0) {
+            lag_mode = LAG_RESYNC;
+        } else if (opt == 'l' && strcmp(optarg, "skip") == 0) {
+            lag_mode = LAG_SKIP;
+        } else if (opt == 'l' && strcmp(optarg, "disconnect") == 0) {
+            lag_mode = LAG_DISCONNECT;
+        } else if (opt == 's' && atoi(optarg) > 0) {
+            stats_interval = atoi(optarg);
+        } else if (opt == 'w' && atoi(optarg) > 0) {
+            window_ms = atoi(optarg);
+        } else {
+            usage(prog);
+            return 1;
+        }
+    }
+    // positional arguments from here on
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 2 || argc > 4 || (argc > 2 && strcmp(argv[2], "epoll") != 0)) {
+        usage(prog);
         return 1;
     }
 
     int time_interval = atoi(argv[1]);
+    if (window_ms == 0) window_ms = time_interval * 1000;
+
+    // whatever the last run committed, or an empty document
+    if (wal_open(&doc_wal, WAL_PATH, SNAPSHOT_PATH, &global_doc) < 0 && !global_doc) {
+        fprintf(stderr, "Cannot recover the document\n");
+        return 1;
+    }
+
+    char log_path[64];
+    snprintf(log_path, sizeof(log_path), COMMAND_LOG_FMT, getpid());
+    if (cmd_log_init(&command_log, log_path) < 0) {
+        perror("cmd_log_init");
+        markdown_free(global_doc);
+        return 1;
+    }
+
+    // before anyone can log in, a role is a hash lookup from then on
+    int roles_rc = role_store_open(&roles, "roles.txt");
+    if (roles_rc == -2) {
+        fprintf(stderr, "Cannot load roles.txt\n");
+        cmd_log_close(&command_log, true);
+        markdown_free(global_doc);
+        return 1;
+    }
+    if (roles_rc < 0) {
+        perror("role_store_open: roles.txt will not be reloaded");
+    }
 
-    global_doc = markdown_init();
+    // a server without a socket still takes FIFO clients
+    if (start_socket_listener() < 0) {
+        fprintf(stderr, "Socket transport unavailable, FIFO clients only\n");
+    }
+
+    // loops have to be up before the first client can signal
+    if (argc > 2) {
+        int loops = argc == 4 ? atoi(argv[3]) : 1;
+        if (loops < 1) loops = 1;
+        if (loops > EVENT_LOOP_MAX) loops = EVENT_LOOP_MAX;
+        if (start_event_loops(loops) < 0) {
+            markdown_free(global_doc);
+            return 1;
+        }
+    }
 
     install_signal_handler();
 
+    // without it every FIFO client gets its own writev
+    if (fanout_init(&broadcast_fanout) < 0) {
+        perror("fanout_init");
+    }
+    dirty_efd = eventfd(0, EFD_CLOEXEC);
+    if (dirty_efd == -1) {
+        perror("eventfd");
+        markdown_free(global_doc);
+        return 1;
+    }
     pthread_t btid;
     int *interval_arg = malloc(sizeof(int));
-    *interval_arg = time_interval;
+    *interval_arg = window_ms;
     pthread_create(&btid, NULL, broadcast_thread, interval_arg);
     pthread_detach(btid);
 
@@ -88,8 +412,36 @@ int main(int argc, char *argv[]) {
     pthread_create(&stid, NULL, server_stdin_thread, NULL);
     pthread_detach(stid);
 
+    if (stats_interval > 0) {
+        pthread_t dtid;
+        pthread_create(&dtid, NULL, stats_dump_thread, NULL);
+        pthread_detach(dtid);
+    }
+
+    // event loops accept on the socket themselves
+    if (listen_fd != -1 && event_loop_count == 0) {
+        pthread_t atid;
+        pthread_create(&atid, NULL, socket_accept_thread, NULL);
+        pthread_detach(atid);
+    }
+
     printf("Server PID: %d\n", getpid());
     printf("Time interval: %d seconds\n", time_interval);
+    if (window_ms != time_interval * 1000) {
+        printf("Broadcast window: %d ms\n", window_ms);
+    }
+    if (batch_mode) {
+        printf("Edits: committed in one batch per interval\n");
+    }
+    if (listen_fd != -1) {
+        printf("Socket: %s\n", socket_path);
+    }
+    if (event_loop_count > 0) {
+        printf("Client I/O: %d epoll event loop thread(s)\n", event_loop_count);
+    }
+    if (stats_interval > 0) {
+        printf("Stats: " STATS_DUMP_FMT " every %d s\n", getpid(), stats_interval);
+    }
 
     server_loop();
     
@@ -119,47 +471,45 @@ void server_loop() {
     }
 }
 
-void sig_handler(int sig, siginfo_t *info, void *context) {
-    // client connect
-    (void)sig;
-    (void)context;
-    pid_t client_pid = info->si_pid;
-
-    char fifo_c2s[64];
-    char fifo_s2c[64];
-    snprintf(fifo_c2s, sizeof(fifo_c2s), "FIFO_C2S_%d", client_pid);
-    snprintf(fifo_s2c, sizeof(fifo_s2c), "FIFO_S2C_%d", client_pid);
+// FIFO_C2S_<pid> / FIFO_S2C_<pid>, fresh. Returns 0, or -1 with neither left behind
+static int create_client_fifos(pid_t client_pid, char *fifo_c2s, char *fifo_s2c) {
+    snprintf(fifo_c2s, 64, CLIENT_FIFO_C2S_FMT, client_pid);
+    snprintf(fifo_s2c, 64, CLIENT_FIFO_S2C_FMT, client_pid);
 
     unlink(fifo_c2s);
     unlink(fifo_s2c);
 
     if (mkfifo(fifo_c2s, 0666) == -1) {
         perror("mkfifo");
-        return;
+        return -1;
     }
 
     if (mkfifo(fifo_s2c, 0666) == -1) {
         perror("mkfifo");
         unlink(fifo_c2s);
-        return;
+        return -1;
     }
+    return 0;
+}
 
-    // notify client
-    if (kill(client_pid, SIGRTMIN + 1) == -1) {
-        perror("kill");
-        unlink(fifo_c2s);
-        unlink(fifo_s2c);
-        return;
-    }
+// Close a client's channel, a socket only once, and remove its FIFOs if it has any
+static void close_client_channel(int fd_c2s, int fd_s2c, const char *fifo_c2s, const char *fifo_s2c) {
+    if (fd_c2s != -1) close(fd_c2s);
+    if (fd_s2c != -1 && fd_s2c != fd_c2s) close(fd_s2c);
+    if (fifo_c2s[0]) unlink(fifo_c2s);
+    if (fifo_s2c[0]) unlink(fifo_s2c);
+}
 
+// handle_client on its own thread, for a socket (sock != -1) or the named FIFOs
+static void spawn_client_thread(pid_t client_pid, int sock, const char *fifo_c2s, const char *fifo_s2c) {
     thread_data *data = malloc(sizeof(thread_data));
     if (!data) {
         perror("malloc thread_data");
-        unlink(fifo_c2s);
-        unlink(fifo_s2c);
+        close_client_channel(sock, sock, fifo_c2s, fifo_s2c);
         return;
     }
     data->client_pid = client_pid;
+    data->sock = sock;
     strcpy(data->fifo_c2s, fifo_c2s);
     strcpy(data->fifo_s2c, fifo_s2c);
 
@@ -168,15 +518,102 @@ void sig_handler(int sig, siginfo_t *info, void *context) {
     if (pthread_create(&thread, NULL, handle_client, data) != 0) {
         perror("pthread_create");
         free(data);
+        close_client_channel(sock, sock, fifo_c2s, fifo_s2c);
+        return;
+    }
+
+    pthread_detach(thread);
+}
+
+void sig_handler(int sig, siginfo_t *info, void *context) {
+    // client connect
+    (void)sig;
+    (void)context;
+    pid_t client_pid = info->si_pid;
+
+    if (event_loop_count > 0) {
+        // the loop sets the client up, only hand it the pid from here
+        event_loop *loop = &event_loops[atomic_fetch_add(&next_event_loop, 1) % (unsigned)event_loop_count];
+        if (write(loop->wake_wr, &client_pid, sizeof(client_pid)) != sizeof(client_pid)) {
+            perror("sig_handler: event loop wake pipe");
+        }
+        return;
+    }
+
+    char fifo_c2s[64];
+    char fifo_s2c[64];
+    if (create_client_fifos(client_pid, fifo_c2s, fifo_s2c) < 0) {
+        return;
+    }
+
+    // notify client
+    if (kill(client_pid, SIGRTMIN + 1) == -1) {
+        perror("kill");
         unlink(fifo_c2s);
         unlink(fifo_s2c);
         return;
     }
 
-    pthread_detach(thread);
+    spawn_client_thread(client_pid, -1, fifo_c2s, fifo_s2c);
+}
+
+int start_socket_listener(void) {
+    snprintf(socket_path, sizeof(socket_path), SERVER_SOCKET_FMT, getpid());
+    unlink(socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        perror("bind/listen");
+        close(fd);
+        unlink(socket_path);
+        return -1;
+    }
+    listen_fd = fd;
+    return 0;
+}
+
+// pid on the other end of a connected socket, so socket clients are keyed like FIFO ones
+static pid_t socket_peer_pid(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        perror("getsockopt(SO_PEERCRED)");
+        return -1;
+    }
+    return cred.pid;
+}
+
+void *socket_accept_thread(void *arg) {
+    (void)arg;
+    // the listening socket is non-blocking for the event loops, wait for it here instead
+    int flags = fcntl(listen_fd, F_GETFL);
+    fcntl(listen_fd, F_SETFL, flags & ~O_NONBLOCK);
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept4");
+            break;
+        }
+        pid_t client_pid = socket_peer_pid(fd);
+        if (client_pid <= 0) {
+            close(fd);
+            continue;
+        }
+        spawn_client_thread(client_pid, fd, "", "");
+    }
+    return NULL;
 }
 
-void add_client(pid_t pid, int fd_c2s, int fd_s2c, const char* fifo_c2s_name, const char* fifo_s2c_name) {
+void add_client(pid_t pid, int fd_c2s, int fd_s2c, const char* fifo_c2s_name, const char* fifo_s2c_name, client_output *out) {
     // add client to list
     client_node_t *cn = malloc(sizeof(client_node_t));
     if (!cn) {
@@ -190,6 +627,9 @@ void add_client(pid_t pid, int fd_c2s, int fd_s2c, const char* fifo_c2s_name, co
     cn->fifo_c2s[sizeof(cn->fifo_c2s) - 1] = '\0';
     strncpy(cn->fifo_s2c, fifo_s2c_name, sizeof(cn->fifo_s2c) - 1);
     cn->fifo_s2c[sizeof(cn->fifo_s2c) - 1] = '\0';
+    cn->out = out;
+    cn->delta = false;
+    cn->sent = NULL;
 
     pthread_mutex_lock(&client_mutex);
     cn->next = client_head;
@@ -205,10 +645,8 @@ void remove_client(pid_t pid) {
         if ((*cur)->pid == pid) {
             client_node_t *tmp = *cur;
             *cur = tmp->next;
-            close(tmp->fd_c2s);
-            close(tmp->fd_s2c);
-            unlink(tmp->fifo_c2s);
-            unlink(tmp->fifo_s2c);
+            close_client_channel(tmp->fd_c2s, tmp->fd_s2c, tmp->fifo_c2s, tmp->fifo_s2c);
+            snapshot_release(tmp->sent);
             free(tmp);
             break;
         }
@@ -217,682 +655,1644 @@ void remove_client(pid_t pid) {
     pthread_mutex_unlock(&client_mutex);
 }
 
-void broadcast_document() {
-    // lock client/doc mutex
-    pthread_mutex_lock(&client_mutex);
-    pthread_mutex_lock(&doc_mutex);
-
-    char verbuf[32];
-    char lenbuf[32];
-    
-    snprintf(verbuf, sizeof(verbuf), "%llu\n", (unsigned long long)global_doc->version);
-    snprintf(lenbuf, sizeof(lenbuf), "%zu\n", global_doc->total_length);
+static void client_output_init(client_output *o, int fd, loop_conn *conn) {
+    pthread_mutex_init(&o->mutex, NULL);
+    out_queue_init(&o->queue);
+    o->fd = fd;
+    o->conn = conn;
+    o->wake_efd = -1;
+    o->armed = false;
+    o->broken = false;
+    o->lagging = false;
+    o->binary = false;
+    o->peak = 0;
+    o->skipped = 0;
+    o->resyncs = 0;
+    o->bytes_queued = 0;
+    o->bytes_sent = 0;
+    o->held = NULL;
+    o->held_count = 0;
+    o->held_cap = 0;
+}
 
-    char *doc_content = markdown_flatten(global_doc);
+static void client_output_destroy(client_output *o) {
+    free(o->held);
+    out_queue_free(&o->queue);
+    if (o->wake_efd != -1) close(o->wake_efd);
+    pthread_mutex_destroy(&o->mutex);
+}
 
-    for (client_node_t *c = client_head; c; c = c->next) {
-        write(c->fd_s2c, verbuf, strlen(verbuf));
-        write(c->fd_s2c, lenbuf, strlen(lenbuf));
-        if (doc_content && global_doc->total_length > 0) {
-            write(c->fd_s2c, doc_content, global_doc->total_length);
-        }
+static void client_output_wake(client_output *o) {
+    uint64_t one = 1;
+    if (write(o->wake_efd, &one, sizeof(one)) < 0) {
+        perror("client_output_wake: eventfd write");
     }
+}
 
-    if (doc_content) {
-        free(doc_content);
+// caller holds o->mutex
+static void loop_conn_watch_output(loop_conn *conn, bool on) {
+    if (conn->out.armed == on) return;
+    int ret;
+    if (conn->fd_s2c == conn->fd_c2s) {
+        struct epoll_event ev = { .events = EPOLLIN | (on ? EPOLLOUT : 0), .data.ptr = &conn->rd_watch };
+        ret = epoll_ctl(conn->loop->epfd, EPOLL_CTL_MOD, conn->fd_c2s, &ev);
+    } else if (on) {
+        struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = &conn->wr_watch };
+        ret = epoll_ctl(conn->loop->epfd, EPOLL_CTL_ADD, conn->fd_s2c, &ev);
+    } else {
+        ret = epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->fd_s2c, NULL);
     }
-
-    pthread_mutex_unlock(&doc_mutex);
-    pthread_mutex_unlock(&client_mutex);
+    if (ret == -1) {
+        perror("epoll_ctl: watch output");
+        return;
+    }
+    conn->out.armed = on;
 }
 
-void *broadcast_thread(void *arg) {
-    int interval = *(int *)arg;
-    free(arg);
-
-    while (1) {
-        sleep(interval);
-        broadcast_document();
+// Wait for the fd to take more: the loop watches it, or the client thread is told to. Caller holds o->mutex
+static void client_output_watch(client_output *o, bool on) {
+    if (o->conn) {
+        loop_conn_watch_output(o->conn, on);
+        return;
     }
-    return NULL;
+    if (on && !o->armed) client_output_wake(o);
+    o->armed = on;
 }
 
-void *handle_client(void *arg) {
-    // handle one client
-    thread_data *data = (thread_data *)arg;
-    pid_t client_pid = data->client_pid;
-    char client_fifo_c2s_name[64];
-    char client_fifo_s2c_name[64];
-
-    strncpy(client_fifo_c2s_name, data->fifo_c2s, sizeof(client_fifo_c2s_name) -1);
-    client_fifo_c2s_name[sizeof(client_fifo_c2s_name)-1] = '\0';
-    strncpy(client_fifo_s2c_name, data->fifo_s2c, sizeof(client_fifo_s2c_name)-1);
-    client_fifo_s2c_name[sizeof(client_fifo_s2c_name)-1] = '\0';
-
-    int fd_c2s = open(client_fifo_c2s_name, O_RDONLY);
-    int fd_s2c = open(client_fifo_s2c_name, O_WRONLY);
-
-    if (fd_c2s == -1 || fd_s2c == -1) {
-        perror("handle_client: error open fifos");
-        if(fd_c2s != -1) close(fd_c2s);
-        if(fd_s2c != -1) close(fd_s2c);
-        unlink(client_fifo_c2s_name); 
-        unlink(client_fifo_s2c_name);
-        free(data);
-        return NULL;
+// Drop the client, whoever reads its commands closes it. Caller holds o->mutex
+static void client_output_drop(client_output *o, pid_t pid) {
+    o->broken = true;
+    out_queue_clear(&o->queue);
+    if (!o->conn) {
+        client_output_wake(o);
+        return;
     }
-
-    char username[256];
-    memset(username, 0, sizeof(username));
-    ssize_t nread = read(fd_c2s, username, sizeof(username) - 1);
-
-    if (nread <= 0) {
-        if (nread == 0) {
-            fprintf(stderr, "handle_client: client %d disconnected before sending username.\n", client_pid);
-        } else {
-            perror("handle_client: error reading username");
-        }
-        close(fd_c2s);
-        close(fd_s2c);
-        unlink(client_fifo_c2s_name);
-        unlink(client_fifo_s2c_name);
-        free(data);
-        return NULL;
+    // a negative pid on the wake pipe means close that client
+    pid_t drop = -pid;
+    if (write(o->conn->loop->wake_wr, &drop, sizeof(drop)) != sizeof(drop)) {
+        perror("client_output_drop: wake pipe");
     }
-    username[strcspn(username, "\n")] = '\0';
-
-    // check user role
-    char *role = check_user_role(username);
-    if (role && strlen(role) > 0) {
-        add_client(client_pid, fd_c2s, fd_s2c, client_fifo_c2s_name, client_fifo_s2c_name);
-
-        if (write(fd_s2c, role, strlen(role)) < 0 || write(fd_s2c, "\n", 1) < 0) {
-            perror("handle_client: error writing role");
-            free(role);
-            remove_client(client_pid);
-            free(data);
-            return NULL;
-        }
-        free(role); 
-
-        pthread_mutex_lock(&doc_mutex);
-        // 1. VERSION\n
-        if (write(fd_s2c, "VERSION\n", 8) < 0) {
-            pthread_mutex_unlock(&doc_mutex);
-            perror("handle_client: error writing VERSION\\n");
-            remove_client(client_pid);
-            free(data);
-            return NULL;
-        }
-        // 2. version
-        char verbuf[32];
-        snprintf(verbuf, sizeof(verbuf), "%llu\n", (unsigned long long)global_doc->version);
-        if (write(fd_s2c, verbuf, strlen(verbuf)) < 0) {
-            pthread_mutex_unlock(&doc_mutex);
-            perror("handle_client: error writing version");
-            remove_client(client_pid);
-            free(data);
-            return NULL;
-        }
-        // 3. DOC\n
-        if (write(fd_s2c, "DOC\n", 4) < 0) {
-            pthread_mutex_unlock(&doc_mutex);
-            perror("handle_client: error writing DOC\n");
-            remove_client(client_pid);
-            free(data);
-            return NULL;
-        }
-        // 4. length\n
-        char lenbuf[32];
-        snprintf(lenbuf, sizeof(lenbuf), "%zu\n", global_doc->total_length);
-        if (write(fd_s2c, lenbuf, strlen(lenbuf)) < 0) {
-            pthread_mutex_unlock(&doc_mutex);
-            perror("handle_client: error writing length");
-            remove_client(client_pid);
-            free(data);
-            return NULL;
-        }
-        // 5. content
-        char *doc_content = markdown_flatten(global_doc);
-        if (doc_content) {
-            size_t written = 0;
-            ssize_t ret;
-            while (written < global_doc->total_length) {
-                ret = write(fd_s2c, doc_content + written, global_doc->total_length - written);
-                if (ret <= 0) {
-                    free(doc_content);
-                    pthread_mutex_unlock(&doc_mutex);
-                    perror("handle_client: error writing initial document content");
-                    remove_client(client_pid);
-                    free(data);
-                    return NULL;
-                }
-                written += (size_t)ret;
-            }
-            free(doc_content);
-        }
-        // 6. \nEND\n
-        if (write(fd_s2c, "\nEND\n", 5) < 0) {
-            pthread_mutex_unlock(&doc_mutex);
-            perror("handle_client: error writing END marker");
-            remove_client(client_pid);
-            free(data);
-            return NULL;
-        }
-        pthread_mutex_unlock(&doc_mutex);
-
-        char command_buffer[1024];
-        while (1) {
-            nread = read(fd_c2s, command_buffer, sizeof(command_buffer)-1);
-            if (nread <= 0)
-                break;
-            command_buffer[nread] = '\0';
-            printf("[SERVER] RECV from %s (bytes=%zd): '%s'\n", username, nread, command_buffer);
-
-            if (strncmp(command_buffer, "DISCONNECT", 10) == 0 || strncmp(command_buffer, "disconnect", 10) == 0) {
-                printf("[SERVER] Client %d is disconnecting\n", client_pid);
-                write(fd_s2c, "SUCCESS\n", 8);
-                enqueue_command(username, command_buffer, 0, NULL);
-                remove_client(client_pid);
-                free(data);
-                return NULL;
-            }
-
-            char *reason_str = NULL;
-            printf("[SERVER] Before process_command: '%s'\n", command_buffer);
-            int rc = process_command(username, command_buffer, &reason_str);
-            printf("[SERVER] After process_command: result=%d, reason=%s\n", 
-                   rc, reason_str ? reason_str : "NULL");
+}
 
-            enqueue_command(username, command_buffer, rc, reason_str);
-            if (rc == 0) {
-                write(fd_s2c, "SUCCESS\n", 8);
-            } else {
-                char reject_msg[512];
-                snprintf(reject_msg, sizeof(reject_msg), "Reject %s\n", 
-                         reason_str ? reason_str : "Unknown reason");
-                write(fd_s2c, reject_msg, strlen(reject_msg));
+// caller holds o->mutex
+static void client_output_flush_locked(client_output *o) {
+    size_t queued = out_queue_len(&o->queue);
+    if (!o->broken && queued > 0) {
+        if (o->conn && o->conn->has_shm) {
+            while (out_queue_len(&o->queue) > 0) {
+                size_t moved = shm_channel_write(&o->conn->shm, conn_buf_head(&o->queue.buf), out_queue_len(&o->queue));
+                out_queue_consume(&o->queue, moved);
+                // ring full, the client wakes the loop once it made room
+                if (moved == 0 && shm_channel_park_writer(&o->conn->shm)) break;
             }
-            if (reason_str) {
-                free(reason_str);
+        } else {
+            int ret = out_queue_flush_fd(&o->queue, o->fd);
+            if (ret < 0) {
+                // the client is gone, whoever reads its commands notices the EOF
+                o->broken = true;
+                out_queue_clear(&o->queue);
+            } else if (ret > 0) {
+                client_output_watch(o, true);
             }
         }
-
-        if (nread == 0) {
-            printf("Client %d (PID: %d) disconnected.\n", getpid(), client_pid);
-        } else if (nread < 0) {
-            perror("handle_client: error reading command from client");
-        }
-        
-        remove_client(client_pid);
-
-    } else {
-        if (role) free(role);
-        const char *reject_msg = "Reject UNAUTHORISED\n";
-        if(write(fd_s2c, reject_msg, strlen(reject_msg)) < 0) {
-             perror("handle_client: error writing reject message");
-        }
-        
-        close(fd_c2s);
-        close(fd_s2c);
-        unlink(client_fifo_c2s_name);
-        unlink(client_fifo_s2c_name);
+        // a failed write cleared what it did not get
+        if (!o->broken) o->bytes_sent += queued - out_queue_len(&o->queue);
     }
-
-    free(data);
-    return NULL;
-}
-
-char *check_user_role(const char *username) {
-    // check roles.txt
-    FILE *file = fopen("roles.txt", "r");
-    if (!file) {
-        perror("error open roles.txt");
-        return NULL;
+    if (out_queue_len(&o->queue) == 0 && o->lagging) {
+        // caught up with what it was sent, now bring it up to date
+        o->lagging = false;
+        atomic_store(&broadcast_catchup, true);
+        mark_document_dirty();
     }
+}
 
-    char line[256];
-    char *role = NULL;
-
-    while (fgets(line, sizeof(line), file)) {
-        char *user = line;
-        char *perm = NULL;
+static void client_out_begin(client_output *o) {
+    pthread_mutex_lock(&o->mutex);
+}
 
-        for (char *p = line; *p != '\0'; p++) {
-            if (*p == ' ' || *p == '\n' || *p == '\t') {
-                *p = '\0';
-                perm = p + 1;
-                break;
-            }
-        }
-        if (!perm) {
-            continue;
-        }
+// what was written since client_out_begin is one message, it goes out as far as the fd takes it
+static void client_out_end(client_output *o) {
+    out_queue_end_message(&o->queue);
+    if (out_queue_len(&o->queue) > o->peak) o->peak = out_queue_len(&o->queue);
+    client_output_flush_locked(o);
+    pthread_mutex_unlock(&o->mutex);
+}
 
-        //delete empty chars
-        user = trim_whitespace(user);
-        perm = trim_whitespace(perm);
-        if (strlen(user) == 0 || strlen(perm) == 0) {
-            continue;
-        }
-        if (strcmp(user, username) == 0) {
-            size_t len = strlen(perm);
-            char *safe_perm = malloc(len + 1);
-            if (safe_perm) {
-                memcpy(safe_perm, perm, len + 1);
-                safe_perm[len] = '\0';
-                role = safe_perm;
-            }
-            break;
-        }
+// between client_out_begin and client_out_end, queued output only reaches the fd at the end
+static int client_write(client_output *o, const void *data, size_t len) {
+    if (o->broken) return -1;
+    if (out_queue_append(&o->queue, data, len) < 0) {
+        errno = ENOMEM;
+        return -1;
     }
-    fclose(file);
-    return role;
+    o->bytes_queued += len;
+    return 0;
 }
 
-char *trim_whitespace(char *s) {
-    // trim spaces
-    while (isspace((unsigned char)*s)) ++s;
-    if (*s == 0) return s;
-    char *end = s + strlen(s) - 1;
-    while (end > s && isspace((unsigned char)*end)) --end;
-    end[1] = '\0';
-    return s;
+static int client_write_piece(void *ctx, const char *data, size_t len) {
+    return client_write((client_output *)ctx, data, len);
 }
 
-void enqueue_command(const char *user, const char *command, int result, const char *reason) {
-    // add to command log
-    pending_command_t *ptr = malloc(sizeof(*ptr));
-    ptr->user = strdup(user);
-    ptr->command = strdup(command);
-    ptr->result = result;
-    ptr->reason = reason ? strdup(reason) : NULL;
-    ptr->next = NULL;
-
-    pthread_mutex_lock(&cmd_queue_mutex);
-
-    //find the end of queue
-    pending_command_t **cur = &cmd_queue_head;
-    while (*cur) {
-        cur = &(*cur)->next;
-    }
-    *cur = ptr;
-    pthread_mutex_unlock(&cmd_queue_mutex);
+static int client_write_snapshot(client_output *o, const doc_snapshot *snap, size_t from, size_t len) {
+    return snapshot_for_each(snap, from, len, client_write_piece, o);
+}
 
+static int client_send(client_output *o, const void *data, size_t len) {
+    client_out_begin(o);
+    int ret = client_write(o, data, len);
+    client_out_end(o);
+    return ret;
 }
 
-void *server_stdin_thread(void *arg) {
-    // handle server stdin
-    (void)arg;
-    char buf[256];
-    while (fgets(buf, sizeof(buf), stdin)) {
-        size_t len = strlen(buf);
-        if (len > 0 && buf[len - 1] == '\n') buf[len - 1] = '\0';
-        if (strcmp(buf, "DOC?") == 0) {
-            //pthread_mutex_lock(&doc_mutex);
-            printf("[SERVER] Current document (version %llu, length %zu):\n", 
-                    (unsigned long long)global_doc->version, 
-                    global_doc->total_length);
-            
-            char *doc_content = markdown_flatten(global_doc);
-            if (doc_content && global_doc->total_length > 0) {
-                fwrite(doc_content, 1, global_doc->total_length, stdout);
-                free(doc_content);
+// Header of a binary frame, the payload_len bytes that follow are the caller's. Caller holds o->mutex
+static int client_write_frame_header(client_output *o, wire_op op, uint64_t payload_len) {
+    char header[WIRE_HEADER_MAX];
+    return client_write(o, header, wire_frame_header(header, op, payload_len));
+}
+
+// the bytes a client holds for snap, what a full sync sends
+static size_t wire_length(const doc_snapshot *snap) {
+    return snap->total_length < snap->flat_len ? snap->total_length : snap->flat_len;
+}
+
+// VERSION\n<version>\nDOC\n<length>\n<content>\nEND\n, or a WIRE_SYNC frame. Caller holds o->mutex
+static int write_initial_sync(client_output *o, const doc_snapshot *snap) {
+    if (o->binary) {
+        char version[WIRE_VARINT_MAX];
+        size_t n = wire_put_varint(version, snap->version);
+        size_t len = wire_length(snap);
+        if (client_write_frame_header(o, WIRE_SYNC, n + len) < 0 || client_write(o, version, n) < 0 ||
+            client_write_snapshot(o, snap, 0, len) < 0) {
+            perror("write_initial_sync: error writing document frame");
+            return -1;
+        }
+        return 0;
+    }
+    // 1. VERSION\n
+    if (client_write(o, "VERSION\n", 8) < 0) {
+        perror("handle_client: error writing VERSION\\n");
+        return -1;
+    }
+    // 2. version
+    char verbuf[32];
+    snprintf(verbuf, sizeof(verbuf), "%llu\n", (unsigned long long)snap->version);
+    if (client_write(o, verbuf, strlen(verbuf)) < 0) {
+        perror("handle_client: error writing version");
+        return -1;
+    }
+    // 3. DOC\n
+    if (client_write(o, "DOC\n", 4) < 0) {
+        perror("handle_client: error writing DOC\n");
+        return -1;
+    }
+    // 4. length\n
+    char lenbuf[32];
+    snprintf(lenbuf, sizeof(lenbuf), "%zu\n", snap->total_length);
+    if (client_write(o, lenbuf, strlen(lenbuf)) < 0) {
+        perror("handle_client: error writing length");
+        return -1;
+    }
+    // 5. content
+    if (client_write_snapshot(o, snap, 0, snap->total_length) < 0) {
+        perror("handle_client: error writing initial document content");
+        return -1;
+    }
+    // 6. \nEND\n
+    if (client_write(o, "\nEND\n", 5) < 0) {
+        perror("handle_client: error writing END marker");
+        return -1;
+    }
+    return 0;
+}
+
+// what changed between a base a client holds and the snapshot being broadcast
+typedef struct {
+    const doc_snapshot *base;
+    size_t prefix;
+    size_t suffix;
+} delta_plan;
+
+// DELTA <base version> <version> <pos> <deleted> <inserted>\n<inserted bytes>\nEND\n or a WIRE_DELTA frame, or
+// the whole document like the initial sync when the client is too far behind for a delta to pay off. Caller
+// holds client_mutex and o->mutex
+static void write_delta(client_output *o, const doc_snapshot *base, const doc_snapshot *snap, delta_plan *plans, size_t *plan_count) {
+    if (snap->version - base->version > DELTA_MAX_VERSIONS) {
+        write_initial_sync(o, snap);
+        return;
+    }
+
+    // clients mostly sit on the same base, diff it once per broadcast
+    delta_plan plan = { base, 0, 0 };
+    size_t i = 0;
+    while (i < *plan_count && plans[i].base != base) i++;
+    if (i < *plan_count) {
+        plan = plans[i];
+    } else {
+        snapshot_diff(base, wire_length(base), snap, wire_length(snap), &plan.prefix, &plan.suffix);
+        if (*plan_count < DELTA_PLAN_CACHE) plans[(*plan_count)++] = plan;
+    }
+
+    size_t deleted = wire_length(base) - plan.prefix - plan.suffix;
+    size_t inserted = wire_length(snap) - plan.prefix - plan.suffix;
+    // a delta about as big as the document is not worth it
+    if (inserted > 0 && inserted >= wire_length(snap) / 2) {
+        write_initial_sync(o, snap);
+        return;
+    }
+
+    if (o->binary) {
+        char fields[4 * WIRE_VARINT_MAX];
+        size_t n = wire_put_varint(fields, base->version);
+        n += wire_put_varint(fields + n, snap->version);
+        n += wire_put_varint(fields + n, plan.prefix);
+        n += wire_put_varint(fields + n, deleted);
+        client_write_frame_header(o, WIRE_DELTA, n + inserted);
+        client_write(o, fields, n);
+        client_write_snapshot(o, snap, plan.prefix, inserted);
+        return;
+    }
+
+    char header[128];
+    snprintf(header, sizeof(header), "DELTA %llu %llu %zu %zu %zu\n", (unsigned long long)base->version,
+             (unsigned long long)snap->version, plan.prefix, deleted, inserted);
+    client_write(o, header, strlen(header));
+    client_write_snapshot(o, snap, plan.prefix, inserted);
+    client_write(o, "\nEND\n", 5);
+}
+
+// <version>\n<length>\n<content>. A thread-per-client client with nothing queued gets it straight away: tee()d
+// from the staging pipe into its FIFO (filled on the first call of a broadcast), writev for what tee did not
+// take. Whatever the fd does not take right now is queued. *staged is 0 until staging was tried, then 1 or -1.
+// Caller holds client_mutex and o->mutex
+static void write_plain_broadcast(const client_node_t *c, client_output *o, const char *header, size_t header_len,
+                                  const doc_snapshot *snap, int *staged) {
+    size_t total = header_len + snap->total_length;
+    size_t done = 0;
+    if (!o->conn && !o->broken && out_queue_len(&o->queue) == 0) {
+        ssize_t ret = -1;
+        if (c->fifo_s2c[0] != '\0' && *staged >= 0) {
+            if (*staged == 0) {
+                *staged = fanout_stage(&broadcast_fanout, header, header_len, snap, snap->total_length) == 0 ? 1 : -1;
+            }
+            if (*staged > 0) ret = fanout_tee(&broadcast_fanout, o->fd);
+        }
+        if (ret > 0) done = (size_t)ret;
+        if (done < total) {
+            ret = fanout_writev(o->fd, header, header_len, snap, snap->total_length, done);
+            if (ret > 0) done += (size_t)ret;
+        }
+        // straight to the fd, past the queue
+        o->bytes_queued += done;
+        o->bytes_sent += done;
+    }
+    if (done < header_len) client_write(o, header + done, header_len - done);
+    size_t from = done > header_len ? done - header_len : 0;
+    if (from < snap->total_length) client_write_snapshot(o, snap, from, snap->total_length - from);
+}
+
+// The client's queue is over the limit. Returns true if snap still went out (as a full resync),
+// caller holds client_mutex and o->mutex
+static bool apply_lag_policy(client_node_t *c, client_output *o, const doc_snapshot *snap) {
+    switch (lag_mode) {
+    case LAG_SKIP:
+        // c->sent stays, the catch-up broadcast is relative to what it really got
+        o->lagging = true;
+        o->skipped++;
+        return false;
+    case LAG_DISCONNECT:
+        atomic_fetch_add(&lag_disconnects, 1);
+        client_output_drop(o, c->pid);
+        return false;
+    case LAG_RESYNC:
+    default:
+        out_queue_drop_unsent(&o->queue);
+        o->resyncs++;
+        write_initial_sync(o, snap);
+        return true;
+    }
+}
+
+// SUCCESS or Reject <reason>, as a frame for a binary client. Caller holds o->mutex
+static int write_result(client_output *o, int rc, const char *reason) {
+    if (!reason) reason = "Unknown reason";
+    if (o->binary) {
+        if (rc == 0) return client_write_frame_header(o, WIRE_OK, 0);
+        size_t len = strlen(reason);
+        if (client_write_frame_header(o, WIRE_REJECT, len) < 0) return -1;
+        return client_write(o, reason, len);
+    }
+    if (rc == 0) return client_write(o, "SUCCESS\n", 8);
+    char reject_msg[512];
+    int len = snprintf(reject_msg, sizeof(reject_msg), "Reject %s\n", reason);
+    return client_write(o, reject_msg, (size_t)len < sizeof(reject_msg) ? (size_t)len : sizeof(reject_msg) - 1);
+}
+
+// A batch's EDIT lines, one WIRE_EDITS frame for a binary client. Caller holds o->mutex
+static void write_edit_log(client_output *o, const char *log, size_t len) {
+    if (len == 0) return;
+    if (o->binary && client_write_frame_header(o, WIRE_EDITS, len) < 0) return;
+    client_write(o, log, len);
+}
+
+static int batch_order(const void *a, const void *b) {
+    const batched_command *x = a;
+    const batched_command *y = b;
+    if (x->pid != y->pid) return x->pid < y->pid ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// first command of pid in a batch sorted by batch_order
+static size_t batch_find(const command_batch *batch, pid_t pid) {
+    size_t lo = 0;
+    size_t hi = batch->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (batch->items[mid].pid < pid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// batch is the commands the broadcast version committed in batch mode, NULL otherwise
+void broadcast_document(command_batch *batch) {
+    uint64_t start = stats_now();
+    // client mutex keeps broadcasts in version order, the document itself is read from a snapshot
+    // so editors never wait for a slow client
+    pthread_mutex_lock(&client_mutex);
+    doc_snapshot *snap = markdown_snapshot(global_doc);
+    bool catchup = atomic_exchange(&broadcast_catchup, false);
+    bool answers = batch && batch->count > 0;
+    // an edit that was already covered by the previous broadcast, unless a lagging client is still behind or
+    // a batch that changed nothing still has to be answered
+    if (!snap || (snap->version == last_broadcast_version && !catchup && !answers)) {
+        pthread_mutex_unlock(&client_mutex);
+        snapshot_release(snap);
+        return;
+    }
+    last_broadcast_version = snap->version;
+
+    char version_line[64];
+    size_t version_len = (size_t)snprintf(version_line, sizeof(version_line), "%llu\n%zu\n",
+                                          (unsigned long long)snap->version, snap->total_length);
+    const char *header = version_line;
+    size_t header_len = version_len;
+    // a batch's EDIT log goes in front of the document, in the order the commands came in
+    size_t log_len = 0;
+    char *joined = NULL;
+    if (answers) {
+        for (size_t i = 0; i < batch->count; i++) log_len += batch->items[i].edit_len;
+        joined = malloc(log_len + version_len);
+        if (joined) {
+            size_t at = 0;
+            for (size_t i = 0; i < batch->count; i++) {
+                memcpy(joined + at, batch->items[i].edit, batch->items[i].edit_len);
+                at += batch->items[i].edit_len;
             }
-            printf("\n");
-            //pthread_mutex_unlock(&doc_mutex);
-        } else if (strcmp(buf, "LOG?") == 0) {
-            printf("[SERVER] Current commands log (pending queue):\n");
-            for (pending_command_t *p = cmd_queue_head; p; p = p->next) {
-                printf("EDIT %s %s %s %s\n", 
-                p->user, 
-                p->command, 
-                p->result == 0 ? "SUCCESS" : "Reject",
-                p->reason == 0 ? "" : p->reason);
+            memcpy(joined + at, version_line, version_len);
+            header = joined;
+            header_len = log_len + version_len;
+        } else {
+            perror("broadcast_document: EDIT log");
+            log_len = 0;
+        }
+        // each client's own answers are looked up by pid
+        qsort(batch->items, batch->count, sizeof(*batch->items), batch_order);
+    }
+    int staged = 0;
+
+    delta_plan plans[DELTA_PLAN_CACHE];
+    size_t plan_count = 0;
+    for (client_node_t *c = client_head; c; c = c->next) {
+        // still waiting for its initial sync, which will be at least this version
+        if (!c->sent) continue;
+        bool behind = c->sent->version != snap->version;
+        if (!behind && !answers) continue;
+        client_output *o = c->out;
+        client_out_begin(o);
+        if (o->broken) {
+            client_out_end(o);
+            continue;
+        }
+        uint64_t queued = o->bytes_queued;
+        // answers to its own commands come first
+        if (answers) {
+            for (size_t i = batch_find(batch, c->pid); i < batch->count && batch->items[i].pid == c->pid; i++) {
+                const batched_command *b = &batch->items[i];
+                if (o->binary) {
+                    write_result(o, b->rejected ? -1 : 0, b->reason);
+                } else {
+                    client_write(o, b->edit + b->reply, b->edit_len - b->reply);
+                }
             }
-        } else if (strcmp(buf, "QUIT") == 0) {
-            int has_clients = (client_head != NULL);
-            if (has_clients) {
-                int count = 0;
-                for (client_node_t *c = client_head; c; c = c->next) count++;
-                printf("QUIT rejected, %d clients still connected.\n", count);
+        }
+        bool delivered = true;
+        if (out_queue_len(&o->queue) >= out_queue_limit) {
+            if (behind) delivered = apply_lag_policy(c, o, snap);
+        } else {
+            // whatever was skipped before is covered by this one
+            o->lagging = false;
+            if (!behind) {
+                write_edit_log(o, header, log_len);
+            } else if (c->delta) {
+                write_edit_log(o, header, log_len);
+                write_delta(o, c->sent, snap, plans, &plan_count);
             } else {
-                printf("[SERVER] Received QUIT command. Exiting...\n");
-                //pthread_mutex_lock(&doc_mutex);
-                char *content = markdown_flatten(global_doc);
-                FILE *out = fopen("doc.md", "w");
-                if (out) {
-                    fwrite(content, 1, global_doc->total_length, out);
-                    fclose(out);
-                }
-                free(content);
-                //pthread_mutex_unlock(&doc_mutex);
-                markdown_free(global_doc);
-                exit(0);
+                write_plain_broadcast(c, o, header, header_len, snap, &staged);
             }
         }
+        if (behind && delivered && !o->broken) {
+            snapshot_release(c->sent);
+            atomic_fetch_add(&snap->refs, 1);
+            c->sent = snap;
+        }
+        if (o->bytes_queued > queued) stats_record(&broadcast_bytes, o->bytes_queued - queued);
+        client_out_end(o);
     }
-    return NULL;
+    if (staged > 0) fanout_drop(&broadcast_fanout);
+
+    pthread_mutex_unlock(&client_mutex);
+    snapshot_release(snap);
+    free(joined);
+    stats_record_since(&broadcast_latency, start);
 }
 
-int process_command(const char *user, const char *command, char **reason) {
-    (void)user;
-    
-    char *cmd_copy = strdup(command);
-    if (!cmd_copy) {
-        *reason = strdup("Memory allocation failed");
-        return -1;
+// Initial sync for a client just put on the list, later delta broadcasts build on what it got here
+static int sync_new_client(pid_t client_pid, client_output *o) {
+    pthread_mutex_lock(&client_mutex);
+    doc_snapshot *snap = markdown_snapshot(global_doc);
+    int synced = -1;
+    if (snap) {
+        client_out_begin(o);
+        synced = write_initial_sync(o, snap);
+        client_out_end(o);
     }
-    
-    size_t len = strlen(cmd_copy);
-    if (len > 0 && cmd_copy[len-1] == '\n') {
-        cmd_copy[len-1] = '\0';
-        len--;
+    for (client_node_t *c = client_head; synced == 0 && c; c = c->next) {
+        if (c->pid == client_pid) {
+            snapshot_release(c->sent);
+            atomic_fetch_add(&snap->refs, 1);
+            c->sent = snap;
+            break;
+        }
     }
-    
-    if (len > 0 && cmd_copy[len-1] == '\r') {
-        cmd_copy[len-1] = '\0';
+    pthread_mutex_unlock(&client_mutex);
+    snapshot_release(snap);
+    return synced;
+}
+
+static void client_enable_delta(pid_t client_pid) {
+    pthread_mutex_lock(&client_mutex);
+    for (client_node_t *c = client_head; c; c = c->next) {
+        if (c->pid == client_pid) {
+            c->delta = true;
+            break;
+        }
     }
-    
-    printf("[SERVER] Trimmed command: '%s'\n", cmd_copy);
-    
-    pthread_mutex_lock(&doc_mutex);
-    int result = -1;
-    uint64_t cur_version = global_doc->version;
-    
-    // handle each command
-    if (strncmp(cmd_copy, "INSERT", 6) == 0) {
-        const char *p = cmd_copy + 7;
-        char *endptr;
-        long position = strtol(p, &endptr, 10);
-        if (endptr == p || (*endptr != ' ' && *endptr != '\t')) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid INSERT format. Expected: INSERT pos text");
-            return -1;
+    pthread_mutex_unlock(&client_mutex);
+}
+
+// Switch the client to binary frames, which always carry deltas. The answer is the last text it gets
+static void client_enable_binary(pid_t client_pid, client_output *o) {
+    pthread_mutex_lock(&client_mutex);
+    for (client_node_t *c = client_head; c; c = c->next) {
+        if (c->pid == client_pid) {
+            c->delta = true;
+            break;
         }
-        size_t pos = (size_t)position;
-        p = endptr;
-        while (*p == ' ' || *p == '\t') p++;
-        printf("[SERVER] Inserting at pos %zu: '%s'\n", pos, p);
-        result = markdown_insert(global_doc, cur_version, pos, p);
-        if (result == 0) {
-            markdown_commit(global_doc);
-            printf("[SERVER] Document updated to version %llu, length %zu\n", 
-                   (unsigned long long)global_doc->version, global_doc->total_length);
+    }
+    // under client_mutex, so every broadcast is either before the answer and text or after it and binary
+    client_out_begin(o);
+    write_result(o, 0, NULL);
+    o->binary = true;
+    client_out_end(o);
+    pthread_mutex_unlock(&client_mutex);
+}
+
+static void send_result(client_output *out, int rc, const char *reason) {
+    client_out_begin(out);
+    write_result(out, rc, reason);
+    client_out_end(out);
+}
+
+// Send the held answers in one message, durable tells whether the WAL has their commits on disk. Without it
+// an edit is rejected rather than answered SUCCESS
+static void send_held_answers(client_output *out, bool durable) {
+    client_out_begin(out);
+    for (size_t i = 0; i < out->held_count; i++) {
+        const held_answer *a = &out->held[i];
+        if (a->rc == 0 && !durable) {
+            write_result(out, -1, NOT_DURABLE);
+        } else {
+            write_result(out, a->rc, a->reason);
         }
-        pthread_mutex_unlock(&doc_mutex);
-        free(cmd_copy);
-        if (result != 0) {
-            *reason = strdup("Insert operation failed");
-            return -1;
+    }
+    client_out_end(out);
+    out->held_count = 0;
+}
+
+// Wait for the WAL to sync what was committed so far and send what the client was held back
+static void release_answers(client_output *out) {
+    if (out->held_count == 0) return;
+    send_held_answers(out, wal_flush(&doc_wal) == 0);
+}
+
+// Answer an edit once its commit is on disk, whoever serves the client's commands releases the answers after
+// the commands it has at hand, so they share one fsync
+static void hold_answer(client_output *out, int rc, const char *reason) {
+    if (out->held_count == out->held_cap) {
+        size_t cap = out->held_cap ? out->held_cap * 2 : 16;
+        held_answer *grown = realloc(out->held, cap * sizeof(*grown));
+        if (!grown) {
+            // this one waits for the disk on its own
+            perror("hold_answer");
+            release_answers(out);
+            if (rc == 0 && wal_flush(&doc_wal) != 0) {
+                rc = -1;
+                reason = NOT_DURABLE;
+            }
+            send_result(out, rc, reason);
+            return;
         }
-        return 0;
+        out->held = grown;
+        out->held_cap = cap;
     }
-    if (strncmp(cmd_copy, "NEWLINE", 7) == 0) {
-        const char *p = cmd_copy + 8;
-        char *endptr;
-        long position = strtol(p, &endptr, 10);
-        if (endptr == p) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid NEWLINE format. Expected: NEWLINE pos");
-            return -1;
+    out->held[out->held_count].rc = rc;
+    out->held[out->held_count].reason = reason;
+    out->held_count++;
+}
+
+// Stage an edit for the commit that closes the current interval. The answer is held back for the broadcast
+// of that commit, unless there is no memory to hold it
+static void batch_command(client_output *out, pid_t client_pid, const char *username, char *command,
+                          const parsed_command *parsed) {
+    const char *reason = NULL;
+    pthread_mutex_lock(&batch_mutex);
+    int rc = process_command(username, command, parsed, false, &reason);
+    enqueue_command(username, command, rc, reason);
+    size_t cmd_len = strcspn(command, "\r\n");
+    if (rc == 0) {
+        open_batch.staged = true;
+        open_batch.edits++;
+        open_batch.edit_bytes += cmd_len;
+    }
+
+    char *edit = NULL;
+    int len = asprintf(&edit, "EDIT %s %.*s %s%s\n", username, (int)cmd_len, command, rc == 0 ? "SUCCESS" : "Reject ",
+                       rc == 0 ? "" : reason ? reason : "Unknown reason");
+    if (len >= 0 && open_batch.count == open_batch.cap) {
+        size_t cap = open_batch.cap ? open_batch.cap * 2 : 64;
+        batched_command *grown = realloc(open_batch.items, cap * sizeof(*grown));
+        if (grown) {
+            open_batch.items = grown;
+            open_batch.cap = cap;
         }
-        size_t pos = (size_t)position;
-        result = markdown_newline(global_doc, cur_version, pos);
-        if (result == 0) {
-            markdown_commit(global_doc);
-            printf("[SERVER] Document updated to version %llu, length %zu\n", 
-                   (unsigned long long)global_doc->version, global_doc->total_length);
-            pthread_mutex_unlock(&doc_mutex);
-            broadcast_document();
-            free(cmd_copy);
-            return 0;
+    }
+    bool held = len >= 0 && open_batch.count < open_batch.cap;
+    if (held) {
+        batched_command *b = &open_batch.items[open_batch.count];
+        b->pid = client_pid;
+        b->seq = open_batch.count;
+        b->edit = edit;
+        b->edit_len = (size_t)len;
+        b->reply = strlen("EDIT ") + strlen(username) + 1 + cmd_len + 1;
+        b->rejected = rc != 0;
+        b->reason = reason;
+        open_batch.count++;
+    }
+    pthread_mutex_unlock(&batch_mutex);
+
+    if (!held) {
+        perror("batch_command");
+        free(edit);
+        send_result(out, rc, reason);
+    }
+    // a rejected command still needs a broadcast to be answered
+    mark_document_dirty();
+}
+
+// The batch's commit never reached the disk, so nothing in it is answered SUCCESS. Its edits stay in the
+// document, they just will not survive a restart
+static void batch_not_durable(command_batch *batch) {
+    for (size_t i = 0; i < batch->count; i++) {
+        batched_command *b = &batch->items[i];
+        if (b->rejected) continue;
+        char *edit = NULL;
+        int len = asprintf(&edit, "%.*sReject " NOT_DURABLE "\n", (int)b->reply, b->edit);
+        if (len < 0) {
+            // the EDIT line and its reply become empty rather than SUCCESS
+            perror("batch_not_durable");
+            b->edit_len = b->reply = 0;
         } else {
-            *reason = strdup("INVALID_POSITION");
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            return -1;
+            free(b->edit);
+            b->edit = edit;
+            b->edit_len = (size_t)len;
         }
+        b->rejected = true;
+        b->reason = NOT_DURABLE;
     }
-    if (strncmp(cmd_copy, "HEADING", 7) == 0) {
-        const char *p = cmd_copy + 8;
-        char *endptr;
-        long level = strtol(p, &endptr, 10);
-        if (endptr == p || level < 1 || level > 6) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid HEADING level. Expected: HEADING level pos");
-            return -1;
+}
+
+// Commit what the interval staged and take its commands, anything staged from here on is the next batch
+static void close_batch(command_batch *batch) {
+    pthread_mutex_lock(&batch_mutex);
+    bool committed = open_batch.staged;
+    if (committed) {
+        pthread_mutex_lock(&doc_mutex);
+        uint64_t start = stats_now();
+        markdown_commit(global_doc);
+        wal_commit(&doc_wal, global_doc);
+        stats_record_since(&batch_commit_latency, start);
+        stats_record(&commit_edits, open_batch.edits);
+        stats_record(&commit_bytes, open_batch.edit_bytes);
+        printf("[SERVER] Batch of %zu commands committed as version %llu, length %zu\n", open_batch.count,
+               (unsigned long long)global_doc->version, global_doc->total_length);
+        pthread_mutex_unlock(&doc_mutex);
+    }
+    *batch = open_batch;
+    memset(&open_batch, 0, sizeof(open_batch));
+    pthread_mutex_unlock(&batch_mutex);
+    // the answers are held back anyway, so they only go out once the commit is on disk: one fsync per batch
+    if (committed && wal_flush(&doc_wal) != 0) batch_not_durable(batch);
+}
+
+static void batch_free(command_batch *batch) {
+    for (size_t i = 0; i < batch->count; i++) free(batch->items[i].edit);
+    free(batch->items);
+    memset(batch, 0, sizeof(*batch));
+}
+
+// Run one command from an authorised client and answer it. parsed is the command already decoded from a binary
+// frame, NULL if it still has to be parsed. Returns 1 if the client asked to disconnect
+static int serve_command(client_output *out, pid_t client_pid, const char *username, char *command, size_t nread,
+                         const parsed_command *parsed) {
+    printf("[SERVER] RECV from %s (bytes=%zu): '%s'\n", username, nread, command);
+
+    if (!parsed && (strncmp(command, "DISCONNECT", 10) == 0 || strncmp(command, "disconnect", 10) == 0)) {
+        printf("[SERVER] Client %d is disconnecting\n", client_pid);
+        // what is not an edit is answered right away, after the answers held for the edits before it
+        release_answers(out);
+        send_result(out, 0, NULL);
+        enqueue_command(username, command, 0, NULL);
+        return 1;
+    }
+
+    // not an edit, switches the client's broadcasts to deltas
+    if (!parsed && strncmp(command, "DELTA ON", 8) == 0) {
+        release_answers(out);
+        client_enable_delta(client_pid);
+        send_result(out, 0, NULL);
+        return 0;
+    }
+
+    // not an edit either, whatever the client sends after this line is binary frames
+    if (!parsed && strncmp(command, "BINARY ON", 9) == 0 && !out->binary) {
+        release_answers(out);
+        client_enable_binary(client_pid, out);
+        return 0;
+    }
+
+    if (batch_mode) {
+        batch_command(out, client_pid, username, command, parsed);
+        return 0;
+    }
+
+    const char *reason_str = NULL;
+    printf("[SERVER] Before process_command: '%s'\n", command);
+    int rc = process_command(username, command, parsed, true, &reason_str);
+    printf("[SERVER] After process_command: result=%d, reason=%s\n", 
+           rc, reason_str ? reason_str : "NULL");
+
+    enqueue_command(username, command, rc, reason_str);
+    hold_answer(out, rc, reason_str);
+    return 0;
+}
+
+// Called after every commit, the broadcast goes out once the interval has passed
+void mark_document_dirty(void) {
+    if (atomic_exchange(&doc_dirty, true)) return;
+    uint64_t one = 1;
+    if (write(dirty_efd, &one, sizeof(one)) < 0) {
+        perror("mark_document_dirty: eventfd write");
+    }
+}
+
+void *broadcast_thread(void *arg) {
+    int interval = *(int *)arg;
+    free(arg);
+
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tfd == -1) {
+        perror("broadcast_thread: timerfd_create");
+        return NULL;
+    }
+    struct itimerspec window;
+    memset(&window, 0, sizeof(window));
+    window.it_value.tv_sec = interval / 1000;
+    window.it_value.tv_nsec = (long)(interval % 1000) * 1000000L;
+    // zero would disarm the timer
+    if (interval <= 0) window.it_value.tv_nsec = 1;
+
+    uint64_t count;
+    while (1) {
+        // nothing to do until the first commit after the last broadcast
+        if (read(dirty_efd, &count, sizeof(count)) < 0) {
+            if (errno == EINTR) continue;
+            perror("broadcast_thread: eventfd read");
+            break;
         }
-        p = endptr + 1;
-        while (*p == ' ' || *p == '\t') p++;
-        long position = strtol(p, &endptr, 10);
-        if (endptr == p) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid HEADING position. Expected: HEADING level pos");
-            return -1;
+        // commits until the timer fires ride along in the same broadcast
+        timerfd_settime(tfd, 0, &window, NULL);
+        while (read(tfd, &count, sizeof(count)) < 0 && errno == EINTR) {
         }
-        size_t pos = (size_t)position;
-        result = markdown_heading(global_doc, cur_version, (size_t)level, pos);
-        if (result == 0) {
-            markdown_commit(global_doc);
-            printf("[SERVER] Document updated to version %llu, length %zu\n", 
-                   (unsigned long long)global_doc->version, global_doc->total_length);
-            pthread_mutex_unlock(&doc_mutex);
-            broadcast_document();
-            free(cmd_copy);
-            return 0;
+        // cleared before the snapshot is taken, so a commit that misses this broadcast schedules the next
+        atomic_store(&doc_dirty, false);
+        if (batch_mode) {
+            // one commit and one version for everything the interval staged
+            command_batch batch;
+            close_batch(&batch);
+            broadcast_document(&batch);
+            batch_free(&batch);
         } else {
-            *reason = strdup("INVALID_POSITION");
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            return -1;
+            broadcast_document(NULL);
         }
     }
-    if (strncmp(cmd_copy, "BOLD", 4) == 0) {
-        const char *p = cmd_copy + 5;
-        char *endptr;
-        long start = strtol(p, &endptr, 10);
-        if (endptr == p) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid BOLD format. Expected: BOLD start end");
-            return -1;
-        }
-        p = endptr;
-        while (*p == ' ' || *p == '\t') p++;
-        long end = strtol(p, &endptr, 10);
-        if (endptr == p) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid BOLD format. Expected: BOLD start end");
+    close(tfd);
+    return NULL;
+}
+
+// Blocking read until in holds a whole line, or EOF. Returns that line's length, 0 if the client went away
+// without sending one, -1 if a read failed
+static ssize_t read_first_line(int fd, conn_buf *in, size_t limit) {
+    char buf[USERNAME_MAX];
+    while (1) {
+        size_t len = conn_buf_line(in, limit, false);
+        if (len > 0) return (ssize_t)len;
+        ssize_t nread = read(fd, buf, sizeof(buf));
+        if (nread < 0 && errno == EINTR) continue;
+        if (nread == 0) return (ssize_t)conn_buf_line(in, limit, true);
+        if (nread < 0) return -1;
+        if (conn_buf_append(in, buf, (size_t)nread) < 0) {
+            errno = ENOMEM;
             return -1;
         }
-        result = markdown_bold(global_doc, cur_version, (size_t)start, (size_t)end);
-        if (result == 0) {
-            markdown_commit(global_doc);
-            printf("[SERVER] Document updated to version %llu, length %zu\n", 
-                   (unsigned long long)global_doc->version, global_doc->total_length);
-            pthread_mutex_unlock(&doc_mutex);
-            broadcast_document();
-            free(cmd_copy);
-            return 0;
+    }
+}
+
+// Take the next command buffered in in: a line, or a frame once the client switched to binary. line gets its
+// text, and *parsed is cmd if a WIRE_COMMAND frame already carried it split up, NULL otherwise. Returns the
+// bytes taken, 0 while the command is incomplete, -1 for a frame too broken to find the next one after it.
+// Only the thread serving the client's commands switches out->binary, so it is read without the lock
+static ssize_t take_command(const client_output *out, conn_buf *in, bool at_eof, char line[COMMAND_MAX],
+                            parsed_command *cmd, const parsed_command **parsed) {
+    *parsed = NULL;
+    if (!out->binary) {
+        size_t len = conn_buf_line(in, COMMAND_MAX - 1, at_eof);
+        if (len == 0) return 0;
+        memcpy(line, conn_buf_head(in), len);
+        line[len] = '\0';
+        conn_buf_consume(in, len);
+        return (ssize_t)len;
+    }
+
+    const char *body;
+    size_t body_len;
+    size_t size = wire_frame(conn_buf_head(in), in->len, COMMAND_MAX + WIRE_HEADER_MAX, &body, &body_len);
+    if (size == 0) return 0;
+    if (size == (size_t)-1) return -1;
+    switch ((unsigned char)body[0]) {
+    case WIRE_LINE: {
+        // as much as one line of the text protocol would have held
+        size_t len = 0;
+        while (len < body_len - 1 && len < COMMAND_MAX - 1 && body[1 + len] != '\n' && body[1 + len] != '\r') len++;
+        memcpy(line, body + 1, len);
+        line[len] = '\0';
+        break;
+    }
+    case WIRE_DISCONNECT:
+        strcpy(line, "DISCONNECT");
+        break;
+    default:
+        if (command_decode(body, body_len, line, COMMAND_MAX, cmd)) *parsed = cmd;
+        break;
+    }
+    conn_buf_consume(in, size);
+    return (ssize_t)size;
+}
+
+// Serve every complete command buffered for a thread-per-client client. Returns true once it disconnected
+static bool serve_buffered(client_output *out, pid_t client_pid, const char *username, conn_buf *in, bool at_eof) {
+    char line[COMMAND_MAX];
+    parsed_command cmd;
+    const parsed_command *parsed;
+    ssize_t len;
+    while ((len = take_command(out, in, at_eof, line, &cmd, &parsed)) > 0) {
+        if (serve_command(out, client_pid, username, line, (size_t)len, parsed)) return true;
+    }
+    release_answers(out);
+    if (len < 0) fprintf(stderr, "serve_buffered: client %d sent a malformed frame\n", client_pid);
+    return len < 0;
+}
+
+void *handle_client(void *arg) {
+    // handle one client
+    thread_data *data = (thread_data *)arg;
+    pid_t client_pid = data->client_pid;
+    char client_fifo_c2s_name[64];
+    char client_fifo_s2c_name[64];
+
+    strncpy(client_fifo_c2s_name, data->fifo_c2s, sizeof(client_fifo_c2s_name) -1);
+    client_fifo_c2s_name[sizeof(client_fifo_c2s_name)-1] = '\0';
+    strncpy(client_fifo_s2c_name, data->fifo_s2c, sizeof(client_fifo_s2c_name)-1);
+    client_fifo_s2c_name[sizeof(client_fifo_s2c_name)-1] = '\0';
+
+    int fd_c2s = data->sock;
+    int fd_s2c = data->sock;
+    if (data->sock == -1) {
+        fd_c2s = open(client_fifo_c2s_name, O_RDONLY);
+        fd_s2c = open(client_fifo_s2c_name, O_WRONLY);
+    }
+
+    if (fd_c2s == -1 || fd_s2c == -1) {
+        perror("handle_client: error open fifos");
+        close_client_channel(fd_c2s, fd_s2c, client_fifo_c2s_name, client_fifo_s2c_name);
+        free(data);
+        return NULL;
+    }
+
+    // commands can follow the username in the same read, they stay buffered
+    conn_buf in;
+    conn_buf_init(&in);
+    char username[USERNAME_MAX];
+    ssize_t nread = read_first_line(fd_c2s, &in, sizeof(username) - 1);
+
+    if (nread <= 0) {
+        if (nread == 0) {
+            fprintf(stderr, "handle_client: client %d disconnected before sending username.\n", client_pid);
         } else {
-            *reason = strdup("INVALID_POSITION");
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            return -1;
+            perror("handle_client: error reading username");
         }
+        conn_buf_free(&in);
+        close_client_channel(fd_c2s, fd_s2c, client_fifo_c2s_name, client_fifo_s2c_name);
+        free(data);
+        return NULL;
     }
-    if (strncmp(cmd_copy, "DELETE", 6) == 0) {
-        const char *p = cmd_copy + 6;
-        while (*p == ' ' || *p == '\t') p++;
-        char *endptr;
-        long position = strtol(p, &endptr, 10);
-        if (endptr == p) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid DELETE format. Expected: DELETE pos len");
-            return -1;
+    memcpy(username, conn_buf_head(&in), (size_t)nread);
+    username[nread] = '\0';
+    username[strcspn(username, "\n")] = '\0';
+    conn_buf_consume(&in, (size_t)nread);
+
+    // check user role
+    char role[ROLE_MAX];
+    if (role_store_lookup(&roles, username, role, sizeof(role))) {
+        // from here on output is queued and written without blocking, this thread drains what is left
+        client_output *out = malloc(sizeof(client_output));
+        int wake_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        int flags = fcntl(fd_s2c, F_GETFL);
+        if (!out || wake_efd == -1 || flags == -1 || fcntl(fd_s2c, F_SETFL, flags | O_NONBLOCK) == -1) {
+            perror("handle_client: output queue");
+            free(out);
+            if (wake_efd != -1) close(wake_efd);
+            conn_buf_free(&in);
+            close_client_channel(fd_c2s, fd_s2c, client_fifo_c2s_name, client_fifo_s2c_name);
+            free(data);
+            return NULL;
+        }
+        client_output_init(out, fd_s2c, NULL);
+        out->wake_efd = wake_efd;
+
+        // role goes out before the client is listed, so no broadcast can overtake it
+        client_out_begin(out);
+        int sent = client_write(out, role, strlen(role));
+        if (sent == 0) sent = client_write(out, "\n", 1);
+        client_out_end(out);
+        if (sent < 0) {
+            perror("handle_client: error writing role");
+            client_output_destroy(out);
+            free(out);
+            conn_buf_free(&in);
+            close_client_channel(fd_c2s, fd_s2c, client_fifo_c2s_name, client_fifo_s2c_name);
+            free(data);
+            return NULL;
+        }
+        add_client(client_pid, fd_c2s, fd_s2c, client_fifo_c2s_name, client_fifo_s2c_name, out);
+
+        // no doc_mutex here, a slow client only holds up other broadcasts
+        if (sync_new_client(client_pid, out) < 0) {
+            remove_client(client_pid);
+            client_output_destroy(out);
+            free(out);
+            conn_buf_free(&in);
+            free(data);
+            return NULL;
+        }
+
+        // commands are framed by newlines, however they were split across reads, and answered in order
+        char chunk[READ_CHUNK];
+        nread = 1;
+        bool done = serve_buffered(out, client_pid, username, &in, false);
+        while (!done) {
+            pthread_mutex_lock(&out->mutex);
+            bool broken = out->broken;
+            bool pending = out_queue_len(&out->queue) > 0;
+            if (!pending) out->armed = false;
+            pthread_mutex_unlock(&out->mutex);
+            if (broken) {
+                printf("Client %d (PID: %d) dropped.\n", getpid(), client_pid);
+                break;
+            }
+
+            // a socket is in here twice, once per direction
+            struct pollfd pfd[3] = {
+                { .fd = fd_c2s, .events = POLLIN },
+                { .fd = wake_efd, .events = POLLIN },
+                { .fd = fd_s2c, .events = pending ? POLLOUT : 0 }
+            };
+            if (poll(pfd, 3, -1) < 0) {
+                if (errno == EINTR) continue;
+                nread = -1;
+                break;
+            }
+            if (pfd[1].revents & POLLIN) {
+                uint64_t count;
+                if (read(wake_efd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("handle_client: eventfd read");
+            }
+            if (pfd[2].revents) {
+                pthread_mutex_lock(&out->mutex);
+                client_output_flush_locked(out);
+                pthread_mutex_unlock(&out->mutex);
+            }
+            if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+            nread = read(fd_c2s, chunk, sizeof(chunk));
+            // a socket shares the non-blocking flag of its output side
+            if (nread < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (nread < 0) break;
+            if (nread > 0 && conn_buf_append(&in, chunk, (size_t)nread) < 0) {
+                errno = ENOMEM;
+                nread = -1;
+                break;
+            }
+            // at EOF an unterminated last command still counts
+            done = serve_buffered(out, client_pid, username, &in, nread == 0) || nread == 0;
+        }
+
+        if (nread == 0) {
+            printf("Client %d (PID: %d) disconnected.\n", getpid(), client_pid);
+        } else if (nread < 0) {
+            perror("handle_client: error reading command from client");
+        }
+        
+        // once off the list no broadcast can reach the queue any more
+        remove_client(client_pid);
+        client_output_destroy(out);
+        free(out);
+        conn_buf_free(&in);
+
+    } else {
+        const char *reject_msg = "Reject UNAUTHORISED\n";
+        if(write(fd_s2c, reject_msg, strlen(reject_msg)) < 0) {
+             perror("handle_client: error writing reject message");
         }
-        p = endptr;
-        while (*p == ' ' || *p == '\t') p++;
-        long length = strtol(p, &endptr, 10);
-        if (endptr == p || length < 0) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid DELETE length");
+        
+        conn_buf_free(&in);
+        close_client_channel(fd_c2s, fd_s2c, client_fifo_c2s_name, client_fifo_s2c_name);
+    }
+
+    free(data);
+    return NULL;
+}
+
+// === epoll event loops ===
+// Each loop multiplexes the FIFOs of the clients sig_handler hands it, with non-blocking I/O and a read and a
+// write buffer per client. Commands run on the loop thread and get the same answers handle_client gives.
+
+int start_event_loops(int count) {
+    for (int i = 0; i < count; i++) {
+        event_loop *loop = &event_loops[i];
+        int wake[2];
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd == -1) {
+            perror("epoll_create1");
             return -1;
         }
-        size_t pos = (size_t)position;
-        size_t len_del = (size_t)length;
-        result = markdown_delete(global_doc, cur_version, pos, len_del);
-        if (result == 0) {
-            markdown_commit(global_doc);
-            printf("[SERVER] Document updated to version %llu, length %zu\n", 
-                   (unsigned long long)global_doc->version, global_doc->total_length);
-            pthread_mutex_unlock(&doc_mutex);
-            broadcast_document();
-            free(cmd_copy);
-            return 0;
-        } else {
-            *reason = strdup("INVALID_POSITION");
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
+        // non-blocking on both ends, sig_handler must never stall on a full pipe
+        if (pipe2(wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+            perror("pipe2");
+            close(loop->epfd);
             return -1;
         }
-    }
-    if (strncmp(cmd_copy, "ORDERED_LIST", 12) == 0) {
-        const char *p = cmd_copy + 13;
-        char *endptr;
-        long position = strtol(p, &endptr, 10);
-        if (endptr == p) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid ORDERED_LIST format. Expected: ORDERED_LIST pos");
+        loop->wake_rd = wake[0];
+        loop->wake_wr = wake[1];
+        loop->wake_watch.kind = WATCH_WAKE;
+        loop->wake_watch.conn = NULL;
+        loop->listen_watch.kind = WATCH_LISTEN;
+        loop->listen_watch.conn = NULL;
+        loop->dead = NULL;
+        loop->held = NULL;
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &loop->wake_watch };
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_rd, &ev) == -1) {
+            perror("epoll_ctl: wake pipe");
+            close(loop->wake_rd);
+            close(loop->wake_wr);
+            close(loop->epfd);
             return -1;
         }
-        size_t pos = (size_t)position;
-        result = markdown_ordered_list(global_doc, cur_version, pos);
-        if (result == 0) {
-            markdown_commit(global_doc);
-            printf("[SERVER] Document updated to version %llu, length %zu\n", 
-                   (unsigned long long)global_doc->version, global_doc->total_length);
-            pthread_mutex_unlock(&doc_mutex);
-            broadcast_document();
-            free(cmd_copy);
-            return 0;
-        } else {
-            *reason = strdup("INVALID_POSITION");
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
+        // every loop accepts, EPOLLEXCLUSIVE wakes only one of them per connection
+        if (listen_fd != -1) {
+            struct epoll_event lev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &loop->listen_watch };
+            if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listen_fd, &lev) == -1) {
+                perror("epoll_ctl: listening socket");
+            }
+        }
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, event_loop_thread, loop) != 0) {
+            perror("pthread_create");
+            close(loop->wake_rd);
+            close(loop->wake_wr);
+            close(loop->epfd);
             return -1;
         }
+        pthread_detach(tid);
+        event_loop_count = i + 1;
     }
+    return 0;
+}
 
-    if (strncmp(cmd_copy, "UNORDERED_LIST", 14) == 0) {
-        const char *p = cmd_copy + 15;
-        while (*p == ' ' || *p == '\t') p++;
-        char *endptr;
-        long position = strtol(p, &endptr, 10);
-        if (endptr == p) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid UNORDERED_LIST format. Expected: UNORDERED_LIST pos");
-            return -1;
+static void loop_conn_close(loop_conn *conn) {
+    if (conn->state == CONN_CLOSED) return;
+    conn->state = CONN_CLOSED;
+    pthread_mutex_lock(&conn->out.mutex);
+    loop_conn_watch_output(conn, false);
+    pthread_mutex_unlock(&conn->out.mutex);
+    epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->fd_c2s, NULL);
+    if (conn->has_shm) epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->shm.efd_local, NULL);
+
+    if (conn->listed) {
+        // once off the list no broadcast can reach the write buffer any more
+        remove_client(conn->pid);
+    } else {
+        close_client_channel(conn->fd_c2s, conn->fd_s2c, conn->fifo_c2s, conn->fifo_s2c);
+    }
+    // events for it may still be pending in this batch
+    conn->next_dead = conn->loop->dead;
+    conn->loop->dead = conn;
+}
+
+static void loop_conn_free(loop_conn *conn) {
+    if (conn->has_shm) shm_channel_close(&conn->shm);
+    conn_buf_free(&conn->in);
+    client_output_destroy(&conn->out);
+    free(conn);
+}
+
+// Take over an open channel and watch it for the username. On failure the channel is closed and NULL returned
+static loop_conn *loop_conn_open(event_loop *loop, pid_t client_pid, int fd_c2s, int fd_s2c, const char *fifo_c2s, const char *fifo_s2c) {
+    loop_conn *conn = calloc(1, sizeof(loop_conn));
+    if (!conn) {
+        perror("calloc loop_conn");
+        close_client_channel(fd_c2s, fd_s2c, fifo_c2s, fifo_s2c);
+        return NULL;
+    }
+
+    conn->pid = client_pid;
+    conn->fd_c2s = fd_c2s;
+    conn->fd_s2c = fd_s2c;
+    strcpy(conn->fifo_c2s, fifo_c2s);
+    strcpy(conn->fifo_s2c, fifo_s2c);
+    conn->state = CONN_AWAIT_USERNAME;
+    conn->loop = loop;
+    conn->rd_watch.kind = WATCH_INPUT;
+    conn->rd_watch.conn = conn;
+    conn->wr_watch.kind = WATCH_OUTPUT;
+    conn->wr_watch.conn = conn;
+    conn_buf_init(&conn->in);
+    client_output_init(&conn->out, fd_s2c, conn);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &conn->rd_watch };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd_c2s, &ev) == -1) {
+        perror("epoll_ctl: client channel");
+        close_client_channel(fd_c2s, fd_s2c, fifo_c2s, fifo_s2c);
+        loop_conn_free(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+// handle_client's FIFO setup, except that nothing here waits for the client
+static void loop_accept_fifo(event_loop *loop, pid_t client_pid) {
+    char fifo_c2s[64];
+    char fifo_s2c[64];
+    if (create_client_fifos(client_pid, fifo_c2s, fifo_s2c) < 0) {
+        return;
+    }
+
+    int fd_c2s = open(fifo_c2s, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    // a non-blocking write-only open fails until the client opened its end, Linux lets a FIFO be opened
+    // read-write instead, which never waits
+    int fd_s2c = open(fifo_s2c, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd_c2s == -1 || fd_s2c == -1) {
+        perror("loop_accept_fifo: error open fifos");
+        close_client_channel(fd_c2s, fd_s2c, fifo_c2s, fifo_s2c);
+        return;
+    }
+
+    loop_conn *conn = loop_conn_open(loop, client_pid, fd_c2s, fd_s2c, fifo_c2s, fifo_s2c);
+    if (!conn) return;
+
+    // notify client
+    if (kill(client_pid, SIGRTMIN + 1) == -1) {
+        perror("kill");
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd_c2s, NULL);
+        close_client_channel(fd_c2s, fd_s2c, fifo_c2s, fifo_s2c);
+        loop_conn_free(conn);
+    }
+}
+
+// everything queued on the listening socket, other loops share it so running dry early is normal
+static void loop_accept_sockets(event_loop *loop) {
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4");
+            return;
+        }
+        pid_t client_pid = socket_peer_pid(fd);
+        if (client_pid <= 0) {
+            close(fd);
+            continue;
+        }
+        loop_conn_open(loop, client_pid, fd, fd, "", "");
+    }
+}
+
+static void loop_conn_login(loop_conn *conn, const char *line, size_t len) {
+    if (len >= sizeof(conn->username)) len = sizeof(conn->username) - 1;
+    memcpy(conn->username, line, len);
+    conn->username[len] = '\0';
+    conn->username[strcspn(conn->username, "\n")] = '\0';
+
+    client_output *out = &conn->out;
+    char role[ROLE_MAX];
+    if (!role_store_lookup(&roles, conn->username, role, sizeof(role))) {
+        const char *reject_msg = "Reject UNAUTHORISED\n";
+        if (client_send(out, reject_msg, strlen(reject_msg)) < 0) {
+            perror("loop_conn_login: error writing reject message");
         }
-        size_t pos = (size_t)position;
+        loop_conn_close(conn);
+        return;
+    }
+
+    // role goes out before the client is listed, so no broadcast can overtake it
+    client_out_begin(out);
+    int sent = client_write(out, role, strlen(role));
+    if (sent == 0) sent = client_write(out, "\n", 1);
+    client_out_end(out);
+    if (sent < 0) {
+        perror("loop_conn_login: error writing role");
+        loop_conn_close(conn);
+        return;
+    }
+
+    add_client(conn->pid, conn->fd_c2s, conn->fd_s2c, conn->fifo_c2s, conn->fifo_s2c, out);
+    conn->listed = true;
+    conn->state = CONN_ACTIVE;
+
+    if (sync_new_client(conn->pid, out) < 0) {
+        loop_conn_close(conn);
+    }
+}
+
+// hand every complete command in the read buffer on, at_eof also flushes a last unterminated line
+static void loop_conn_drain_input(loop_conn *conn, bool at_eof) {
+    char line[COMMAND_MAX];
+    while (conn->state == CONN_AWAIT_USERNAME && conn->in.len > 0) {
+        size_t len = conn_buf_line(&conn->in, USERNAME_MAX - 1, at_eof);
+        if (len == 0) return;
+        memcpy(line, conn_buf_head(&conn->in), len);
+        line[len] = '\0';
+        conn_buf_consume(&conn->in, len);
+        loop_conn_login(conn, line, len);
+    }
+
+    parsed_command cmd;
+    const parsed_command *parsed;
+    while (conn->state == CONN_ACTIVE && conn->in.len > 0) {
+        ssize_t len = take_command(&conn->out, &conn->in, at_eof, line, &cmd, &parsed);
+        if (len == 0) break;
+        if (len < 0) fprintf(stderr, "loop_conn_drain_input: client %d sent a malformed frame\n", conn->pid);
+        if (len < 0 || serve_command(&conn->out, conn->pid, conn->username, line, (size_t)len, parsed)) {
+            loop_conn_close(conn);
+        }
+    }
+    if (conn->out.held_count > 0 && !conn->held_listed) {
+        conn->held_listed = true;
+        conn->next_held = conn->loop->held;
+        conn->loop->held = conn;
+    }
+}
 
-        result = markdown_unordered_list(global_doc, cur_version, pos);
-        if (result == 0) {
-            markdown_commit(global_doc);
-            pthread_mutex_unlock(&doc_mutex);
-            broadcast_document();
-            free(cmd_copy);
-            return 0;
+// The end of a batch of events: one wait for the WAL covers the answers every client of the loop is held
+static void loop_release_answers(event_loop *loop) {
+    if (!loop->held) return;
+    bool durable = wal_flush(&doc_wal) == 0;
+    while (loop->held) {
+        loop_conn *conn = loop->held;
+        loop->held = conn->next_held;
+        conn->held_listed = false;
+        if (conn->state == CONN_CLOSED) {
+            conn->out.held_count = 0;
         } else {
-            *reason = strdup("INVALID_POSITION");
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            return -1;
+            send_held_answers(&conn->out, durable);
         }
     }
+}
 
-    if (strncmp(cmd_copy, "ITALIC", 6) == 0) {
-        const char *p = cmd_copy + 7;
-        char *endptr;
-        long start = strtol(p, &endptr, 10);
-        if (endptr == p) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid ITALIC format. Expected: ITALIC start end");
-            return -1;
+// The client's rings moved: push out what is waiting for space and take in what arrived
+static void loop_conn_shm_ready(loop_conn *conn) {
+    shm_channel_unpark(&conn->shm);
+
+    pthread_mutex_lock(&conn->out.mutex);
+    client_output_flush_locked(&conn->out);
+    pthread_mutex_unlock(&conn->out.mutex);
+
+    char buf[COMMAND_MAX];
+    while (1) {
+        size_t moved = shm_channel_read(&conn->shm, buf, sizeof(buf));
+        if (moved > 0) {
+            if (conn_buf_append(&conn->in, buf, moved) < 0) {
+                perror("loop_conn_shm_ready: read buffer");
+                loop_conn_close(conn);
+                return;
+            }
+            continue;
         }
-        p = endptr + 1;
-        while (*p == ' ' || *p == '\t') p++;
-        long end = strtol(p, &endptr, 10);
-        if (endptr == p) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid ITALIC format. Expected: ITALIC start end");
-            return -1;
+        if (shm_channel_park_reader(&conn->shm)) break;
+    }
+    loop_conn_drain_input(conn, false);
+}
+
+// Switch a socket client that sent [memfd, server eventfd, client eventfd] with its username over to them
+static void loop_conn_attach_shm(loop_conn *conn, const int *fds, size_t nfds) {
+    bool usable = nfds == 3 && !conn->has_shm && conn->state == CONN_AWAIT_USERNAME && conn->fd_c2s == conn->fd_s2c;
+    if (usable && shm_channel_attach(&conn->shm, fds[0], fds[1], fds[2]) == 0) {
+        close(fds[0]);
+        conn->shm_watch.kind = WATCH_SHM;
+        conn->shm_watch.conn = conn;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &conn->shm_watch };
+        if (epoll_ctl(conn->loop->epfd, EPOLL_CTL_ADD, conn->shm.efd_local, &ev) == 0) {
+            conn->has_shm = true;
+            shm_channel_park_reader(&conn->shm);
+            return;
         }
-        result = markdown_italic(global_doc, cur_version, (size_t)start, (size_t)end);
-        if (result == 0) {
-            markdown_commit(global_doc);
-            printf("[SERVER] Document updated to version %llu, length %zu\n", 
-                   (unsigned long long)global_doc->version, global_doc->total_length);
-            pthread_mutex_unlock(&doc_mutex);
-            broadcast_document();
-            free(cmd_copy);
-            return 0;
-        } else {
-            *reason = strdup("INVALID_POSITION");
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            return -1;
+        perror("epoll_ctl: shm eventfd");
+        shm_channel_close(&conn->shm);
+        return;
+    }
+    // not taken, the client notices the answer coming over the socket instead
+    for (size_t i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+}
+
+// read() on a FIFO, recvmsg() on a socket so a shared memory offer can come along
+static ssize_t loop_conn_recv(loop_conn *conn, char *buf, size_t len) {
+    if (conn->fd_c2s != conn->fd_s2c) return read(conn->fd_c2s, buf, len);
+
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    union {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+
+    ssize_t nread = recvmsg(conn->fd_c2s, &msg, MSG_CMSG_CLOEXEC);
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); nread >= 0 && cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            int fds[3];
+            size_t nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (nfds > 3) nfds = 3;
+            memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+            loop_conn_attach_shm(conn, fds, nfds);
         }
     }
-    if (strncmp(cmd_copy, "CODE", 4) == 0) {
-        const char *p = cmd_copy + 5;
-        char *endptr;
-        long start = strtol(p, &endptr, 10);
-        if (endptr == p) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid CODE format. Expected: CODE start end");
-            return -1;
+    return nread;
+}
+
+static void loop_conn_readable(loop_conn *conn) {
+    char buf[READ_CHUNK];
+    bool at_eof = false;
+    while (1) {
+        ssize_t nread = loop_conn_recv(conn, buf, sizeof(buf));
+        if (nread > 0) {
+            if (conn_buf_append(&conn->in, buf, (size_t)nread) < 0) {
+                perror("loop_conn_readable: read buffer");
+                loop_conn_close(conn);
+                return;
+            }
+            continue;
         }
-        p = endptr + 1;
-        while (*p == ' ' || *p == '\t') p++;
-        long end = strtol(p, &endptr, 10);
-        if (endptr == p) {
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            *reason = strdup("Invalid CODE format. Expected: CODE start end");
-            return -1;
+        if (nread == 0) {
+            at_eof = true;
+            break;
         }
-        result = markdown_code(global_doc, cur_version, (size_t)start, (size_t)end);
-        if (result == 0) {
-            markdown_commit(global_doc);
-            printf("[SERVER] Document updated to version %llu, length %zu\n", 
-                   (unsigned long long)global_doc->version, global_doc->total_length);
-            pthread_mutex_unlock(&doc_mutex);
-            broadcast_document();
-            free(cmd_copy);
-            return 0;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        perror("loop_conn_readable: error reading command from client");
+        loop_conn_close(conn);
+        return;
+    }
+
+    loop_conn_drain_input(conn, at_eof);
+    if (at_eof && conn->state != CONN_CLOSED) {
+        if (conn->state == CONN_AWAIT_USERNAME) {
+            fprintf(stderr, "loop_conn_readable: client %d disconnected before sending username.\n", conn->pid);
         } else {
-            *reason = strdup("INVALID_POSITION");
-            pthread_mutex_unlock(&doc_mutex);
-            free(cmd_copy);
-            return -1;
+            printf("Client %d (PID: %d) disconnected.\n", getpid(), conn->pid);
+        }
+        loop_conn_close(conn);
+    }
+}
+
+static void loop_conn_writable(loop_conn *conn) {
+    pthread_mutex_lock(&conn->out.mutex);
+    client_output_flush_locked(&conn->out);
+    if (out_queue_len(&conn->out.queue) == 0 || conn->out.broken) {
+        loop_conn_watch_output(conn, false);
+    }
+    pthread_mutex_unlock(&conn->out.mutex);
+}
+
+// A broadcast dropped this client for lagging, close it if it is still one of ours
+static void loop_drop_client(event_loop *loop, pid_t client_pid) {
+    loop_conn *conn = NULL;
+    pthread_mutex_lock(&client_mutex);
+    for (client_node_t *c = client_head; c; c = c->next) {
+        if (c->pid == client_pid) {
+            if (c->out->conn && c->out->conn->loop == loop) conn = c->out->conn;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&client_mutex);
+    // only this loop closes its clients, so conn cannot go away in between
+    if (conn && conn->state != CONN_CLOSED) {
+        printf("Client %d (PID: %d) dropped.\n", getpid(), client_pid);
+        loop_conn_close(conn);
+    }
+}
+
+void *event_loop_thread(void *arg) {
+    event_loop *loop = (event_loop *)arg;
+    struct epoll_event events[EVENT_LOOP_BATCH];
+
+    while (1) {
+        int n = epoll_wait(loop->epfd, events, EVENT_LOOP_BATCH, -1);
+        if (n < 0) {
+            // SIGRTMIN lands on any thread and epoll_wait is never restarted
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            loop_watch *w = events[i].data.ptr;
+            if (w->kind == WATCH_WAKE) {
+                pid_t pids[64];
+                ssize_t got;
+                while ((got = read(loop->wake_rd, pids, sizeof(pids))) > 0) {
+                    for (size_t k = 0; k < (size_t)got / sizeof(pid_t); k++) {
+                        if (pids[k] < 0) {
+                            loop_drop_client(loop, -pids[k]);
+                        } else {
+                            loop_accept_fifo(loop, pids[k]);
+                        }
+                    }
+                }
+                continue;
+            }
+            if (w->kind == WATCH_LISTEN) {
+                loop_accept_sockets(loop);
+                continue;
+            }
+            loop_conn *conn = w->conn;
+            if (conn->state == CONN_CLOSED) continue;
+            if (w->kind == WATCH_SHM) {
+                loop_conn_shm_ready(conn);
+                continue;
+            }
+            // a socket reports both directions on its input registration
+            if (w->kind == WATCH_OUTPUT || (events[i].events & EPOLLOUT)) {
+                loop_conn_writable(conn);
+            }
+            if (w->kind == WATCH_INPUT && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                loop_conn_readable(conn);
+            }
+        }
+
+        // before the dead are freed, some of them may still be on the list
+        loop_release_answers(loop);
+        while (loop->dead) {
+            loop_conn *conn = loop->dead;
+            loop->dead = conn->next_dead;
+            loop_conn_free(conn);
         }
     }
+    return NULL;
+}
+
+void enqueue_command(const char *user, const char *command, int result, const char *reason) {
+    // add to command log, the oldest entries go to disk once it is full
+    cmd_log_append(&command_log, user, command, result, reason);
+}
+
+// LOG? [first [count]], every command by default
+static void print_command_log(const char *args) {
+    uint64_t total = cmd_log_count(&command_log);
+    char *end;
+    uint64_t first = strtoull(args, &end, 10);
+    uint64_t count = strtoull(end, &end, 10);
+    if (first > total) first = total;
+    if (count == 0 || count > total - first) count = total - first;
+
+    printf("[SERVER] Current commands log, %llu to %llu of %llu:\n", (unsigned long long)first,
+           (unsigned long long)(first + count), (unsigned long long)total);
+    cmd_log_record rec;
+    for (uint64_t seq = first; seq < first + count; seq++) {
+        if (cmd_log_get(&command_log, seq, &rec) != 0) {
+            printf("(command %llu lost)\n", (unsigned long long)seq);
+            continue;
+        }
+        printf("EDIT %s %s %s %s\n", rec.user, rec.command, rec.rejected ? "Reject" : "SUCCESS", rec.reason);
+    }
+}
+
+// STATS?: every histogram that has records, then what each connected client was queued and sent
+static void print_stats(FILE *out) {
+    fprintf(out, "[SERVER] Stats since start, times in ns, sizes in bytes:\n");
+    char name[64];
+    for (int op = 0; op <= CMD_COUNT; op++) {
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            snprintf(name, sizeof(name), "%s %s", op < CMD_COUNT ? command_name((command_op)op) : "(unparsed)",
+                     phase_names[phase]);
+            stats_print(out, name, &edit_latency[op][phase]);
+        }
+    }
+    stats_print(out, "batch commit", &batch_commit_latency);
+    stats_print(out, "commit edits", &commit_edits);
+    stats_print(out, "commit bytes", &commit_bytes);
+    stats_print(out, "broadcast", &broadcast_latency);
+    stats_print(out, "broadcast bytes/client", &broadcast_bytes);
+    pthread_mutex_lock(&client_mutex);
+    for (client_node_t *c = client_head; c; c = c->next) {
+        pthread_mutex_lock(&c->out->mutex);
+        fprintf(out, "%d queued %llu sent %llu\n", c->pid, (unsigned long long)c->out->bytes_queued,
+                (unsigned long long)c->out->bytes_sent);
+        pthread_mutex_unlock(&c->out->mutex);
+    }
+    pthread_mutex_unlock(&client_mutex);
+}
+
+// -s: the STATS? report, renamed into place so a reader never sees it half written
+void *stats_dump_thread(void *arg) {
+    (void)arg;
+    char path[64];
+    char tmp_path[72];
+    snprintf(path, sizeof(path), STATS_DUMP_FMT, getpid());
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    while (1) {
+        sleep((unsigned)stats_interval);
+        FILE *out = fopen(tmp_path, "w");
+        if (!out) {
+            perror("stats_dump_thread");
+            continue;
+        }
+        print_stats(out);
+        if (fclose(out) != 0 || rename(tmp_path, path) != 0) perror("stats_dump_thread");
+    }
+    return NULL;
+}
+
+void *server_stdin_thread(void *arg) {
+    // handle server stdin
+    (void)arg;
+    char buf[256];
+    while (fgets(buf, sizeof(buf), stdin)) {
+        size_t len = strlen(buf);
+        if (len > 0 && buf[len - 1] == '\n') buf[len - 1] = '\0';
+        if (strcmp(buf, "DOC?") == 0) {
+            doc_snapshot *snap = markdown_snapshot(global_doc);
+            if (snap) {
+                printf("[SERVER] Current document (version %llu, length %zu):\n", 
+                        (unsigned long long)snap->version, 
+                        snap->total_length);
+                snapshot_write_file(snap, stdout, snap->total_length);
+                printf("\n");
+                snapshot_release(snap);
+            }
+        } else if (strncmp(buf, "LOG?", 4) == 0 && (buf[4] == '\0' || buf[4] == ' ')) {
+            print_command_log(buf + 4);
+        } else if (strcmp(buf, "QUEUES?") == 0) {
+            static const char *lag_names[] = { "resync", "skip", "disconnect" };
+            printf("[SERVER] Output queues (limit %zu bytes, lag policy %s, %lu dropped for lagging):\n",
+                   out_queue_limit, lag_names[lag_mode], (unsigned long)atomic_load(&lag_disconnects));
+            pthread_mutex_lock(&client_mutex);
+            for (client_node_t *c = client_head; c; c = c->next) {
+                pthread_mutex_lock(&c->out->mutex);
+                printf("%d depth %zu peak %zu skipped %llu resyncs %llu%s\n", c->pid, out_queue_len(&c->out->queue),
+                       c->out->peak, (unsigned long long)c->out->skipped, (unsigned long long)c->out->resyncs,
+                       c->out->lagging ? " lagging" : "");
+                pthread_mutex_unlock(&c->out->mutex);
+            }
+            pthread_mutex_unlock(&client_mutex);
+        } else if (strcmp(buf, "STATS?") == 0) {
+            print_stats(stdout);
+        } else if (strcmp(buf, "QUIT") == 0) {
+            int has_clients = (client_head != NULL);
+            if (has_clients) {
+                int count = 0;
+                for (client_node_t *c = client_head; c; c = c->next) count++;
+                printf("QUIT rejected, %d clients still connected.\n", count);
+            } else {
+                printf("[SERVER] Received QUIT command. Exiting...\n");
+                if (listen_fd != -1) unlink(socket_path);
+                cmd_log_close(&command_log, true);
+                if (batch_mode) {
+                    // edits staged since the last broadcast are part of the document
+                    command_batch batch;
+                    close_batch(&batch);
+                    batch_free(&batch);
+                }
+                pthread_mutex_lock(&doc_mutex);
+                const char *content = markdown_flatten_borrow(global_doc, NULL);
+                FILE *out = fopen("doc.md", "w");
+                if (out && content) {
+                    fwrite(content, 1, global_doc->total_length, out);
+                }
+                if (out) fclose(out);
+                // the next start loads the snapshot this writes and has nothing to replay
+                wal_close(&doc_wal, global_doc);
+                pthread_mutex_unlock(&doc_mutex);
+                markdown_free(global_doc);
+                exit(0);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Apply one edit against the current version. Without commit it stays staged for the next markdown_commit.
+// command is parsed in place unless parsed already holds it, *reason is static
+int process_command(const char *user, char *command, const parsed_command *parsed, bool commit, const char **reason) {
+    (void)user;
+
+    parsed_command cmd;
+    *reason = NULL;
+    // each phase starts where the one before it ended, a frame arrives parsed already
+    uint64_t now = stats_now();
+    if (!parsed) {
+        *reason = command_parse(command, &cmd);
+        now += stats_record_since(&edit_latency[*reason ? CMD_COUNT : cmd.op][PHASE_PARSE], now);
+        if (*reason) return -1;
+        parsed = &cmd;
+    }
+    stats_hist *latency = edit_latency[parsed->op];
+
+    pthread_mutex_lock(&doc_mutex);
+    now += stats_record_since(&latency[PHASE_LOCK_WAIT], now);
+    // past a failed log write nothing can be made durable any more, so nothing more is taken
+    if (wal_failed(&doc_wal)) {
+        pthread_mutex_unlock(&doc_mutex);
+        *reason = NOT_DURABLE;
+        return -1;
+    }
+    // a failed edit may still have queued part of itself, so replay needs it too
+    wal_stage(&doc_wal, command);
+    int result = command_apply(global_doc, global_doc->version, parsed);
+    now += stats_record_since(&latency[PHASE_APPLY], now);
+    if (result == 0 && commit) {
+        markdown_commit(global_doc);
+        wal_commit(&doc_wal, global_doc);
+        stats_record_since(&latency[PHASE_COMMIT], now);
+        stats_record(&commit_edits, 1);
+        stats_record(&commit_bytes, strcspn(command, "\r\n"));
+        printf("[SERVER] Document updated to version %llu, length %zu\n",
+               (unsigned long long)global_doc->version, global_doc->total_length);
+    }
     pthread_mutex_unlock(&doc_mutex);
-    free(cmd_copy);
-    *reason = strdup("Unknown command");
-    return -1;
-}
\ No newline at end of file
+
+    if (result != 0) {
+        *reason = command_result_reason(result);
+        return -1;
+    }
+    mark_document_dirty();
+    return 0;
+}
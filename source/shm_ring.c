@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include "../libs/shm_ring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+static void ring_init(shm_ring *r) {
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->consumer_parked, 0);
+    atomic_init(&r->producer_parked, 0);
+    r->capacity = SHM_RING_CAPACITY;
+}
+
+static void wake(int efd) {
+    uint64_t one = 1;
+    // a full counter already means "wake up", nothing else can go wrong with an eventfd write
+    (void)!write(efd, &one, sizeof(one));
+}
+
+static int map_channel(shm_channel *ch, int memfd, bool client) {
+    size_t len = 2 * sizeof(shm_ring);
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (map == MAP_FAILED) return -1;
+    shm_ring *c2s = (shm_ring *)map;
+    shm_ring *s2c = c2s + 1;
+    ch->rx = client ? s2c : c2s;
+    ch->tx = client ? c2s : s2c;
+    ch->map = map;
+    ch->map_len = len;
+    return 0;
+}
+
+int shm_channel_create(shm_channel *ch, int *memfd_out) {
+    int memfd = memfd_create("zoit-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd == -1) return -1;
+    // sealed at its size, so the server can map it without fearing SIGBUS
+    if (ftruncate(memfd, (off_t)(2 * sizeof(shm_ring))) == -1 ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1 ||
+        map_channel(ch, memfd, true) == -1) {
+        close(memfd);
+        return -1;
+    }
+    ring_init(ch->rx);
+    ring_init(ch->tx);
+
+    ch->efd_local = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ch->efd_peer = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ch->efd_local == -1 || ch->efd_peer == -1) {
+        if (ch->efd_local != -1) close(ch->efd_local);
+        if (ch->efd_peer != -1) close(ch->efd_peer);
+        munmap(ch->map, ch->map_len);
+        close(memfd);
+        return -1;
+    }
+    *memfd_out = memfd;
+    return 0;
+}
+
+int shm_channel_attach(shm_channel *ch, int memfd, int efd_server, int efd_client) {
+    struct stat st;
+    int seals = fcntl(memfd, F_GET_SEALS);
+    if (seals == -1 || !(seals & F_SEAL_SHRINK) || fstat(memfd, &st) == -1 || (size_t)st.st_size != 2 * sizeof(shm_ring)) {
+        return -1;
+    }
+    if (map_channel(ch, memfd, false) == -1) return -1;
+    // a client built with another ring size
+    if (ch->rx->capacity != SHM_RING_CAPACITY || ch->tx->capacity != SHM_RING_CAPACITY) {
+        munmap(ch->map, ch->map_len);
+        return -1;
+    }
+    ch->efd_local = efd_server;
+    ch->efd_peer = efd_client;
+    return 0;
+}
+
+void shm_channel_close(shm_channel *ch) {
+    if (ch->map) munmap(ch->map, ch->map_len);
+    if (ch->efd_local != -1) close(ch->efd_local);
+    if (ch->efd_peer != -1) close(ch->efd_peer);
+    ch->map = NULL;
+    ch->efd_local = -1;
+    ch->efd_peer = -1;
+}
+
+size_t shm_channel_write(shm_channel *ch, const void *data, size_t len) {
+    shm_ring *r = ch->tx;
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    uint64_t used = head - tail;
+    // a peer that broke the ring only gets its own connection stuck
+    if (used > SHM_RING_CAPACITY) return 0;
+    size_t room = SHM_RING_CAPACITY - (size_t)used;
+    if (len > room) len = room;
+    if (len == 0) return 0;
+
+    size_t at = (size_t)(head % SHM_RING_CAPACITY);
+    size_t first = SHM_RING_CAPACITY - at < len ? SHM_RING_CAPACITY - at : len;
+    memcpy(r->data + at, data, first);
+    memcpy(r->data, (const char *)data + first, len - first);
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+
+    // pairs with the fence in shm_channel_park_reader
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&r->consumer_parked, memory_order_relaxed)) {
+        wake(ch->efd_peer);
+    }
+    return len;
+}
+
+size_t shm_channel_read(shm_channel *ch, void *buf, size_t len) {
+    shm_ring *r = ch->rx;
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t avail = head - tail;
+    if (avail > SHM_RING_CAPACITY) return 0;
+    if (len > avail) len = (size_t)avail;
+    if (len == 0) return 0;
+
+    size_t at = (size_t)(tail % SHM_RING_CAPACITY);
+    size_t first = SHM_RING_CAPACITY - at < len ? SHM_RING_CAPACITY - at : len;
+    memcpy(buf, r->data + at, first);
+    memcpy((char *)buf + first, r->data, len - first);
+    atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+
+    // pairs with the fence in shm_channel_park_writer
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&r->producer_parked, memory_order_relaxed)) {
+        wake(ch->efd_peer);
+    }
+    return len;
+}
+
+bool shm_channel_park_reader(shm_channel *ch) {
+    shm_ring *r = ch->rx;
+    atomic_store_explicit(&r->consumer_parked, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&r->head, memory_order_acquire) == atomic_load_explicit(&r->tail, memory_order_relaxed);
+}
+
+bool shm_channel_park_writer(shm_channel *ch) {
+    shm_ring *r = ch->tx;
+    atomic_store_explicit(&r->producer_parked, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t used = atomic_load_explicit(&r->head, memory_order_relaxed) - atomic_load_explicit(&r->tail, memory_order_acquire);
+    return used >= SHM_RING_CAPACITY;
+}
+
+void shm_channel_unpark(shm_channel *ch) {
+    atomic_store_explicit(&ch->rx->consumer_parked, 0, memory_order_relaxed);
+    atomic_store_explicit(&ch->tx->producer_parked, 0, memory_order_relaxed);
+    uint64_t count;
+    (void)!read(ch->efd_local, &count, sizeof(count));
+}
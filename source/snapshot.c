@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include "../libs/snapshot.h"
+#include "../libs/flat_cache.h"
+#include "../libs/line_index.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+void snapshot_state_init(snapshot_state *st) {
+    st->latest = NULL;
+    st->dirty = false;
+    st->keep_prefix = 0;
+    st->keep_suffix = 0;
+}
+
+void snapshot_state_free(snapshot_state *st) {
+    snapshot_release(st->latest);
+    snapshot_state_init(st);
+}
+
+void snapshot_note_change(snapshot_state *st, size_t keep_prefix, size_t keep_suffix) {
+    if (!st->latest) return;
+    if (!st->dirty) {
+        st->keep_prefix = keep_prefix;
+        st->keep_suffix = keep_suffix;
+        st->dirty = true;
+        return;
+    }
+    if (keep_prefix < st->keep_prefix) st->keep_prefix = keep_prefix;
+    if (keep_suffix < st->keep_suffix) st->keep_suffix = keep_suffix;
+}
+
+static snapshot_chunk *chunk_retain(snapshot_chunk *c) {
+    atomic_fetch_add(&c->refs, 1);
+    return c;
+}
+
+static void chunk_release(snapshot_chunk *c) {
+    if (atomic_fetch_sub(&c->refs, 1) == 1) free(c);
+}
+
+static doc_snapshot *snapshot_alloc(const document *doc, size_t chunk_count) {
+    doc_snapshot *snap = malloc(sizeof(doc_snapshot));
+    if (!snap) return NULL;
+    snap->chunks = chunk_count ? malloc(chunk_count * sizeof(snapshot_chunk *)) : NULL;
+    if (chunk_count && !snap->chunks) {
+        free(snap);
+        return NULL;
+    }
+    atomic_init(&snap->refs, 1);
+    snap->version = doc->version;
+    snap->total_length = doc->total_length;
+    snap->flat_len = 0;
+    snap->chunk_count = 0;
+    return snap;
+}
+
+// bytes changed since old was taken, work out what can be shared and render the rest
+static doc_snapshot *snapshot_build(document *doc, const doc_snapshot *old, size_t keep_prefix, size_t keep_suffix) {
+    size_t new_len = line_index_flat_length(doc);
+    size_t old_count = old ? old->chunk_count : 0;
+
+    // whole chunks inside the kept prefix and suffix can be shared
+    size_t head = 0, head_bytes = 0;
+    while (head < old_count && head_bytes + old->chunks[head]->len <= keep_prefix) {
+        head_bytes += old->chunks[head++]->len;
+    }
+    size_t tail = 0, tail_bytes = 0;
+    while (head + tail < old_count && tail_bytes + old->chunks[old_count - 1 - tail]->len <= keep_suffix) {
+        tail_bytes += old->chunks[old_count - 1 - tail++]->len;
+    }
+
+    // a short middle swallows a neighbour so that repeated small edits do not fragment the chunk list
+    size_t mid_len = new_len - head_bytes - tail_bytes;
+    while (mid_len < SNAPSHOT_CHUNK_SIZE / 2 && (head > 0 || tail > 0)) {
+        if (tail > 0) {
+            tail--;
+            tail_bytes -= old->chunks[old_count - 1 - tail]->len;
+            mid_len += old->chunks[old_count - 1 - tail]->len;
+        } else {
+            head--;
+            head_bytes -= old->chunks[head]->len;
+            mid_len += old->chunks[head]->len;
+        }
+    }
+
+    size_t mid_count = (mid_len + SNAPSHOT_CHUNK_SIZE - 1) / SNAPSHOT_CHUNK_SIZE;
+    doc_snapshot *snap = snapshot_alloc(doc, head + mid_count + tail);
+    if (!snap) return NULL;
+
+    for (size_t i = 0; i < head; i++) {
+        snap->chunks[snap->chunk_count++] = chunk_retain(old->chunks[i]);
+    }
+
+    // spread the middle evenly, a chunk of one byte next to a full one helps nobody
+    size_t from = head_bytes;
+    for (size_t i = 0; i < mid_count; i++) {
+        size_t len = mid_len / mid_count + (i < mid_len % mid_count ? 1 : 0);
+        snapshot_chunk *c = malloc(sizeof(snapshot_chunk) + len);
+        if (!c) {
+            snapshot_release(snap);
+            return NULL;
+        }
+        atomic_init(&c->refs, 1);
+        c->len = len;
+        flat_cache_copy_range(doc, from, len, c->data);
+        snap->chunks[snap->chunk_count++] = c;
+        from += len;
+    }
+
+    for (size_t i = old_count - tail; i < old_count; i++) {
+        snap->chunks[snap->chunk_count++] = chunk_retain(old->chunks[i]);
+    }
+
+    snap->flat_len = new_len;
+    return snap;
+}
+
+doc_snapshot *snapshot_take(document *doc) {
+    snapshot_state *st = &doc->snaps;
+    doc_snapshot *old = st->latest;
+
+    if (old && !st->dirty && old->version == doc->version && old->total_length == doc->total_length) {
+        atomic_fetch_add(&old->refs, 1);
+        return old;
+    }
+
+    doc_snapshot *snap;
+    if (old && !st->dirty) {
+        // version moved without touching any bytes, share every chunk
+        snap = snapshot_alloc(doc, old->chunk_count);
+        if (!snap) return NULL;
+        for (size_t i = 0; i < old->chunk_count; i++) {
+            snap->chunks[snap->chunk_count++] = chunk_retain(old->chunks[i]);
+        }
+        snap->flat_len = old->flat_len;
+    } else {
+        size_t new_len = line_index_flat_length(doc);
+        size_t keep_prefix = 0, keep_suffix = 0;
+        if (old) {
+            keep_prefix = st->keep_prefix;
+            keep_suffix = st->keep_suffix;
+            size_t shorter = old->flat_len < new_len ? old->flat_len : new_len;
+            if (keep_prefix + keep_suffix > shorter) {
+                keep_prefix = 0;
+                keep_suffix = 0;
+            }
+        }
+        snap = snapshot_build(doc, old, keep_prefix, keep_suffix);
+        if (!snap) return NULL;
+    }
+
+    // one reference for the document, one for the caller
+    atomic_fetch_add(&snap->refs, 1);
+    snapshot_release(old);
+    st->latest = snap;
+    st->dirty = false;
+    return snap;
+}
+
+void snapshot_release(doc_snapshot *snap) {
+    if (!snap) return;
+    if (atomic_fetch_sub(&snap->refs, 1) != 1) return;
+    for (size_t i = 0; i < snap->chunk_count; i++) {
+        chunk_release(snap->chunks[i]);
+    }
+    free(snap->chunks);
+    free(snap);
+}
+
+int snapshot_write_fd(const doc_snapshot *snap, int fd, size_t len) {
+    for (size_t i = 0; i < snap->chunk_count && len > 0; i++) {
+        const snapshot_chunk *c = snap->chunks[i];
+        size_t todo = c->len < len ? c->len : len;
+        size_t written = 0;
+        while (written < todo) {
+            ssize_t ret = write(fd, c->data + written, todo - written);
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret <= 0) return -1;
+            written += (size_t)ret;
+        }
+        len -= todo;
+    }
+    return 0;
+}
+
+int snapshot_write_file(const doc_snapshot *snap, FILE *stream, size_t len) {
+    for (size_t i = 0; i < snap->chunk_count && len > 0; i++) {
+        const snapshot_chunk *c = snap->chunks[i];
+        size_t todo = c->len < len ? c->len : len;
+        if (fwrite(c->data, 1, todo, stream) != todo) return -1;
+        len -= todo;
+    }
+    return 0;
+}
+
+int snapshot_for_each(const doc_snapshot *snap, size_t from, size_t len,
+                      int (*fn)(void *ctx, const char *data, size_t len), void *ctx) {
+    for (size_t i = 0; i < snap->chunk_count && len > 0; i++) {
+        const snapshot_chunk *c = snap->chunks[i];
+        if (from >= c->len) {
+            from -= c->len;
+            continue;
+        }
+        size_t todo = c->len - from < len ? c->len - from : len;
+        int ret = fn(ctx, c->data + from, todo);
+        if (ret != 0) return ret;
+        len -= todo;
+        from = 0;
+    }
+    return 0;
+}
+
+// first chunk at or after byte pos, *off_out gets pos inside it
+static size_t chunk_at(const doc_snapshot *snap, size_t pos, size_t *off_out) {
+    size_t i = 0;
+    while (i < snap->chunk_count && pos >= snap->chunks[i]->len) {
+        pos -= snap->chunks[i++]->len;
+    }
+    *off_out = pos;
+    return i;
+}
+
+// length of the common run of a from pos_a and b from pos_b going forward, at most limit bytes
+static size_t common_forward(const doc_snapshot *a, size_t pos_a, const doc_snapshot *b, size_t pos_b, size_t limit) {
+    size_t off_a, off_b;
+    size_t ia = chunk_at(a, pos_a, &off_a);
+    size_t ib = chunk_at(b, pos_b, &off_b);
+    size_t same = 0;
+    while (same < limit && ia < a->chunk_count && ib < b->chunk_count) {
+        const snapshot_chunk *ca = a->chunks[ia];
+        const snapshot_chunk *cb = b->chunks[ib];
+        size_t span = ca->len - off_a < cb->len - off_b ? ca->len - off_a : cb->len - off_b;
+        if (span > limit - same) span = limit - same;
+        if (ca != cb || off_a != off_b) {
+            const char *pa = ca->data + off_a;
+            const char *pb = cb->data + off_b;
+            if (memcmp(pa, pb, span) != 0) {
+                size_t k = 0;
+                while (pa[k] == pb[k]) k++;
+                return same + k;
+            }
+        }
+        same += span;
+        off_a += span;
+        off_b += span;
+        if (off_a == ca->len) { ia++; off_a = 0; }
+        if (off_b == cb->len) { ib++; off_b = 0; }
+    }
+    return same;
+}
+
+// same going backward from just before end_a and end_b
+static size_t common_backward(const doc_snapshot *a, size_t end_a, const doc_snapshot *b, size_t end_b, size_t limit) {
+    size_t same = 0;
+    while (same < limit) {
+        // locate the chunks holding the bytes just before the current ends
+        size_t off_a, off_b;
+        size_t ia = chunk_at(a, end_a - same - 1, &off_a);
+        size_t ib = chunk_at(b, end_b - same - 1, &off_b);
+        const snapshot_chunk *ca = a->chunks[ia];
+        const snapshot_chunk *cb = b->chunks[ib];
+        // off is the last byte of the run, compare off + 1 bytes back from there
+        size_t span = off_a < off_b ? off_a + 1 : off_b + 1;
+        if (span > limit - same) span = limit - same;
+        if (ca != cb || off_a != off_b) {
+            const char *pa = ca->data + off_a + 1 - span;
+            const char *pb = cb->data + off_b + 1 - span;
+            if (memcmp(pa, pb, span) != 0) {
+                size_t k = 0;
+                while (pa[span - 1 - k] == pb[span - 1 - k]) k++;
+                return same + k;
+            }
+        }
+        same += span;
+    }
+    return same;
+}
+
+void snapshot_diff(const doc_snapshot *from, size_t from_len, const doc_snapshot *to, size_t to_len,
+                   size_t *prefix_out, size_t *suffix_out) {
+    if (from_len > from->flat_len) from_len = from->flat_len;
+    if (to_len > to->flat_len) to_len = to->flat_len;
+    size_t shorter = from_len < to_len ? from_len : to_len;
+
+    size_t prefix = common_forward(from, 0, to, 0, shorter);
+    size_t suffix = common_backward(from, from_len, to, to_len, shorter - prefix);
+    *prefix_out = prefix;
+    *suffix_out = suffix;
+}
@@ -0,0 +1,78 @@
+#define _GNU_SOURCE
+#include "../libs/stats.h"
+#include <time.h>
+
+#define SUB_COUNT (1u << STATS_SUB_BITS)
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static size_t bucket_of(uint64_t v) {
+    if (v < SUB_COUNT) return (size_t)v;
+    // shift drops all but the STATS_SUB_BITS bits below the highest set one
+    unsigned shift = (unsigned)(63 - __builtin_clzll(v)) - STATS_SUB_BITS;
+    return SUB_COUNT + ((size_t)shift << STATS_SUB_BITS) + (size_t)((v >> shift) & (SUB_COUNT - 1));
+}
+
+// largest value that lands in bucket i
+static uint64_t bucket_top(size_t i) {
+    if (i < SUB_COUNT) return i;
+    unsigned shift = (unsigned)((i - SUB_COUNT) >> STATS_SUB_BITS);
+    uint64_t sub = (i - SUB_COUNT) & (SUB_COUNT - 1);
+    return ((SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+void stats_record(stats_hist *h, uint64_t value) {
+    if (value > STATS_MAX_VALUE) value = STATS_MAX_VALUE;
+    atomic_fetch_add_explicit(&h->counts[bucket_of(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value > max &&
+           !atomic_compare_exchange_weak_explicit(&h->max, &max, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+uint64_t stats_record_since(stats_hist *h, uint64_t since) {
+    uint64_t took = stats_now() - since;
+    stats_record(h, took);
+    return took;
+}
+
+uint64_t stats_percentile(stats_hist *h, double q) {
+    uint64_t counts[STATS_BUCKETS];
+    uint64_t total = 0;
+    // the sum of the copies rather than h->total, so a record landing meanwhile cannot push the rank past them
+    for (size_t i = 0; i < STATS_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(q * (double)total + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > total) rank = total;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(i);
+            uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+            return top < max ? top : max;
+        }
+    }
+    return bucket_top(STATS_BUCKETS - 1);
+}
+
+void stats_print(FILE *out, const char *name, stats_hist *h) {
+    uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+    if (total == 0) return;
+    uint64_t sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+    fprintf(out, "%-24s count %llu mean %llu p50 %llu p99 %llu p999 %llu max %llu\n", name,
+            (unsigned long long)total, (unsigned long long)(sum / total),
+            (unsigned long long)stats_percentile(h, 0.5), (unsigned long long)stats_percentile(h, 0.99),
+            (unsigned long long)stats_percentile(h, 0.999),
+            (unsigned long long)atomic_load_explicit(&h->max, memory_order_relaxed));
+}
@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+#include "../libs/wal.h"
+#include "../libs/command.h"
+#include "../libs/wire.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define RECORD_HEADER 8
+#define RECORD_FIXED 12
+#define SNAP_MAGIC "ZOITSNP1"
+#define SNAP_HEADER 36
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+// CRC-32 (IEEE) of data, continuing from crc (0 to start)
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    crc = ~crc;
+    while (len--) crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static int write_full(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Append data and sync it. If either fails, cut the file back to where it ended so it holds no torn record
+static int append_synced(int fd, const char *data, size_t len) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("wal_writer");
+        return -1;
+    }
+    if (write_full(fd, data, len) == 0 && fdatasync(fd) == 0) return 0;
+    perror("wal_writer");
+    if (ftruncate(fd, st.st_size) != 0 || fdatasync(fd) != 0) perror("wal_writer: cutting off the torn tail");
+    return -1;
+}
+
+// whole file into memory, NULL if there is none
+static char *read_file(const char *path, size_t *len_out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fd, &st) == 0 && (data = malloc((size_t)st.st_size + 1))) {
+        size_t len = 0;
+        while (len < (size_t)st.st_size) {
+            ssize_t n = read(fd, data + len, (size_t)st.st_size - len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            len += (size_t)n;
+        }
+        *len_out = len;
+    }
+    close(fd);
+    return data;
+}
+
+// fsync the directory path lives in, so a rename into it survives a crash
+static void sync_parent_dir(const char *path) {
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash) slash[slash == dir ? 1 : 0] = '\0';
+    else strcpy(dir, ".");
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return;
+    fsync(fd);
+    close(fd);
+}
+
+// === Snapshots ===
+
+typedef struct {
+    int fd;
+    uint32_t crc;
+} snap_writer;
+
+static int snap_write_piece(void *ctx, const char *data, size_t len) {
+    snap_writer *sw = ctx;
+    sw->crc = crc32_update(sw->crc, data, len);
+    return write_full(sw->fd, data, len);
+}
+
+// Per line: LEB128 length, type byte, LEB128 metadata. Flushed to the file whenever the buffer runs low
+static int write_line_shapes(snap_writer *sw, const line_shape *lines, size_t count) {
+    char buf[4096];
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (used > sizeof(buf) - (2 * WIRE_VARINT_MAX + 1)) {
+            if (snap_write_piece(sw, buf, used) != 0) return -1;
+            used = 0;
+        }
+        used += wire_put_varint(buf + used, lines[i].length);
+        buf[used++] = (char)lines[i].type;
+        used += wire_put_varint(buf + used, (uint32_t)lines[i].metadata);
+    }
+    return snap_write_piece(sw, buf, used);
+}
+
+// magic, version, text length, line count, CRC32 of the rest, then the flattened text and every line's shape
+static int write_snapshot(wal *w, const doc_snapshot *snap, const line_shape *lines, size_t line_count) {
+    int fd = open(w->snap_tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    char header[SNAP_HEADER] = { 0 };
+    snap_writer sw = { fd, 0 };
+    int rc = -1;
+    if (write_full(fd, header, SNAP_HEADER) == 0 && snapshot_for_each(snap, 0, snap->flat_len, snap_write_piece, &sw) == 0 &&
+        write_line_shapes(&sw, lines, line_count) == 0) {
+        uint64_t version = snap->version;
+        uint64_t len = snap->flat_len;
+        uint64_t count = line_count;
+        memcpy(header, SNAP_MAGIC, 8);
+        memcpy(header + 8, &version, 8);
+        memcpy(header + 16, &len, 8);
+        memcpy(header + 24, &count, 8);
+        memcpy(header + 32, &sw.crc, 4);
+        if (pwrite(fd, header, SNAP_HEADER, 0) == SNAP_HEADER && fdatasync(fd) == 0) rc = 0;
+    }
+    if (close(fd) != 0) rc = -1;
+    if (rc == 0 && rename(w->snap_tmp_path, w->snap_path) != 0) rc = -1;
+    if (rc != 0) {
+        unlink(w->snap_tmp_path);
+        return -1;
+    }
+    sync_parent_dir(w->snap_path);
+    return 0;
+}
+
+// The snapshot as a document, NULL if there is no valid one
+static document *load_snapshot(const char *path) {
+    size_t len = 0;
+    char *data = read_file(path, &len);
+    if (!data) return NULL;
+    document *doc = NULL;
+    uint64_t version, text_len, count;
+    uint32_t crc;
+    line_shape *lines = NULL;
+    if (len >= SNAP_HEADER && memcmp(data, SNAP_MAGIC, 8) == 0) {
+        memcpy(&version, data + 8, 8);
+        memcpy(&text_len, data + 16, 8);
+        memcpy(&count, data + 24, 8);
+        memcpy(&crc, data + 32, 4);
+        // every line takes at least three bytes after the text
+        bool sane = text_len <= len - SNAP_HEADER && count <= (len - SNAP_HEADER - text_len) / 3 &&
+                    crc32_update(0, data + SNAP_HEADER, len - SNAP_HEADER) == crc;
+        lines = sane ? malloc((count ? count : 1) * sizeof(line_shape)) : NULL;
+        if (lines) {
+            const char *p = data + SNAP_HEADER + text_len;
+            const char *end = data + len;
+            uint64_t covered = 0;
+            for (uint64_t i = 0; i < count && sane; i++) {
+                uint64_t length, metadata;
+                sane = wire_get_varint(&p, end, &length) && p < end;
+                if (!sane) break;
+                lines[i].type = (line_type)(unsigned char)*p++;
+                sane = wire_get_varint(&p, end, &metadata);
+                lines[i].length = (size_t)length;
+                lines[i].metadata = (int)(uint32_t)metadata;
+                covered += length + (i > 0);
+            }
+            // the lines and their separators have to cover the text exactly
+            if (sane && covered == text_len && p == end) {
+                doc = markdown_load(data + SNAP_HEADER, lines, (size_t)count, version);
+            }
+        }
+    }
+    free(lines);
+    if (!doc) fprintf(stderr, "wal: %s is damaged, ignoring it\n", path);
+    free(data);
+    return doc;
+}
+
+// === Replay ===
+
+// how a log file's replay ended
+typedef enum {
+    REPLAY_COMPLETE,
+    // the last record was cut short or damaged, what a crash in the middle of writing it leaves behind
+    REPLAY_TORN,
+    // a damaged record with more after it, or one that does not follow on: history is missing
+    REPLAY_BROKEN
+} replay_end;
+
+// Apply the records of one log file that follow doc's version. Returns how many were replayed, and stops at
+// the first record that is torn, damaged or does not follow on
+static uint64_t replay_file(const char *path, document *doc, replay_end *end) {
+    size_t len = 0;
+    char *data = read_file(path, &len);
+    *end = REPLAY_COMPLETE;
+    if (!data) return 0;
+
+    static char line[65536 + 1];
+    uint64_t replayed = 0;
+    size_t at = 0;
+    while (at < len) {
+        uint32_t payload, crc;
+        uint64_t version;
+        uint32_t count;
+        // a header that is cut short or makes no sense leaves nothing to find the next record by
+        *end = REPLAY_TORN;
+        if (len - at < RECORD_HEADER) break;
+        memcpy(&payload, data + at, 4);
+        memcpy(&crc, data + at + 4, 4);
+        if (payload < RECORD_FIXED || payload > len - at - RECORD_HEADER) break;
+        const char *p = data + at + RECORD_HEADER;
+        if (crc32_update(0, p, payload) != crc) {
+            if (at + RECORD_HEADER + payload < len) *end = REPLAY_BROKEN;
+            break;
+        }
+        memcpy(&version, p, 8);
+        memcpy(&count, p + 8, 4);
+        *end = REPLAY_COMPLETE;
+        if (version <= doc->version) {
+            at += RECORD_HEADER + payload;
+            continue;
+        }
+        if (version != doc->version + 1) {
+            fprintf(stderr, "wal: %s holds version %llu next, the document is at %llu\n", path,
+                    (unsigned long long)version, (unsigned long long)doc->version);
+            *end = REPLAY_BROKEN;
+            break;
+        }
+
+        // payload was checked whole, so the lengths inside it can be trusted
+        const char *q = p + RECORD_FIXED;
+        for (uint32_t i = 0; i < count; i++) {
+            uint16_t n;
+            memcpy(&n, q, 2);
+            memcpy(line, q + 2, n);
+            line[n] = '\0';
+            q += 2 + n;
+            parsed_command cmd;
+            if (command_parse(line, &cmd) == NULL) command_apply(doc, doc->version, &cmd);
+        }
+        markdown_commit(doc);
+        replayed++;
+        at += RECORD_HEADER + payload;
+    }
+    if (at < len) fprintf(stderr, "wal: %s stops being usable %zu bytes in, %zu bytes after it\n", path, at, len - at);
+    free(data);
+    return replayed;
+}
+
+// === Writer ===
+
+// Everything the writer is handed goes to the log in order and is synced before the next batch is taken.
+// Once the log failed, batches are dropped without touching the file
+static void *wal_writer(void *arg) {
+    wal *w = arg;
+    conn_buf batch;
+    conn_buf_init(&batch);
+
+    pthread_mutex_lock(&w->mutex);
+    while (1) {
+        while (!w->stop && w->pending.len == 0 && !w->cut) pthread_cond_wait(&w->work, &w->mutex);
+        if (w->stop && w->pending.len == 0 && !w->cut) break;
+        // the records sealed meanwhile are the next group
+        conn_buf swap = batch;
+        batch = w->pending;
+        w->pending = swap;
+        uint64_t sealed = w->sealed;
+        doc_snapshot *cut = w->cut;
+        line_shape *cut_lines = w->cut_lines;
+        size_t cut_line_count = w->cut_line_count;
+        size_t cut_at = w->cut_at;
+        w->cut = NULL;
+        w->cut_lines = NULL;
+        bool failed = w->failed;
+        pthread_mutex_unlock(&w->mutex);
+
+        const char *data = conn_buf_head(&batch);
+        size_t head = cut ? cut_at : batch.len;
+        int rc = failed ? -1 : append_synced(w->fd, data, head);
+        if (rc == 0 && cut && access(w->old_path, F_OK) == 0) {
+            // the last snapshot failed, the old log is still needed and this one keeps everything
+            rc = append_synced(w->fd, data + head, batch.len - head);
+            if (rc == 0 && write_snapshot(w, cut, cut_lines, cut_line_count) == 0) unlink(w->old_path);
+        } else if (rc == 0 && cut) {
+            // the records up to the cut stay in the old log until the snapshot is safely in place
+            rc = rename(w->path, w->old_path);
+            int fd = rc == 0 ? open(w->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644) : -1;
+            if (fd == -1) {
+                perror("wal_writer: starting a new log");
+                rc = -1;
+            } else {
+                close(w->fd);
+                w->fd = fd;
+                sync_parent_dir(w->path);
+                rc = append_synced(w->fd, data + head, batch.len - head);
+                if (rc == 0 && write_snapshot(w, cut, cut_lines, cut_line_count) == 0) unlink(w->old_path);
+            }
+        }
+        if (cut) snapshot_release(cut);
+        free(cut_lines);
+        conn_buf_consume(&batch, batch.len);
+
+        pthread_mutex_lock(&w->mutex);
+        if (rc != 0 && !failed) {
+            fprintf(stderr, "wal: logging stopped, edits from now on will not survive a restart\n");
+            w->failed = true;
+        }
+        // whatever was in this group is not on disk, and neither is anything after it
+        if (!w->failed) w->durable = sealed;
+        w->fsyncs++;
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    conn_buf_free(&batch);
+    return NULL;
+}
+
+// === Logging ===
+
+// Ask the writer to cut the log at everything sealed so far, caller holds w->mutex
+static void request_cut(wal *w, document *doc) {
+    size_t count;
+    line_shape *lines = markdown_line_shapes(doc, &count);
+    doc_snapshot *snap = lines ? markdown_snapshot(doc) : NULL;
+    if (!snap) {
+        free(lines);
+        return;
+    }
+    if (w->cut) snapshot_release(w->cut);
+    free(w->cut_lines);
+    w->cut = snap;
+    w->cut_lines = lines;
+    w->cut_line_count = count;
+    w->cut_at = w->pending.len;
+    w->cut_version = doc->version;
+    w->log_bytes = 0;
+    pthread_cond_signal(&w->work);
+}
+
+int wal_open(wal *w, const char *log_path, const char *snap_path, document **doc) {
+    pthread_once(&crc_once, crc_init);
+    memset(w, 0, sizeof(*w));
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->done, NULL);
+    conn_buf_init(&w->staged);
+    conn_buf_init(&w->pending);
+    w->fd = -1;
+    snprintf(w->path, sizeof(w->path), "%s", log_path);
+    snprintf(w->old_path, sizeof(w->old_path), "%s.old", log_path);
+    snprintf(w->snap_path, sizeof(w->snap_path), "%s", snap_path);
+    snprintf(w->snap_tmp_path, sizeof(w->snap_tmp_path), "%s.tmp", snap_path);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    *doc = load_snapshot(w->snap_path);
+    if (!*doc) *doc = markdown_init();
+    if (!*doc) {
+        perror("wal_open");
+        return -1;
+    }
+    uint64_t snap_version = (*doc)->version;
+    replay_end old_end, end;
+    // after a torn old log the newer one does not follow on, and says so
+    uint64_t replayed = replay_file(w->old_path, *doc, &old_end);
+    replayed += replay_file(w->path, *doc, &end);
+    if (old_end == REPLAY_BROKEN || end == REPLAY_BROKEN) {
+        // a fresh snapshot and an empty log would throw away the only copy of what is missing
+        fprintf(stderr, "wal: committed versions are missing from %s, %s and %s, not starting over them. Move them "
+                        "aside to start from what is left\n", w->snap_path, w->old_path, w->path);
+        markdown_free(*doc);
+        *doc = NULL;
+        return -1;
+    }
+    bool had_old = access(w->old_path, F_OK) == 0;
+
+    // what was replayed goes into a snapshot, so the log starts out empty and without a torn tail
+    int flags = O_APPEND;
+    if (replayed > 0 || old_end == REPLAY_TORN || end == REPLAY_TORN || had_old) {
+        size_t count;
+        line_shape *lines = markdown_line_shapes(*doc, &count);
+        doc_snapshot *snap = lines ? markdown_snapshot(*doc) : NULL;
+        int rc = snap ? write_snapshot(w, snap, lines, count) : -1;
+        if (snap) snapshot_release(snap);
+        free(lines);
+        if (rc != 0) {
+            perror("wal_open: cannot write a snapshot, edits will not survive a restart");
+            return -1;
+        }
+        unlink(w->old_path);
+        flags = O_TRUNC | O_APPEND;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (snap_version > 0 || replayed > 0) {
+        printf("[SERVER] Recovered version %llu: snapshot of version %llu and %llu logged commits in %.1f ms\n",
+               (unsigned long long)(*doc)->version, (unsigned long long)snap_version, (unsigned long long)replayed,
+               (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    }
+
+    w->fd = open(w->path, O_WRONLY | O_CREAT | flags | O_CLOEXEC, 0644);
+    if (w->fd == -1) {
+        perror("wal_open: edits will not survive a restart");
+        return -1;
+    }
+    w->cut_version = (*doc)->version;
+    if (pthread_create(&w->writer, NULL, wal_writer, w) != 0) {
+        close(w->fd);
+        w->fd = -1;
+        return -1;
+    }
+    w->enabled = true;
+    return 0;
+}
+
+void wal_stage(wal *w, const char *command) {
+    if (!w->enabled) return;
+    size_t len = strcspn(command, "\r\n");
+    if (len > UINT16_MAX) len = UINT16_MAX;
+    uint16_t n = (uint16_t)len;
+    // only the caller's lock guards staged, the writer never looks at it
+    size_t before = w->staged.len;
+    if (conn_buf_append(&w->staged, &n, 2) == 0 && conn_buf_append(&w->staged, command, len) == 0) {
+        w->staged_count++;
+    } else {
+        // the commit would not replay to the same document, wal_commit stops the log instead
+        perror("wal_stage");
+        w->staged.len = before;
+        w->staged_lost = true;
+    }
+}
+
+void wal_commit(wal *w, document *doc) {
+    if (!w->enabled) return;
+    uint64_t version = doc->version;
+    uint32_t payload = (uint32_t)(RECORD_FIXED + w->staged.len);
+    uint32_t crc = crc32_update(0, &version, 8);
+    crc = crc32_update(crc, &w->staged_count, 4);
+    crc = crc32_update(crc, conn_buf_head(&w->staged), w->staged.len);
+
+    char header[RECORD_HEADER + RECORD_FIXED];
+    memcpy(header, &payload, 4);
+    memcpy(header + 4, &crc, 4);
+    memcpy(header + 8, &version, 8);
+    memcpy(header + 16, &w->staged_count, 4);
+
+    pthread_mutex_lock(&w->mutex);
+    // a record that is left out or half appended breaks the history for every one after it
+    size_t before = w->pending.len;
+    bool sealed = !w->failed && !w->staged_lost && conn_buf_append(&w->pending, header, sizeof(header)) == 0 &&
+                  conn_buf_append(&w->pending, conn_buf_head(&w->staged), w->staged.len) == 0;
+    if (!sealed) {
+        w->pending.len = before;
+        if (!w->failed) {
+            fprintf(stderr, "wal: version %llu could not be logged, logging stopped, edits from now on will not "
+                            "survive a restart\n", (unsigned long long)version);
+            w->failed = true;
+        }
+        // whoever waits for this one is told it failed
+        pthread_cond_broadcast(&w->done);
+    }
+    conn_buf_consume(&w->staged, w->staged.len);
+    w->staged_count = 0;
+    w->staged_lost = false;
+    w->sealed++;
+    if (sealed) {
+        w->log_bytes += RECORD_HEADER + payload;
+        if (version - w->cut_version >= WAL_CHECKPOINT_VERSIONS || w->log_bytes >= WAL_CHECKPOINT_BYTES) {
+            request_cut(w, doc);
+        }
+        pthread_cond_signal(&w->work);
+    }
+    pthread_mutex_unlock(&w->mutex);
+}
+
+int wal_flush(wal *w) {
+    if (!w->enabled) return 0;
+    pthread_mutex_lock(&w->mutex);
+    uint64_t target = w->sealed;
+    while (w->durable < target && !w->failed) pthread_cond_wait(&w->done, &w->mutex);
+    int rc = w->durable >= target ? 0 : -1;
+    pthread_mutex_unlock(&w->mutex);
+    return rc;
+}
+
+bool wal_failed(wal *w) {
+    if (!w->enabled) return false;
+    pthread_mutex_lock(&w->mutex);
+    bool failed = w->failed;
+    pthread_mutex_unlock(&w->mutex);
+    return failed;
+}
+
+void wal_close(wal *w, document *doc) {
+    if (!w->enabled) return;
+    pthread_mutex_lock(&w->mutex);
+    if (doc->version != w->cut_version) request_cut(w, doc);
+    w->stop = true;
+    pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->writer, NULL);
+    close(w->fd);
+    w->fd = -1;
+    w->enabled = false;
+}
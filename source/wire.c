@@ -0,0 +1,46 @@
+#include "../libs/wire.h"
+
+size_t wire_put_varint(char *buf, uint64_t v) {
+    size_t n = 0;
+    do {
+        buf[n++] = (char)((v & 0x7f) | (v > 0x7f ? 0x80 : 0));
+        v >>= 7;
+    } while (v);
+    return n;
+}
+
+bool wire_get_varint(const char **p, const char *end, uint64_t *out) {
+    const char *s = *p;
+    uint64_t v = 0;
+    for (int shift = 0; s < end && shift < 64; shift += 7) {
+        unsigned char b = (unsigned char)*s++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *p = s;
+            *out = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t wire_frame_header(char *buf, wire_op op, uint64_t payload_len) {
+    size_t n = wire_put_varint(buf, payload_len + 1);
+    buf[n++] = (char)op;
+    return n;
+}
+
+size_t wire_frame(const char *data, size_t len, size_t limit, const char **body, size_t *body_len) {
+    const char *p = data;
+    uint64_t size;
+    if (!wire_get_varint(&p, data + len, &size)) {
+        // a length that cannot finish within its ten bytes never will
+        return len >= WIRE_VARINT_MAX ? (size_t)-1 : 0;
+    }
+    size_t header = (size_t)(p - data);
+    if (size == 0 || size > limit) return (size_t)-1;
+    if (len - header < size) return 0;
+    *body = p;
+    *body_len = (size_t)size;
+    return header + (size_t)size;
+}